@@ -0,0 +1,429 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "aesgcm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#include <emmintrin.h>
+
+#define AESGCM_TARGET __attribute__((target("aes,pclmul,ssse3,sse2")))
+
+/*
+ * GHASH works on bit reflected values. Blocks are byte reversed on
+ * load, which leaves a one bit shift for the multiplication, as in
+ * the Intel carry-less multiplication white paper.
+ */
+static inline AESGCM_TARGET __m128i aesgcm_bswap(__m128i x)
+{
+	const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+		8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(x, mask);
+}
+
+/* Accumulate the unreduced 256 bit product a * b into hi:lo */
+static inline AESGCM_TARGET void aesgcm_clmul(__m128i a, __m128i b,
+	__m128i *lo, __m128i *hi)
+{
+	__m128i t0, t1, t2;
+
+	t0 = _mm_clmulepi64_si128(a, b, 0x00);
+	t1 = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+		_mm_clmulepi64_si128(a, b, 0x01));
+	t2 = _mm_clmulepi64_si128(a, b, 0x11);
+
+	*lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+	*hi = _mm_xor_si128(*hi, _mm_xor_si128(t2, _mm_srli_si128(t1, 8)));
+}
+
+/*
+ * Shift hi:lo left by one and reduce modulo x^128 + x^7 + x^2 + x + 1.
+ * Being linear, it can be done once for a sum of products.
+ */
+static inline AESGCM_TARGET __m128i aesgcm_reduce(__m128i lo, __m128i hi)
+{
+	__m128i t7, t8, t9, t2, t4, t5;
+
+	t7 = _mm_srli_epi32(lo, 31);
+	t8 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	lo = _mm_or_si128(lo, t7);
+	hi = _mm_or_si128(hi, t8);
+	hi = _mm_or_si128(hi, t9);
+
+	t7 = _mm_slli_epi32(lo, 31);
+	t8 = _mm_slli_epi32(lo, 30);
+	t9 = _mm_slli_epi32(lo, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	lo = _mm_xor_si128(lo, t7);
+
+	t2 = _mm_srli_epi32(lo, 1);
+	t4 = _mm_srli_epi32(lo, 2);
+	t5 = _mm_srli_epi32(lo, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	lo = _mm_xor_si128(lo, t2);
+
+	return _mm_xor_si128(hi, lo);
+}
+
+static inline AESGCM_TARGET __m128i aesgcm_mul(__m128i a, __m128i b)
+{
+	__m128i lo = _mm_setzero_si128();
+	__m128i hi = _mm_setzero_si128();
+
+	aesgcm_clmul(a, b, &lo, &hi);
+
+	return aesgcm_reduce(lo, hi);
+}
+
+static inline AESGCM_TARGET __m128i aesgcm_encrypt(const struct aesni_ctx *aes,
+	__m128i b)
+{
+	const __m128i *rk = (const __m128i *) aes->rk;
+	int r;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (r = 1; r < aes->rounds; r++)
+		b = _mm_aesenc_si128(b, rk[r]);
+
+	return _mm_aesenclast_si128(b, rk[aes->rounds]);
+}
+
+/* One block, possibly partial, into the hash */
+static inline AESGCM_TARGET __m128i aesgcm_ghash_block(__m128i acc,
+	__m128i h, const unsigned char *in, unsigned int len)
+{
+	unsigned char buf[16];
+	__m128i x;
+
+	if (len < 16) {
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, in, len);
+		in = buf;
+	}
+
+	x = aesgcm_bswap(_mm_loadu_si128((const __m128i *) in));
+
+	return aesgcm_mul(_mm_xor_si128(acc, x), h);
+}
+
+AESGCM_TARGET int aesgcm_init(struct aesgcm_ctx *ctx, const unsigned char *key,
+	int key_len)
+{
+	static const unsigned char zero[16];
+	__m128i *htab = (__m128i *) ctx->htab;
+	__m128i h;
+
+	int x;
+
+	/* CTR setup doubles as key expansion, the counter is unused */
+	if (aesni_ctr_init(&ctx->aes, key, key_len, zero) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	h = aesgcm_bswap(aesgcm_encrypt(&ctx->aes, _mm_setzero_si128()));
+
+	htab[0] = h;
+	for (x = 1; x < AESGCM_PARALLEL; x++)
+		htab[x] = aesgcm_mul(htab[x - 1], h);
+
+	return MACSSH_SUCCESS;
+}
+
+/*
+ * CTR encryption from J0 + 1 with GHASH over the ciphertext. Full
+ * batches of AESGCM_PARALLEL blocks hash a batch of ciphertext while
+ * the AES rounds of the next run: when decrypting the ciphertext is
+ * the input of the same batch, when encrypting it is the output of
+ * the previous one. The GHASH of a batch is folded with H^n .. H^1
+ * and reduced once.
+ */
+static AESGCM_TARGET void aesgcm_crypt(struct aesgcm_ctx *ctx,
+	const unsigned char *iv, const unsigned char *aad,
+	unsigned int aad_len, const unsigned char *in, unsigned char *out,
+	unsigned int len, unsigned char *tag, int encrypt)
+{
+	const __m128i *rk = (const __m128i *) ctx->aes.rk;
+	const __m128i *htab = (const __m128i *) ctx->htab;
+	const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+	const unsigned char *pending = NULL;
+	unsigned char j0[16];
+	__m128i ctr, acc, ek0;
+	__m128i b[AESGCM_PARALLEL], x[AESGCM_PARALLEL];
+	__m128i lo, hi, k;
+	unsigned int done, num;
+	int i, r;
+
+	memcpy(j0, iv, AESGCM_IV_LEN);
+	memset(j0 + AESGCM_IV_LEN, 0, 3);
+	j0[15] = 1;
+
+	/* Byte reversed, the 32 bit counter is the low lane */
+	ctr = aesgcm_bswap(_mm_loadu_si128((const __m128i *) j0));
+	ek0 = aesgcm_encrypt(&ctx->aes, aesgcm_bswap(ctr));
+
+	acc = _mm_setzero_si128();
+	for (done = 0; done < aad_len; done += 16)
+		acc = aesgcm_ghash_block(acc, htab[0], aad + done,
+			MIN(16, aad_len - done));
+
+	for (done = 0; len - done >= 16 * AESGCM_PARALLEL;
+		done += 16 * AESGCM_PARALLEL) {
+
+		const unsigned char *src = encrypt ? pending : in + done;
+
+		k = rk[0];
+		for (i = 0; i < AESGCM_PARALLEL; i++) {
+			ctr = _mm_add_epi32(ctr, one);
+			b[i] = _mm_xor_si128(aesgcm_bswap(ctr), k);
+		}
+
+		if (src) {
+			for (i = 0; i < AESGCM_PARALLEL; i++)
+				x[i] = aesgcm_bswap(_mm_loadu_si128(
+					(const __m128i *) (src + 16 * i)));
+			x[0] = _mm_xor_si128(x[0], acc);
+		}
+
+		lo = _mm_setzero_si128();
+		hi = _mm_setzero_si128();
+
+		/* At least ten rounds, enough to hide eight multiplies */
+		for (r = 1; r < ctx->aes.rounds; r++) {
+			k = rk[r];
+			for (i = 0; i < AESGCM_PARALLEL; i++)
+				b[i] = _mm_aesenc_si128(b[i], k);
+
+			if (src && r <= AESGCM_PARALLEL)
+				aesgcm_clmul(x[r - 1],
+					htab[AESGCM_PARALLEL - r], &lo, &hi);
+		}
+
+		if (src)
+			acc = aesgcm_reduce(lo, hi);
+
+		k = rk[ctx->aes.rounds];
+		for (i = 0; i < AESGCM_PARALLEL; i++) {
+			__m128i p = _mm_loadu_si128(
+				(const __m128i *) (in + done + 16 * i));
+
+			b[i] = _mm_aesenclast_si128(b[i], k);
+			_mm_storeu_si128((__m128i *) (out + done + 16 * i),
+				_mm_xor_si128(b[i], p));
+		}
+
+		pending = out + done;
+	}
+
+	/* Last full batch of ciphertext, when encrypting */
+	if (encrypt && pending) {
+		lo = _mm_setzero_si128();
+		hi = _mm_setzero_si128();
+
+		for (i = 0; i < AESGCM_PARALLEL; i++) {
+			x[i] = aesgcm_bswap(_mm_loadu_si128(
+				(const __m128i *) (pending + 16 * i)));
+			if (i == 0)
+				x[i] = _mm_xor_si128(x[i], acc);
+
+			aesgcm_clmul(x[i], htab[AESGCM_PARALLEL - 1 - i], &lo,
+				&hi);
+		}
+
+		acc = aesgcm_reduce(lo, hi);
+	}
+
+	/* Remaining blocks, one at a time */
+	for (; done < len; done += num) {
+		unsigned char ks[16];
+
+		num = MIN(16, len - done);
+
+		if (!encrypt)
+			acc = aesgcm_ghash_block(acc, htab[0], in + done, num);
+
+		ctr = _mm_add_epi32(ctr, one);
+		_mm_storeu_si128((__m128i *) ks,
+			aesgcm_encrypt(&ctx->aes, aesgcm_bswap(ctr)));
+
+		for (i = 0; i < num; i++)
+			out[done + i] = in[done + i] ^ ks[i];
+
+		if (encrypt)
+			acc = aesgcm_ghash_block(acc, htab[0], out + done, num);
+	}
+
+	/* Bit lengths of aad and ciphertext */
+	k = _mm_set_epi64x((long long) aad_len * 8, (long long) len * 8);
+	acc = aesgcm_mul(_mm_xor_si128(acc, k), htab[0]);
+
+	_mm_storeu_si128((__m128i *) tag,
+		_mm_xor_si128(aesgcm_bswap(acc), ek0));
+}
+
+void aesgcm_seal(struct aesgcm_ctx *ctx, const unsigned char *iv,
+	const unsigned char *aad, unsigned int aad_len,
+	const unsigned char *in, unsigned char *out, unsigned int len,
+	unsigned char *tag)
+{
+	aesgcm_crypt(ctx, iv, aad, aad_len, in, out, len, tag, 1);
+}
+
+int aesgcm_open(struct aesgcm_ctx *ctx, const unsigned char *iv,
+	const unsigned char *aad, unsigned int aad_len,
+	const unsigned char *in, unsigned char *out, unsigned int len,
+	const unsigned char *tag)
+{
+	unsigned char calc[AESGCM_TAG_LEN];
+	unsigned char d = 0;
+
+	aesgcm_crypt(ctx, iv, aad, aad_len, in, out, len, calc, 0);
+
+	/* Constant time compare */
+	int x;
+	for (x = 0; x < AESGCM_TAG_LEN; x++)
+		d |= calc[x] ^ tag[x];
+
+	return d ? MACSSH_FAILURE : MACSSH_SUCCESS;
+}
+
+/* Test case 4 from the GCM specification, then a long message */
+static int aesgcm_selftest()
+{
+	static const unsigned char key[16] = {
+		0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+		0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08
+	};
+	static const unsigned char iv[12] = {
+		0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad,
+		0xde, 0xca, 0xf8, 0x88
+	};
+	static const unsigned char aad[20] = {
+		0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+		0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+		0xab, 0xad, 0xda, 0xd2
+	};
+	static const unsigned char pt[60] = {
+		0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5,
+		0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+		0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda,
+		0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+		0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53,
+		0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+		0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57,
+		0xba, 0x63, 0x7b, 0x39
+	};
+	static const unsigned char ct[60] = {
+		0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24,
+		0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+		0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0,
+		0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+		0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c,
+		0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+		0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97,
+		0x3d, 0x58, 0xe0, 0x91
+	};
+	static const unsigned char tag[16] = {
+		0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb,
+		0x94, 0xfa, 0xe9, 0x5a, 0xe7, 0x12, 0x1a, 0x47
+	};
+	unsigned char buf[16 * (2 * AESGCM_PARALLEL + 1)];
+	unsigned char out[sizeof(buf)];
+	unsigned char t[16];
+	struct aesgcm_ctx ctx;
+
+	aesgcm_init(&ctx, key, sizeof(key));
+
+	aesgcm_seal(&ctx, iv, aad, sizeof(aad), pt, out, sizeof(pt), t);
+	if (memcmp(out, ct, sizeof(ct)) || memcmp(t, tag, sizeof(tag)))
+		return 0;
+
+	/* Batched code must agree with itself both ways */
+	int x;
+	for (x = 0; x < sizeof(buf); x++)
+		buf[x] = x;
+
+	aesgcm_seal(&ctx, iv, aad, sizeof(aad), buf, out, sizeof(buf), t);
+	if (aesgcm_open(&ctx, iv, aad, sizeof(aad), out, out, sizeof(buf),
+		t) != MACSSH_SUCCESS || memcmp(out, buf, sizeof(buf)))
+		return 0;
+
+	return 1;
+}
+
+int aesgcm_available()
+{
+	static int available = -1;
+	unsigned int a, b, c, d;
+
+	if (available >= 0)
+		return available;
+
+	available = 0;
+
+	if (aesni_available() && __get_cpuid(1, &a, &b, &c, &d) &&
+		(c & bit_PCLMUL) && (c & bit_SSSE3))
+		available = aesgcm_selftest();
+
+	return available;
+}
+
+#else
+
+int aesgcm_available()
+{
+	return 0;
+}
+
+int aesgcm_init(struct aesgcm_ctx *ctx, const unsigned char *key,
+	int key_len)
+{
+	return MACSSH_FAILURE;
+}
+
+void aesgcm_seal(struct aesgcm_ctx *ctx, const unsigned char *iv,
+	const unsigned char *aad, unsigned int aad_len,
+	const unsigned char *in, unsigned char *out, unsigned int len,
+	unsigned char *tag)
+{
+}
+
+int aesgcm_open(struct aesgcm_ctx *ctx, const unsigned char *iv,
+	const unsigned char *aad, unsigned int aad_len,
+	const unsigned char *in, unsigned char *out, unsigned int len,
+	const unsigned char *tag)
+{
+	return MACSSH_FAILURE;
+}
+
+#endif
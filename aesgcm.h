@@ -0,0 +1,64 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AESGCM_H
+#define AESGCM_H
+
+#include "includes.h"
+#include "aesni.h"
+
+#define AESGCM_IV_LEN		12
+#define AESGCM_TAG_LEN		16
+
+/* Powers of H kept, GHASH is folded this many blocks at a time */
+#define AESGCM_PARALLEL		AESNI_PARALLEL
+
+/* AES-GCM on AES-NI and PCLMULQDQ */
+struct aesgcm_ctx {
+	struct aesni_ctx aes;
+
+	/* H^1 .. H^AESGCM_PARALLEL, byte reversed */
+	unsigned char htab[AESGCM_PARALLEL][16] __attribute__((aligned(16)));
+};
+
+/* Non-zero if the CPU has AES-NI and PCLMULQDQ and the tests pass */
+int aesgcm_available();
+
+int aesgcm_init(struct aesgcm_ctx *ctx, const unsigned char *key,
+	int key_len);
+
+/*
+ * Encrypt 'len' bytes from 'in' to 'out' and authenticate them along
+ * with 'aad'. The tag is written to 'tag'.
+ */
+void aesgcm_seal(struct aesgcm_ctx *ctx, const unsigned char *iv,
+	const unsigned char *aad, unsigned int aad_len,
+	const unsigned char *in, unsigned char *out, unsigned int len,
+	unsigned char *tag);
+
+/*
+ * Decrypt and check 'tag'. Returns MACSSH_FAILURE on a mismatch, the
+ * output must then be thrown away.
+ */
+int aesgcm_open(struct aesgcm_ctx *ctx, const unsigned char *iv,
+	const unsigned char *aad, unsigned int aad_len,
+	const unsigned char *in, unsigned char *out, unsigned int len,
+	const unsigned char *tag);
+
+#endif /* AESGCM_H */
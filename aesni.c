@@ -0,0 +1,280 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "aesni.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+/* Key expansion steps, as in the Intel AES-NI white paper */
+static inline AESNI_TARGET __m128i aesni_expand_128(__m128i key, __m128i gen)
+{
+	gen = _mm_shuffle_epi32(gen, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+
+	return _mm_xor_si128(key, gen);
+}
+
+static inline AESNI_TARGET __m128i aesni_expand_256b(__m128i key, __m128i prev)
+{
+	__m128i gen = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0),
+		0xaa);
+
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+
+	return _mm_xor_si128(key, gen);
+}
+
+#define EXPAND128(k, rcon) \
+	aesni_expand_128(k, _mm_aeskeygenassist_si128(k, rcon))
+
+static AESNI_TARGET void aesni_setup_128(struct aesni_ctx *ctx,
+	const unsigned char *key)
+{
+	__m128i *rk = (__m128i *) ctx->rk;
+
+	rk[0] = _mm_loadu_si128((const __m128i *) key);
+	rk[1] = EXPAND128(rk[0], 0x01);
+	rk[2] = EXPAND128(rk[1], 0x02);
+	rk[3] = EXPAND128(rk[2], 0x04);
+	rk[4] = EXPAND128(rk[3], 0x08);
+	rk[5] = EXPAND128(rk[4], 0x10);
+	rk[6] = EXPAND128(rk[5], 0x20);
+	rk[7] = EXPAND128(rk[6], 0x40);
+	rk[8] = EXPAND128(rk[7], 0x80);
+	rk[9] = EXPAND128(rk[8], 0x1b);
+	rk[10] = EXPAND128(rk[9], 0x36);
+
+	ctx->rounds = 10;
+}
+
+#define EXPAND256(n, rcon) do { \
+	rk[n] = aesni_expand_128(rk[n - 2], \
+		_mm_aeskeygenassist_si128(rk[n - 1], rcon)); \
+	rk[n + 1] = aesni_expand_256b(rk[n - 1], rk[n]); \
+} while (0)
+
+static AESNI_TARGET void aesni_setup_256(struct aesni_ctx *ctx,
+	const unsigned char *key)
+{
+	__m128i *rk = (__m128i *) ctx->rk;
+
+	rk[0] = _mm_loadu_si128((const __m128i *) key);
+	rk[1] = _mm_loadu_si128((const __m128i *) (key + 16));
+
+	EXPAND256(2, 0x01);
+	EXPAND256(4, 0x02);
+	EXPAND256(6, 0x04);
+	EXPAND256(8, 0x08);
+	EXPAND256(10, 0x10);
+	EXPAND256(12, 0x20);
+	rk[14] = aesni_expand_128(rk[12],
+		_mm_aeskeygenassist_si128(rk[13], 0x40));
+
+	ctx->rounds = 14;
+}
+
+AESNI_TARGET void aesni_encrypt_block(const struct aesni_ctx *ctx,
+	const unsigned char *in, unsigned char *out)
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	__m128i b;
+
+	b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in), rk[0]);
+
+	int r;
+	for (r = 1; r < ctx->rounds; r++)
+		b = _mm_aesenc_si128(b, rk[r]);
+
+	b = _mm_aesenclast_si128(b, rk[ctx->rounds]);
+
+	_mm_storeu_si128((__m128i *) out, b);
+}
+
+/* Increment the 128 bit big-endian counter */
+static inline void aesni_ctr_inc(unsigned char *ctr)
+{
+	int x;
+	for (x = 15; x >= 0; x--)
+		if (++ctr[x] != 0)
+			break;
+}
+
+AESNI_TARGET void aesni_ctr_keystream(struct aesni_ctx *ctx, unsigned char *out,
+	unsigned int blocks)
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	__m128i b[AESNI_PARALLEL];
+	__m128i k;
+	int x, r;
+
+	while (blocks >= AESNI_PARALLEL) {
+
+		for (x = 0; x < AESNI_PARALLEL; x++) {
+			b[x] = _mm_loadu_si128((const __m128i *) ctx->ctr);
+			aesni_ctr_inc(ctx->ctr);
+		}
+
+		k = rk[0];
+		for (x = 0; x < AESNI_PARALLEL; x++)
+			b[x] = _mm_xor_si128(b[x], k);
+
+		/* Independent blocks hide the aesenc latency */
+		for (r = 1; r < ctx->rounds; r++) {
+			k = rk[r];
+			for (x = 0; x < AESNI_PARALLEL; x++)
+				b[x] = _mm_aesenc_si128(b[x], k);
+		}
+
+		k = rk[ctx->rounds];
+		for (x = 0; x < AESNI_PARALLEL; x++) {
+			b[x] = _mm_aesenclast_si128(b[x], k);
+			_mm_storeu_si128((__m128i *) out, b[x]);
+			out += 16;
+		}
+
+		blocks -= AESNI_PARALLEL;
+	}
+
+	while (blocks--) {
+		aesni_encrypt_block(ctx, ctx->ctr, out);
+		aesni_ctr_inc(ctx->ctr);
+		out += 16;
+	}
+}
+
+int aesni_ctr_init(struct aesni_ctx *ctx, const unsigned char *key,
+	int key_len, const unsigned char *iv)
+{
+	switch (key_len) {
+	case 16:
+		aesni_setup_128(ctx, key);
+		break;
+	case 32:
+		aesni_setup_256(ctx, key);
+		break;
+	default:
+		return MACSSH_FAILURE;
+	}
+
+	memcpy(ctx->ctr, iv, 16);
+
+	return MACSSH_SUCCESS;
+}
+
+/*
+ * Known answers from FIPS-197 appendix C, run through the CTR path,
+ * with the plaintext as counter. Checks 8-way and tail code alike.
+ */
+static int aesni_selftest()
+{
+	static const unsigned char pt[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+	};
+	static const unsigned char ct128[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+	};
+	static const unsigned char ct256[16] = {
+		0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+		0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89
+	};
+	unsigned char key[32];
+	unsigned char ks[16 * (AESNI_PARALLEL + 1)];
+	unsigned char one[16];
+	struct aesni_ctx ctx;
+
+	int x;
+	for (x = 0; x < 32; x++)
+		key[x] = x;
+
+	aesni_ctr_init(&ctx, key, 16, pt);
+	aesni_ctr_keystream(&ctx, ks, AESNI_PARALLEL + 1);
+	if (memcmp(ks, ct128, 16))
+		return 0;
+
+	/* Parallel blocks must match one-at-a-time encryption */
+	memcpy(one, pt, 16);
+	for (x = 0; x < AESNI_PARALLEL + 1; x++) {
+		unsigned char b[16];
+		aesni_encrypt_block(&ctx, one, b);
+		if (memcmp(b, ks + 16 * x, 16))
+			return 0;
+		aesni_ctr_inc(one);
+	}
+
+	aesni_ctr_init(&ctx, key, 32, pt);
+	aesni_ctr_keystream(&ctx, ks, 1);
+	if (memcmp(ks, ct256, 16))
+		return 0;
+
+	return 1;
+}
+
+int aesni_available()
+{
+	static int available = -1;
+	unsigned int a, b, c, d;
+
+	if (available >= 0)
+		return available;
+
+	available = 0;
+
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES) && (d & bit_SSE2))
+		available = aesni_selftest();
+
+	return available;
+}
+
+#else
+
+int aesni_available()
+{
+	return 0;
+}
+
+int aesni_ctr_init(struct aesni_ctx *ctx, const unsigned char *key,
+	int key_len, const unsigned char *iv)
+{
+	return MACSSH_FAILURE;
+}
+
+void aesni_ctr_keystream(struct aesni_ctx *ctx, unsigned char *out,
+	unsigned int blocks)
+{
+}
+
+void aesni_encrypt_block(const struct aesni_ctx *ctx,
+	const unsigned char *in, unsigned char *out)
+{
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AESNI_H
+#define AESNI_H
+
+#include "includes.h"
+
+/* Blocks encrypted in parallel, to keep the AES pipeline full */
+#define AESNI_PARALLEL		8
+
+/* Expanded AES key and big-endian 128 bit counter */
+struct aesni_ctx {
+	unsigned char rk[15][16] __attribute__((aligned(16)));
+	int rounds;
+	unsigned char ctr[16];
+};
+
+/* Non-zero if the CPU has AES-NI and the known-answer tests pass */
+int aesni_available();
+
+int aesni_ctr_init(struct aesni_ctx *ctx, const unsigned char *key,
+	int key_len, const unsigned char *iv);
+
+/* Write 'blocks' blocks of CTR keystream to 'out' */
+void aesni_ctr_keystream(struct aesni_ctx *ctx, unsigned char *out,
+	unsigned int blocks);
+
+/* Single block ECB encryption with the expanded key */
+void aesni_encrypt_block(const struct aesni_ctx *ctx,
+	const unsigned char *in, unsigned char *out);
+
+#endif /* AESNI_H */
@@ -0,0 +1,323 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Syscalls and wakeups per packet of a bulk transfer over loopback TCP,
+ * for each event backend. One loop sends 32 KB packets on one end and
+ * drains the other, the way the session moves channel data: writev()
+ * of the send queue on epoll and poll, linked sends and a multishot
+ * receive on io_uring. Not part of the program, built by hand:
+ *
+ *	gcc -O2 -o bench-event bench-event.c -lpthread
+ *
+ * event.c and uring.c are included below, behind macros counting every
+ * syscall they and the bench make on the data path.
+ */
+
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "includes.h"
+#include "event.h"
+#include "uring.h"
+
+static unsigned long long bench_calls;
+
+#define read(...)	(bench_calls++, read(__VA_ARGS__))
+#define write(...)	(bench_calls++, write(__VA_ARGS__))
+#define writev(...)	(bench_calls++, writev(__VA_ARGS__))
+#define poll(...)	(bench_calls++, poll(__VA_ARGS__))
+#define epoll_wait(...)	(bench_calls++, epoll_wait(__VA_ARGS__))
+#define epoll_ctl(...)	(bench_calls++, epoll_ctl(__VA_ARGS__))
+#define syscall(...)	(bench_calls++, syscall(__VA_ARGS__))
+
+#include "event.c"
+#include "uring.c"
+
+#define BENCH_PKT	(32 * 1024)
+#define BENCH_PKTS	16384
+
+/* Packets queued per flush, as SESSION_IOV_MAX */
+#define BENCH_QUEUE	64
+
+#define BENCH_TOTAL	((unsigned long long) BENCH_PKT * BENCH_PKTS)
+
+struct bench {
+	int tx;
+	int rx;
+	unsigned long long sent;
+	unsigned long long recvd;
+	int inflight;
+	int failed;
+};
+
+static unsigned char bench_out[BENCH_PKT];
+static unsigned char bench_in[64 * 1024];
+
+static unsigned long long bench_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_done(struct ev_loop *loop, struct bench *b)
+{
+	if (b->recvd == BENCH_TOTAL || b->failed)
+		ev_stop(loop);
+}
+
+/* Queued bytes from 'sent' on, packet by packet */
+static int bench_fill_iov(struct bench *b, struct iovec *iov)
+{
+	unsigned long long off = b->sent;
+	int num = 0;
+
+	while (off < BENCH_TOTAL && num < BENCH_QUEUE) {
+		iov[num].iov_base = bench_out + off % BENCH_PKT;
+		iov[num].iov_len = BENCH_PKT - off % BENCH_PKT;
+		off += iov[num++].iov_len;
+	}
+
+	return num;
+}
+
+static void bench_write_cb(struct ev_loop *loop, int fd, int events,
+	void *arg)
+{
+	struct bench *b = arg;
+	struct iovec iov[BENCH_QUEUE];
+	size_t total;
+	ssize_t len;
+	int num;
+
+	while ((num = bench_fill_iov(b, iov)) > 0) {
+		total = 0;
+
+		int x;
+		for (x = 0; x < num; x++)
+			total += iov[x].iov_len;
+
+		len = writev(fd, iov, num);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				b->failed = 1;
+			break;
+		}
+
+		b->sent += len;
+
+		/* Socket buffer is full, wait for EV_WRITE */
+		if (len < total)
+			break;
+	}
+
+	if (b->sent == BENCH_TOTAL)
+		ev_mod(loop, fd, 0);
+
+	bench_done(loop, b);
+}
+
+static void bench_read_cb(struct ev_loop *loop, int fd, int events,
+	void *arg)
+{
+	struct bench *b = arg;
+	ssize_t len;
+
+	while ((len = read(fd, bench_in, sizeof(bench_in))) > 0)
+		b->recvd += len;
+
+	if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		b->failed = 1;
+
+	bench_done(loop, b);
+}
+
+static struct bench *bench_uring;
+
+static void bench_send_linked(struct ev_loop *loop, struct bench *b);
+
+static void bench_sent_cb(struct ev_loop *loop, int fd, int res, void *arg)
+{
+	struct bench *b = bench_uring;
+
+	if (res < 0)
+		b->failed = 1;
+	else
+		b->sent += res;
+
+	if (--b->inflight == 0 && !b->failed)
+		bench_send_linked(loop, b);
+
+	bench_done(loop, b);
+}
+
+/* One chain of linked sends in flight, as session_send_linked() */
+static void bench_send_linked(struct ev_loop *loop, struct bench *b)
+{
+	struct iovec iov[BENCH_QUEUE];
+	int num = bench_fill_iov(b, iov);
+
+	int x;
+	for (x = 0; x < num; x++)
+		if (ev_send(loop, b->tx, iov[x].iov_base, iov[x].iov_len,
+			x + 1 < num, &bench_sent_cb) != MACSSH_SUCCESS)
+			break;
+
+	b->inflight = x;
+	if (num && !x)
+		b->failed = 1;
+}
+
+static void bench_recv_cb(struct ev_loop *loop, int fd,
+	const unsigned char *data, int len, void *arg)
+{
+	struct bench *b = bench_uring;
+
+	if (len <= 0)
+		b->failed = 1;
+	else
+		b->recvd += len;
+
+	bench_done(loop, b);
+}
+
+static int bench_connect(int *tx, int *rx, int nonblock)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int lfd, one = 1;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return MACSSH_FAILURE;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+		listen(lfd, 1) < 0 ||
+		getsockname(lfd, (struct sockaddr *) &sin, &len) < 0)
+		goto error;
+
+	*tx = socket(AF_INET, SOCK_STREAM, 0);
+	if (*tx < 0 || connect(*tx, (struct sockaddr *) &sin,
+		sizeof(sin)) < 0)
+		goto error;
+
+	*rx = accept(lfd, NULL, NULL);
+	if (*rx < 0)
+		goto error;
+
+	close(lfd);
+
+	setsockopt(*tx, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (nonblock) {
+		fcntl(*tx, F_SETFL, fcntl(*tx, F_GETFL) | O_NONBLOCK);
+		fcntl(*rx, F_SETFL, fcntl(*rx, F_GETFL) | O_NONBLOCK);
+	}
+
+	return MACSSH_SUCCESS;
+
+error:
+	close(lfd);
+	return MACSSH_FAILURE;
+}
+
+static void bench_backend(const char *name, int backend)
+{
+	struct bench b;
+	struct ev_loop *loop;
+	unsigned long long start, ns, calls;
+	int uring = backend == EV_BACKEND_URING;
+
+	loop = ev_loop_new(backend);
+	if (!loop) {
+		printf("%-6s unavailable\n", name);
+		return;
+	}
+
+	memset(&b, 0, sizeof(b));
+
+	/* The session keeps the socket blocking for io_uring */
+	if (bench_connect(&b.tx, &b.rx, !uring) != MACSSH_SUCCESS) {
+		printf("%-6s no loopback connection\n", name);
+		ev_loop_free(loop);
+		return;
+	}
+
+	if (uring) {
+		bench_uring = &b;
+		if (ev_add(loop, b.tx, 0, &bench_write_cb, &b) !=
+			MACSSH_SUCCESS || ev_add(loop, b.rx, 0,
+			&bench_read_cb, &b) != MACSSH_SUCCESS ||
+			ev_recv_start(loop, b.rx, &bench_recv_cb) !=
+			MACSSH_SUCCESS)
+			b.failed = 1;
+	} else if (ev_add(loop, b.tx, EV_WRITE | EV_ET, &bench_write_cb,
+		&b) != MACSSH_SUCCESS || ev_add(loop, b.rx, EV_READ | EV_ET,
+		&bench_read_cb, &b) != MACSSH_SUCCESS) {
+		b.failed = 1;
+	}
+
+	bench_calls = loop->waits = loop->events = 0;
+	start = bench_ns();
+
+	if (uring && !b.failed)
+		bench_send_linked(loop, &b);
+
+	if (!b.failed)
+		ev_run(loop);
+
+	ns = bench_ns() - start;
+	calls = bench_calls;
+
+	if (b.failed)
+		printf("%-6s failed after %llu bytes\n", name, b.recvd);
+	else
+		printf("%-6s %8.1f MB/s %6.2f syscalls/packet "
+			"%6.2f wakeups/packet %6.2f events/wakeup\n", name,
+			(double) BENCH_TOTAL * 1000 / ns,
+			(double) calls / BENCH_PKTS,
+			(double) loop->waits / BENCH_PKTS,
+			(double) loop->events / loop->waits);
+
+	ev_loop_free(loop);
+	close(b.tx);
+	close(b.rx);
+}
+
+int main(int argc, char *argv[])
+{
+	printf("%d packets of %d bytes over loopback TCP\n", BENCH_PKTS,
+		BENCH_PKT);
+
+	bench_backend("epoll", EV_BACKEND_EPOLL);
+	bench_backend("poll", EV_BACKEND_POLL);
+	bench_backend("uring", EV_BACKEND_URING);
+
+	return 0;
+}
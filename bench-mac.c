@@ -0,0 +1,134 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput of every mac in hash_list, in the order kex.c prefers
+ * them, over 32 KB payloads. Not part of the program, built by hand
+ * from everything but ssh-main.c:
+ *
+ *	gcc -O2 -fcommon -o bench-mac bench-mac.c \
+ *		$(ls *.c | grep -v -e ssh-main.c -e bench-) \
+ *		-ltomcrypt -ltommath -lpthread
+ */
+
+#include <time.h>
+
+#include "includes.h"
+#include "kex.h"
+#include "mac.h"
+
+#define BENCH_LEN	(32 * 1024)
+#define BENCH_ROUNDS	4096
+
+/* Messages per mac_compute_batch(), for the macs that batch */
+#define BENCH_BATCH	8
+
+static unsigned long long bench_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, const char *how,
+	unsigned long long ns, struct mac_ctx *ctx)
+{
+	printf("%-30s %-7s %8.1f MB/s %6.2f cycles/byte\n", name, how,
+		(double) ctx->bytes * 1000 / ns,
+		(double) ctx->cycles / ctx->bytes);
+}
+
+static void bench_batch(const char *name, struct mac_ctx *ctx,
+	unsigned char *buf, unsigned char (*out)[MAX_HASH_SIZE])
+{
+	const unsigned char *data[BENCH_BATCH];
+	unsigned char *tags[BENCH_BATCH];
+	unsigned int len[BENCH_BATCH];
+	uint32_t seq[BENCH_BATCH];
+	unsigned long long start;
+	int x, y;
+
+	for (y = 0; y < BENCH_BATCH; y++) {
+		data[y] = buf;
+		len[y] = BENCH_LEN;
+		tags[y] = out[y];
+	}
+
+	ctx->bytes = ctx->cycles = 0;
+
+	start = bench_ns();
+	for (x = 0; x < BENCH_ROUNDS; x += BENCH_BATCH) {
+		for (y = 0; y < BENCH_BATCH; y++)
+			seq[y] = x + y;
+
+		mac_compute_batch(ctx, seq, data, len, tags, BENCH_BATCH);
+	}
+
+	bench_report(name, "batched", bench_ns() - start, ctx);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char buf[BENCH_LEN];
+	static unsigned char out[BENCH_BATCH][MAX_HASH_SIZE];
+	unsigned char key[64];	/* hmac-sha2-512's, the longest */
+	const struct ssh_mac *mac;
+	struct mac_ctx *ctx;
+	unsigned long long start;
+	int x, y;
+
+	for (x = 0; x < sizeof(buf); x++)
+		buf[x] = x * 7;
+	for (x = 0; x < sizeof(key); x++)
+		key[x] = x;
+
+	for (x = 0; x < hash_list.num; x++) {
+		const char *name = hash_list.algos[x].name;
+
+		mac = hash_list.algos[x].algorithm;
+		if (!mac)
+			continue;
+
+		ctx = mac_new(name, mac, key);
+		if (!ctx) {
+			printf("%-30s not available\n", name);
+			continue;
+		}
+
+		start = bench_ns();
+		for (y = 0; y < BENCH_ROUNDS; y++)
+			if (mac_compute(ctx, y, buf, BENCH_LEN,
+				out[0]) != MACSSH_SUCCESS)
+				break;
+
+		if (y < BENCH_ROUNDS)
+			printf("%-30s failed\n", name);
+		else
+			bench_report(name, "serial", bench_ns() - start, ctx);
+
+		if (mac_can_batch(ctx))
+			bench_batch(name, ctx, buf, out);
+
+		mac_free(ctx);
+	}
+
+	return 0;
+}
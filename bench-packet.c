@@ -0,0 +1,293 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per field cost of the packet codec, before and after the function
+ * pointer table left struct packet. The old table and its codecs are
+ * reproduced here, the new ones are those of ssh-packet.[ch]. Not part
+ * of the program, built by hand:
+ *
+ *	gcc -O2 -o bench-packet bench-packet.c ssh-packet.c pool.c \
+ *		cipher.c mac.c umac.c sha256mb.c shani.c aesni.c aesgcm.c \
+ *		chacha.c chachapoly.c poly1305.c random.c misc.c \
+ *		-ltomcrypt -ltommath -lpthread
+ */
+
+#include <time.h>
+
+#include "includes.h"
+#include "ssh-packet.h"
+#include "ssh-session.h"
+
+/* The program's is in ssh-session.c, the codec never touches it */
+__thread struct session *ses;
+
+#define BENCH_MSGS	(8 * 1000 * 1000)
+
+/* Fields per message, see bench_encode_*() */
+#define BENCH_FIELDS	5
+
+#define BENCH_NAME	"diffie-hellman-group14-sha256"
+
+/* struct packet as it was, a table of codecs in every instance */
+struct old_packet {
+	char *data;
+
+	unsigned int len;
+	unsigned int wr_pos;
+	unsigned int rd_pos;
+	unsigned int size;
+
+	void (*put_int)(struct old_packet *pck, int data);
+	void (*put_char)(struct old_packet *pck, unsigned char data);
+	void (*put_str)(struct old_packet *pck, const char *data);
+	void (*put_byte)(struct old_packet *pck, unsigned char);
+	void (*put_bytes)(struct old_packet *pck, void *data, int len);
+	void (*put_exch_list)(struct old_packet *pck, void *data);
+	void (*put_mpint)(struct old_packet *pck, mp_int *mpi);
+
+	mp_int* (*get_mpint)(struct old_packet *pck, mp_int *mp);
+	int (*get_int)(struct old_packet *pck);
+	char* (*get_str)(struct old_packet *pck);
+	unsigned char (*get_char)(struct old_packet *pck);
+	unsigned char (*get_byte)(struct old_packet *pck);
+	unsigned char (*get_byte_at)(struct old_packet *pck, int index);
+	unsigned char (*get_byte_at_offset)(struct old_packet *pck,
+		int offset);
+	unsigned char* (*get_bytes)(struct old_packet *pck, int num);
+	void* (*get_exch_list)(struct old_packet *pck);
+
+	int (*resize)(struct old_packet *pck, int size);
+
+	int (*encrypt)(struct old_packet *pck);
+	int (*decrypt)(struct old_packet *pck);
+
+	struct list_head list;
+
+	struct packet_pool *pool;
+	int pool_cls;
+};
+
+static void old_put_byte(struct old_packet *pck, unsigned char data)
+{
+	*(pck->data + pck->len) = data;
+
+	pck->len++;
+}
+
+static void old_put_int(struct old_packet *pck, int data)
+{
+	STORE32H(data, pck->data + pck->len);
+
+	pck->len += 4;
+}
+
+static void old_put_str(struct old_packet *pck, const char *data)
+{
+	memcpy(pck->data + pck->len, data, strlen(data));
+	pck->len += strlen(data);
+}
+
+static unsigned char old_get_byte(struct old_packet *pck)
+{
+	return ((unsigned char *) pck->data)[pck->rd_pos++];
+}
+
+static int old_get_int(struct old_packet *pck)
+{
+	int ret;
+
+	LOAD32H(ret, pck->data + pck->rd_pos);
+
+	pck->rd_pos += 4;
+	return ret;
+}
+
+/*
+ * Filled the table on every allocation. Out of line as packet_new()
+ * was, so the calls through the table stay indirect.
+ */
+static void __attribute__((noinline)) old_packet_init(struct old_packet *pck)
+{
+	pck->len = 0;
+	pck->wr_pos = 0;
+	pck->rd_pos = 0;
+
+	pck->put_byte = &old_put_byte;
+	pck->put_char = &old_put_byte;
+	pck->put_int = &old_put_int;
+	pck->put_str = &old_put_str;
+	pck->put_bytes = NULL;
+	pck->put_exch_list = NULL;
+	pck->put_mpint = NULL;
+
+	pck->get_int = &old_get_int;
+	pck->get_byte = &old_get_byte;
+	pck->get_byte_at = NULL;
+	pck->get_byte_at_offset = NULL;
+	pck->get_bytes = NULL;
+	pck->get_str = NULL;
+	pck->get_exch_list = NULL;
+	pck->get_mpint = NULL;
+
+	pck->resize = NULL;
+}
+
+/* Keeps the compiler from looking through 'p' */
+#define BENCH_HIDE(p)	__asm__ volatile("" : "+r" (p))
+
+static unsigned long long bench_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A CHANNEL_DATA header and a name: msg, channel, length, string */
+static void bench_encode_old(struct old_packet *pck, int x)
+{
+	old_packet_init(pck);
+	BENCH_HIDE(pck);
+
+	pck->put_byte(pck, 94);
+	pck->put_int(pck, x);
+	pck->put_int(pck, x + 1);
+	pck->put_int(pck, sizeof(BENCH_NAME) - 1);
+	pck->put_str(pck, BENCH_NAME);
+}
+
+static void bench_encode_new(struct packet *pck, int x)
+{
+	packet_init(pck);
+	BENCH_HIDE(pck);
+
+	packet_put_byte(pck, 94);
+	packet_put_int(pck, x);
+	packet_put_int(pck, x + 1);
+	packet_put_int(pck, sizeof(BENCH_NAME) - 1);
+	packet_put_str(pck, BENCH_NAME);
+}
+
+static unsigned int bench_decode_old(struct old_packet *pck)
+{
+	unsigned int sum, len;
+
+	pck->rd_pos = 0;
+	BENCH_HIDE(pck);
+
+	sum = pck->get_byte(pck);
+	sum += pck->get_int(pck);
+	sum += pck->get_int(pck);
+	len = pck->get_int(pck);
+	sum += (unsigned char) pck->data[pck->rd_pos];
+	pck->rd_pos += len;
+
+	return sum;
+}
+
+/* Unchecked inline getters, for headers already known to be there */
+static unsigned int bench_decode_inline(struct packet *pck)
+{
+	unsigned int sum, len;
+
+	pck->rd_pos = 0;
+	BENCH_HIDE(pck);
+
+	sum = packet_get_byte(pck);
+	sum += packet_get_int(pck);
+	sum += packet_get_int(pck);
+	len = packet_get_int(pck);
+	sum += (unsigned char) pck->data[pck->rd_pos];
+	pck->rd_pos += len;
+
+	return sum;
+}
+
+/* The bounds-checked readers, as kex.c and ssh-session.c parse */
+static unsigned int bench_decode_checked(struct packet *pck)
+{
+	struct packet_view name;
+	unsigned char msg;
+	uint32_t a, b;
+
+	pck->rd_pos = 0;
+	BENCH_HIDE(pck);
+
+	if (packet_read_byte(pck, &msg) != MACSSH_SUCCESS ||
+		packet_read_u32(pck, &a) != MACSSH_SUCCESS ||
+		packet_read_u32(pck, &b) != MACSSH_SUCCESS ||
+		packet_read_string(pck, &name) != MACSSH_SUCCESS)
+		return 0;
+
+	return msg + a + b + name.ptr[0];
+}
+
+static void bench_report(const char *what, unsigned long long ns)
+{
+	printf("%-28s %6.2f ns/field\n", what,
+		(double) ns / ((double) BENCH_MSGS * BENCH_FIELDS));
+}
+
+int main(int argc, char **argv)
+{
+	static char old_buf[256], new_buf[256];
+	struct old_packet old_pck;
+	struct packet new_pck;
+	unsigned long long start;
+	unsigned int sum = 0;
+	int x;
+
+	memset(&old_pck, 0, sizeof(old_pck));
+	memset(&new_pck, 0, sizeof(new_pck));
+	old_pck.data = old_buf;
+	new_pck.data = new_buf;
+
+	printf("struct packet: %zu bytes before, %zu bytes after\n",
+		sizeof(struct old_packet), sizeof(struct packet));
+
+	start = bench_ns();
+	for (x = 0; x < BENCH_MSGS; x++)
+		bench_encode_old(&old_pck, x);
+	bench_report("encode, function pointers", bench_ns() - start);
+
+	start = bench_ns();
+	for (x = 0; x < BENCH_MSGS; x++)
+		bench_encode_new(&new_pck, x);
+	bench_report("encode, direct", bench_ns() - start);
+
+	start = bench_ns();
+	for (x = 0; x < BENCH_MSGS; x++)
+		sum += bench_decode_old(&old_pck);
+	bench_report("decode, function pointers", bench_ns() - start);
+
+	start = bench_ns();
+	for (x = 0; x < BENCH_MSGS; x++)
+		sum += bench_decode_inline(&new_pck);
+	bench_report("decode, inline", bench_ns() - start);
+
+	start = bench_ns();
+	for (x = 0; x < BENCH_MSGS; x++)
+		sum += bench_decode_checked(&new_pck);
+	bench_report("decode, bounds-checked", bench_ns() - start);
+
+	/* Keeps the decoders from being thrown away */
+	return sum == 1;
+}
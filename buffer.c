@@ -18,83 +18,148 @@
  */
 
 #include "buffer.h"
-#include "list.h"
 
-void buf_add(struct buffer *buf, struct packet *data)
+#define BUF_SLOT(buf, idx) ((buf)->ring[(idx) & (BUF_MAX_PACKETS - 1)])
+
+int buf_add(struct buffer *buf, struct packet *data)
 {
-        list_add(&data->list, &buf->packets->list);
+        size_t len = data->len - data->wr_pos;
+
+        if (buf->tail - buf->head == BUF_MAX_PACKETS ||
+                buf->bytes + len > BUF_MAX_BYTES)
+                return MACSSH_FAILURE;
+
+        BUF_SLOT(buf, buf->tail) = data;
+        buf->tail++;
+
+        buf->bytes += len;
+
+        return MACSSH_SUCCESS;
 }
 
 struct packet* buf_get(struct buffer *buf)
 {
         struct packet *pck;
 
-        pck = list_entry(buf->packets->list.next, struct packet, list);
+        if (buf->head == buf->tail)
+                return NULL;
 
-        list_del(&pck->list);
+        pck = BUF_SLOT(buf, buf->head);
+        buf->head++;
+
+        buf->bytes -= pck->len - pck->wr_pos;
 
         return pck;
 }
 
 struct packet* buf_peak(struct buffer *buf)
+{
+        if (buf->head == buf->tail)
+                return NULL;
+
+        return BUF_SLOT(buf, buf->head);
+}
+
+int buf_fill_iov(struct buffer *buf, struct iovec *iov, int max)
 {
         struct packet *pck;
+        unsigned int idx;
+        int num = 0;
 
-        pck = list_entry(buf->packets->list.next, struct packet, list);
+        for (idx = buf->head; idx != buf->tail && num < max; idx++) {
+                pck = BUF_SLOT(buf, idx);
 
-        return pck;
+                iov[num].iov_base = pck->data + pck->wr_pos;
+                iov[num].iov_len = pck->len - pck->wr_pos;
+                num++;
+        }
+
+        return num;
+}
+
+void buf_consume(struct buffer *buf, size_t len)
+{
+        struct packet *pck;
+        size_t left;
+
+        while (len > 0 && buf->head != buf->tail) {
+
+                pck = BUF_SLOT(buf, buf->head);
+
+                left = pck->len - pck->wr_pos;
+
+                /* Short write, resume here next time */
+                if (len < left) {
+                        INCREMENT_WR_POS(pck, len);
+                        buf->bytes -= len;
+                        return;
+                }
+
+                len -= left;
+
+                buf->bytes -= left;
+                buf->head++;
+                packet_free(pck);
+        }
 }
 
 int buf_isempty(struct buffer *buf)
 {
-        return list_empty(&buf->packets->list);
+        return buf->head == buf->tail;
 }
 
-int buf_len(struct buffer *buf)
+int buf_isfull(struct buffer *buf)
 {
-        int count = 0;
+        return buf->tail - buf->head == BUF_MAX_PACKETS ||
+                buf->bytes + PACKET_MAX_SIZE > BUF_MAX_BYTES;
+}
 
-        while (!list_empty(&buf->packets->list))
-                count++;
+int buf_len(struct buffer *buf)
+{
+        return buf->tail - buf->head;
+}
 
-        return count;
+size_t buf_bytes(struct buffer *buf)
+{
+        return buf->bytes;
 }
 
 void buf_free(struct buffer *buf)
 {
-        struct packet *pck;
-        struct list_head *pos;
-        struct list_head *safe;
-
-        list_for_each_safe(pos, safe, &buf->packets->list)
-        {
-                pck = list_entry(pos, struct packet, list);
-                list_del(pos);
-                free(pck);
-        }
+        if (!buf)
+                return;
+
+        while (buf->head != buf->tail)
+                packet_free(buf_get(buf));
 
         free(buf);
 }
 
 static void buf_init(struct buffer *buf)
 {
-
-        buf->packets = packet_new(1514);
-        
-        INIT_LIST_HEAD(&buf->packets->list);
+        buf->head = 0;
+        buf->tail = 0;
+        buf->bytes = 0;
 
         buf->buf_add = &buf_add;
         buf->buf_get = &buf_get;
         buf->buf_peak = &buf_peak;
         buf->buf_isempty = &buf_isempty;
+        buf->buf_isfull = &buf_isfull;
         buf->buf_len = &buf_len;
+        buf->buf_bytes = &buf_bytes;
+        buf->buf_fill_iov = &buf_fill_iov;
+        buf->buf_consume = &buf_consume;
 }
 
 struct buffer* buf_new(void)
 {
         struct buffer *buf = malloc(sizeof (struct buffer));
 
+        if (!buf)
+                return NULL;
+
         buf_init(buf);
 
         return buf;
-}
\ No newline at end of file
+}
@@ -23,18 +23,50 @@
 #include "ssh-packet.h"
 #include "includes.h"
 
-/* Buffer to hold in- and outgoing data */
+/*
+ * Bounds of one queue. The packet count must be a power of two, the
+ * ring index is masked with it.
+ */
+#define BUF_MAX_PACKETS		1024
+#define BUF_MAX_BYTES		(1 << 22)
+
+/*
+ * FIFO queue of packets, to hold in- and outgoing data. A fixed ring
+ * of packet pointers, so every operation is O(1) and nothing is
+ * allocated once the queue exists.
+ */
 struct buffer {
 	
-	void (*buf_add)(struct buffer *, struct packet *pck);
+	/* Fails, leaving the packet to the caller, when the queue is full */
+	int (*buf_add)(struct buffer *, struct packet *pck);
         
 	int (*buf_isempty)(struct buffer *buf);
+
+	/* No room left for another packet of the largest size */
+	int (*buf_isfull)(struct buffer *buf);
 	int (*buf_len)(struct buffer *buf);
+
+	/* Bytes not yet written, of all queued packets */
+	size_t (*buf_bytes)(struct buffer *buf);
 	
+	/* Oldest packet, or NULL when empty */
 	struct packet* (*buf_get)(struct buffer *buf);
         struct packet* (*buf_peak)(struct buffer *buf);
-        
-        struct packet *packets;
+
+	/*
+	 * Gather unwritten data of queued packets, oldest first,
+	 * and account for 'len' written bytes afterwards.
+	 */
+	int (*buf_fill_iov)(struct buffer *buf, struct iovec *iov, int max);
+	void (*buf_consume)(struct buffer *buf, size_t len);
+
+	/* Free running, tail - head packets are queued */
+	unsigned int head;
+	unsigned int tail;
+
+	size_t bytes;
+
+        struct packet *ring[BUF_MAX_PACKETS];
 
 };
 
@@ -42,4 +74,3 @@ struct buffer* buf_new();
 void buf_free(struct buffer *buf);
 
 #endif /* BUFFER_H */
-
@@ -0,0 +1,334 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "chacha.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA_SIMD
+#include <immintrin.h>
+#endif
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define LOAD32L(p) ((uint32_t) (p)[0] | ((uint32_t) (p)[1] << 8) | \
+	((uint32_t) (p)[2] << 16) | ((uint32_t) (p)[3] << 24))
+
+#define QUARTERROUND(a, b, c, d) do { \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7); \
+} while (0)
+
+static const unsigned char sigma[16] = "expand 32-byte k";
+
+void chacha_keysetup(struct chacha_ctx *ctx, const unsigned char *key)
+{
+	int x;
+	for (x = 0; x < 4; x++)
+		ctx->input[x] = LOAD32L(sigma + 4 * x);
+
+	for (x = 0; x < 8; x++)
+		ctx->input[4 + x] = LOAD32L(key + 4 * x);
+}
+
+void chacha_ivsetup(struct chacha_ctx *ctx, const unsigned char *iv,
+	const unsigned char *ctr)
+{
+	ctx->input[12] = ctr ? LOAD32L(ctr) : 0;
+	ctx->input[13] = ctr ? LOAD32L(ctr + 4) : 0;
+	ctx->input[14] = LOAD32L(iv);
+	ctx->input[15] = LOAD32L(iv + 4);
+}
+
+static inline void chacha_next_block(struct chacha_ctx *ctx)
+{
+	if (++ctx->input[12] == 0)
+		ctx->input[13]++;
+}
+
+/* One block of keystream */
+static void chacha_block(struct chacha_ctx *ctx, unsigned char *out)
+{
+	uint32_t x[16];
+
+	memcpy(x, ctx->input, sizeof(x));
+
+	int i;
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i++) {
+		uint32_t v = x[i] + ctx->input[i];
+		out[4 * i] = v;
+		out[4 * i + 1] = v >> 8;
+		out[4 * i + 2] = v >> 16;
+		out[4 * i + 3] = v >> 24;
+	}
+
+	chacha_next_block(ctx);
+}
+
+#ifdef CHACHA_SIMD
+
+/*
+ * Multi-block kernels. Vector i holds state word i of N consecutive
+ * blocks, one block per lane. Blocks only differ in the counter.
+ */
+#define SSE_ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), \
+	_mm_srli_epi32(v, 32 - (n)))
+
+#define SSE_QR(a, b, c, d) do { \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE_ROTL(d, 16); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE_ROTL(b, 12); \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE_ROTL(d, 8); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE_ROTL(b, 7); \
+} while (0)
+
+/* 4 blocks per call */
+__attribute__((target("sse2")))
+static void chacha_4block_sse2(struct chacha_ctx *ctx, const unsigned char *in,
+	unsigned char *out)
+{
+	__m128i v[16], s[16];
+	uint32_t lo[4], hi[4];
+
+	int i, g;
+	for (i = 0; i < 4; i++) {
+		lo[i] = ctx->input[12] + i;
+		hi[i] = ctx->input[13] + (lo[i] < ctx->input[12]);
+	}
+
+	for (i = 0; i < 16; i++)
+		s[i] = _mm_set1_epi32(ctx->input[i]);
+
+	s[12] = _mm_loadu_si128((const __m128i *) lo);
+	s[13] = _mm_loadu_si128((const __m128i *) hi);
+
+	memcpy(v, s, sizeof(v));
+
+	for (i = 0; i < 10; i++) {
+		SSE_QR(v[0], v[4], v[8], v[12]);
+		SSE_QR(v[1], v[5], v[9], v[13]);
+		SSE_QR(v[2], v[6], v[10], v[14]);
+		SSE_QR(v[3], v[7], v[11], v[15]);
+		SSE_QR(v[0], v[5], v[10], v[15]);
+		SSE_QR(v[1], v[6], v[11], v[12]);
+		SSE_QR(v[2], v[7], v[8], v[13]);
+		SSE_QR(v[3], v[4], v[9], v[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		v[i] = _mm_add_epi32(v[i], s[i]);
+
+	/* Transpose words g..g+3 of the four blocks and xor */
+	for (g = 0; g < 16; g += 4) {
+		__m128i t0 = _mm_unpacklo_epi32(v[g], v[g + 1]);
+		__m128i t1 = _mm_unpacklo_epi32(v[g + 2], v[g + 3]);
+		__m128i t2 = _mm_unpackhi_epi32(v[g], v[g + 1]);
+		__m128i t3 = _mm_unpackhi_epi32(v[g + 2], v[g + 3]);
+		__m128i r[4];
+
+		r[0] = _mm_unpacklo_epi64(t0, t1);
+		r[1] = _mm_unpackhi_epi64(t0, t1);
+		r[2] = _mm_unpacklo_epi64(t2, t3);
+		r[3] = _mm_unpackhi_epi64(t2, t3);
+
+		for (i = 0; i < 4; i++) {
+			const __m128i *src = (const __m128i *)
+				(in + 64 * i + 4 * g);
+			__m128i *dst = (__m128i *) (out + 64 * i + 4 * g);
+
+			_mm_storeu_si128(dst, _mm_xor_si128(r[i],
+				_mm_loadu_si128(src)));
+		}
+	}
+
+	ctx->input[12] += 4;
+	if (ctx->input[12] < 4)
+		ctx->input[13]++;
+}
+
+#define AVX_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), \
+	_mm256_srli_epi32(v, 32 - (n)))
+
+/* Byte rotations are a single shuffle */
+#define AVX_ROTL8(v, m8) _mm256_shuffle_epi8(v, m8)
+#define AVX_ROTL16(v, m16) _mm256_shuffle_epi8(v, m16)
+
+#define AVX_QR(a, b, c, d) do { \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); \
+	d = AVX_ROTL16(d, rot16); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); \
+	b = AVX_ROTL(b, 12); \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); \
+	d = AVX_ROTL8(d, rot8); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); \
+	b = AVX_ROTL(b, 7); \
+} while (0)
+
+/* 8 blocks per call */
+__attribute__((target("avx2")))
+static void chacha_8block_avx2(struct chacha_ctx *ctx, const unsigned char *in,
+	unsigned char *out)
+{
+	const __m256i rot16 = _mm256_set_epi8(
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	__m256i v[16], s[16];
+	uint32_t lo[8], hi[8];
+
+	int i, g;
+	for (i = 0; i < 8; i++) {
+		lo[i] = ctx->input[12] + i;
+		hi[i] = ctx->input[13] + (lo[i] < ctx->input[12]);
+	}
+
+	for (i = 0; i < 16; i++)
+		s[i] = _mm256_set1_epi32(ctx->input[i]);
+
+	s[12] = _mm256_loadu_si256((const __m256i *) lo);
+	s[13] = _mm256_loadu_si256((const __m256i *) hi);
+
+	memcpy(v, s, sizeof(v));
+
+	for (i = 0; i < 10; i++) {
+		AVX_QR(v[0], v[4], v[8], v[12]);
+		AVX_QR(v[1], v[5], v[9], v[13]);
+		AVX_QR(v[2], v[6], v[10], v[14]);
+		AVX_QR(v[3], v[7], v[11], v[15]);
+		AVX_QR(v[0], v[5], v[10], v[15]);
+		AVX_QR(v[1], v[6], v[11], v[12]);
+		AVX_QR(v[2], v[7], v[8], v[13]);
+		AVX_QR(v[3], v[4], v[9], v[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		v[i] = _mm256_add_epi32(v[i], s[i]);
+
+	/*
+	 * Same transpose as the SSE2 kernel, per 128 bit half. The low
+	 * half holds blocks 0-3, the high half blocks 4-7.
+	 */
+	for (g = 0; g < 16; g += 4) {
+		__m256i t0 = _mm256_unpacklo_epi32(v[g], v[g + 1]);
+		__m256i t1 = _mm256_unpacklo_epi32(v[g + 2], v[g + 3]);
+		__m256i t2 = _mm256_unpackhi_epi32(v[g], v[g + 1]);
+		__m256i t3 = _mm256_unpackhi_epi32(v[g + 2], v[g + 3]);
+		__m256i r[4];
+
+		r[0] = _mm256_unpacklo_epi64(t0, t1);
+		r[1] = _mm256_unpackhi_epi64(t0, t1);
+		r[2] = _mm256_unpacklo_epi64(t2, t3);
+		r[3] = _mm256_unpackhi_epi64(t2, t3);
+
+		for (i = 0; i < 4; i++) {
+			const unsigned char *src = in + 64 * i + 4 * g;
+			unsigned char *dst = out + 64 * i + 4 * g;
+
+			_mm_storeu_si128((__m128i *) dst, _mm_xor_si128(
+				_mm256_castsi256_si128(r[i]),
+				_mm_loadu_si128((const __m128i *) src)));
+
+			_mm_storeu_si128((__m128i *) (dst + 256), _mm_xor_si128(
+				_mm256_extracti128_si256(r[i], 1),
+				_mm_loadu_si128((const __m128i *) (src + 256))));
+		}
+	}
+
+	ctx->input[12] += 8;
+	if (ctx->input[12] < 8)
+		ctx->input[13]++;
+}
+
+static int chacha_simd_level()
+{
+	static int level = -1;
+
+	if (level < 0) {
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2"))
+			level = 2;
+		else if (__builtin_cpu_supports("sse2"))
+			level = 1;
+		else
+			level = 0;
+	}
+
+	return level;
+}
+
+#endif /* CHACHA_SIMD */
+
+void chacha_encrypt_bytes(struct chacha_ctx *ctx, const unsigned char *in,
+	unsigned char *out, unsigned int len)
+{
+	unsigned char ks[CHACHA_BLOCKLEN];
+
+#ifdef CHACHA_SIMD
+	int level = chacha_simd_level();
+
+	if (level >= 2) {
+		while (len >= 8 * CHACHA_BLOCKLEN) {
+			chacha_8block_avx2(ctx, in, out);
+			in += 8 * CHACHA_BLOCKLEN;
+			out += 8 * CHACHA_BLOCKLEN;
+			len -= 8 * CHACHA_BLOCKLEN;
+		}
+	}
+
+	if (level >= 1) {
+		while (len >= 4 * CHACHA_BLOCKLEN) {
+			chacha_4block_sse2(ctx, in, out);
+			in += 4 * CHACHA_BLOCKLEN;
+			out += 4 * CHACHA_BLOCKLEN;
+			len -= 4 * CHACHA_BLOCKLEN;
+		}
+	}
+#endif
+
+	while (len > 0) {
+		unsigned int num = MIN(len, CHACHA_BLOCKLEN);
+
+		chacha_block(ctx, ks);
+
+		unsigned int x;
+		for (x = 0; x < num; x++)
+			out[x] = in[x] ^ ks[x];
+
+		in += num;
+		out += num;
+		len -= num;
+	}
+
+	memset(ks, 0, sizeof(ks));
+}
@@ -0,0 +1,44 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHACHA_H
+#define CHACHA_H
+
+#include "includes.h"
+
+#define CHACHA_KEYLEN		32
+#define CHACHA_IVLEN		8
+#define CHACHA_CTRLEN		8
+#define CHACHA_BLOCKLEN		64
+
+/* Original ChaCha20: 64 bit nonce and 64 bit block counter */
+struct chacha_ctx {
+	uint32_t input[16];
+};
+
+void chacha_keysetup(struct chacha_ctx *ctx, const unsigned char *key);
+
+/* 'ctr' is little endian, NULL starts at block 0 */
+void chacha_ivsetup(struct chacha_ctx *ctx, const unsigned char *iv,
+	const unsigned char *ctr);
+
+void chacha_encrypt_bytes(struct chacha_ctx *ctx, const unsigned char *in,
+	unsigned char *out, unsigned int len);
+
+#endif /* CHACHA_H */
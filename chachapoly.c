@@ -0,0 +1,111 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "chachapoly.h"
+
+void chachapoly_init(struct chachapoly_ctx *ctx, const unsigned char *key)
+{
+	chacha_keysetup(&ctx->main_ctx, key);
+	chacha_keysetup(&ctx->header_ctx, key + CHACHA_KEYLEN);
+}
+
+/* The sequence number is the nonce, big endian */
+static void chachapoly_seqbuf(unsigned char *buf, uint32_t seqnr)
+{
+	memset(buf, 0, 4);
+	STORE32H(seqnr, buf + 4);
+}
+
+/* Constant time compare */
+static int chachapoly_tag_eq(const unsigned char *a, const unsigned char *b)
+{
+	unsigned char d = 0;
+
+	int x;
+	for (x = 0; x < POLY1305_TAGLEN; x++)
+		d |= a[x] ^ b[x];
+
+	return d == 0;
+}
+
+int chachapoly_crypt(struct chachapoly_ctx *ctx, uint32_t seqnr,
+	unsigned char *dest, const unsigned char *src, unsigned int len,
+	unsigned int aadlen, int encrypt)
+{
+	static const unsigned char one[8] = { 1, 0, 0, 0, 0, 0, 0, 0 };
+	unsigned char seqbuf[8];
+	unsigned char poly_key[POLY1305_KEYLEN];
+	unsigned char tag[POLY1305_TAGLEN];
+	int ret = MACSSH_SUCCESS;
+
+	/* Poly1305 key is the first keystream block of the payload key */
+	chachapoly_seqbuf(seqbuf, seqnr);
+	memset(poly_key, 0, sizeof(poly_key));
+	chacha_ivsetup(&ctx->main_ctx, seqbuf, NULL);
+	chacha_encrypt_bytes(&ctx->main_ctx, poly_key, poly_key,
+		sizeof(poly_key));
+
+	/* Reject forgeries before any decryption */
+	if (!encrypt) {
+		poly1305_auth(tag, src, aadlen + len, poly_key);
+
+		if (!chachapoly_tag_eq(tag, src + aadlen + len)) {
+			ret = MACSSH_FAILURE;
+			goto out;
+		}
+	}
+
+	if (aadlen) {
+		chacha_ivsetup(&ctx->header_ctx, seqbuf, NULL);
+		chacha_encrypt_bytes(&ctx->header_ctx, src, dest, aadlen);
+	}
+
+	/* Payload starts at block counter 1 */
+	chacha_ivsetup(&ctx->main_ctx, seqbuf, one);
+	chacha_encrypt_bytes(&ctx->main_ctx, src + aadlen, dest + aadlen, len);
+
+	if (encrypt)
+		poly1305_auth(dest + aadlen + len, dest, aadlen + len,
+			poly_key);
+
+out:
+	memset(poly_key, 0, sizeof(poly_key));
+	memset(tag, 0, sizeof(tag));
+
+	return ret;
+}
+
+int chachapoly_get_length(struct chachapoly_ctx *ctx, uint32_t *plen,
+	uint32_t seqnr, const unsigned char *cp, unsigned int len)
+{
+	unsigned char buf[4];
+	unsigned char seqbuf[8];
+
+	if (len < 4)
+		return MACSSH_FAILURE;
+
+	chachapoly_seqbuf(seqbuf, seqnr);
+	chacha_ivsetup(&ctx->header_ctx, seqbuf, NULL);
+	chacha_encrypt_bytes(&ctx->header_ctx, cp, buf, 4);
+
+	LOAD32H(*plen, buf);
+
+	return MACSSH_SUCCESS;
+}
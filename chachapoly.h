@@ -0,0 +1,50 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHACHAPOLY_H
+#define CHACHAPOLY_H
+
+#include "includes.h"
+#include "chacha.h"
+#include "poly1305.h"
+
+/* chacha20-poly1305@openssh.com, see PROTOCOL.chacha20poly1305 */
+#define CHACHAPOLY_KEYLEN	(2 * CHACHA_KEYLEN)
+
+struct chachapoly_ctx {
+	struct chacha_ctx main_ctx;	/* Payload and poly1305 key */
+	struct chacha_ctx header_ctx;	/* Packet length only */
+};
+
+void chachapoly_init(struct chachapoly_ctx *ctx, const unsigned char *key);
+
+/*
+ * En- or decrypt 'aadlen' bytes of length field and 'len' bytes of
+ * payload from 'src' to 'dest'. Encryption appends the tag to 'dest',
+ * decryption checks the tag behind 'src' before touching anything.
+ */
+int chachapoly_crypt(struct chachapoly_ctx *ctx, uint32_t seqnr,
+	unsigned char *dest, const unsigned char *src, unsigned int len,
+	unsigned int aadlen, int encrypt);
+
+/* Decrypt the packet length on its own, without consuming it */
+int chachapoly_get_length(struct chachapoly_ctx *ctx, uint32_t *plen,
+	uint32_t seqnr, const unsigned char *cp, unsigned int len);
+
+#endif /* CHACHAPOLY_H */
@@ -0,0 +1,381 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "cipher.h"
+#include "dbg.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const struct ssh_cipher ssh_aes128_ctr = { &aes_desc, 16, 16, CIPHER_MODE_CTR };
+const struct ssh_cipher ssh_aes256_ctr = { &aes_desc, 32, 16, CIPHER_MODE_CTR };
+const struct ssh_cipher ssh_twofish128_ctr = { &twofish_desc, 16, 16, CIPHER_MODE_CTR };
+const struct ssh_cipher ssh_twofish256_ctr = { &twofish_desc, 32, 16, CIPHER_MODE_CTR };
+const struct ssh_cipher ssh_aes128_cbc = { &aes_desc, 16, 16, CIPHER_MODE_CBC };
+const struct ssh_cipher ssh_aes256_cbc = { &aes_desc, 32, 16, CIPHER_MODE_CBC };
+const struct ssh_cipher ssh_twofish128_cbc = { &twofish_desc, 16, 16, CIPHER_MODE_CBC };
+const struct ssh_cipher ssh_twofish256_cbc = { &twofish_desc, 32, 16, CIPHER_MODE_CBC };
+const struct ssh_cipher ssh_3des_ctr = { &des3_desc, 24, 8, CIPHER_MODE_CTR };
+const struct ssh_cipher ssh_3des_cbc = { &des3_desc, 24, 8, CIPHER_MODE_CBC };
+const struct ssh_cipher ssh_blowfish_cbc = { &blowfish_desc, 16, 8, CIPHER_MODE_CBC };
+const struct ssh_cipher ssh_aes128_gcm = { &aes_desc, 16, 16, CIPHER_MODE_GCM };
+const struct ssh_cipher ssh_aes256_gcm = { &aes_desc, 32, 16, CIPHER_MODE_GCM };
+const struct ssh_cipher ssh_chachapoly = { NULL, CHACHAPOLY_KEYLEN, 8, CIPHER_MODE_CHACHAPOLY };
+const struct ssh_cipher ssh_none = { NULL, 0, 8, CIPHER_MODE_NONE };
+
+/* Encrypting zeros in CTR mode yields the raw keystream */
+static const unsigned char ks_zero[CIPHER_KS_BATCH];
+
+static unsigned long long cipher_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+struct cipher_ctx* cipher_new(const char *name, const struct ssh_cipher *cipher,
+	const unsigned char *key, const unsigned char *iv, int encrypt)
+{
+	struct cipher_ctx *ctx;
+	int idx = -1;
+	int err = CRYPT_OK;
+
+	if ((ctx = calloc(1, sizeof(struct cipher_ctx))) == NULL)
+		return NULL;
+
+	ctx->cipher = cipher;
+	ctx->name = name;
+	ctx->encrypt = encrypt;
+
+	if (cipher->desc && (idx = register_cipher(cipher->desc)) < 0)
+		goto error;
+
+	/* Hardware AES is picked at runtime, once per context */
+	if (cipher->mode == CIPHER_MODE_CTR && cipher->desc == &aes_desc &&
+		aesni_available()) {
+		ctx->aesni = 1;
+		ctx->ks_pos = CIPHER_KS_BATCH;
+
+		if (aesni_ctr_init(&ctx->state.aesni, key, cipher->key_len,
+			iv) != MACSSH_SUCCESS)
+			goto error;
+
+		return ctx;
+	}
+
+	if (cipher->mode == CIPHER_MODE_GCM) {
+		memcpy(ctx->nonce, iv, AESGCM_IV_LEN);
+
+		if (aesgcm_available()) {
+			ctx->aesni = 1;
+
+			if (aesgcm_init(&ctx->state.aesgcm, key,
+				cipher->key_len) != MACSSH_SUCCESS)
+				goto error;
+
+			return ctx;
+		}
+	}
+
+	switch (cipher->mode) {
+	case CIPHER_MODE_CTR:
+		err = ctr_start(idx, iv, key, cipher->key_len, 0,
+			CTR_COUNTER_BIG_ENDIAN, &ctx->state.ctr);
+
+		/* Nothing generated yet */
+		ctx->ks_pos = CIPHER_KS_BATCH;
+		break;
+	case CIPHER_MODE_CBC:
+		err = cbc_start(idx, iv, key, cipher->key_len, 0,
+			&ctx->state.cbc);
+		break;
+	case CIPHER_MODE_CHACHAPOLY:
+		chachapoly_init(&ctx->state.chachapoly, key);
+		break;
+	case CIPHER_MODE_GCM:
+		err = gcm_init(&ctx->state.gcm, idx, key, cipher->key_len);
+		break;
+	default:
+		break;
+	}
+
+	if (err != CRYPT_OK)
+		goto error;
+
+	return ctx;
+
+error:
+	macssh_warn("Could not set up cipher %s", name);
+	free(ctx);
+	return NULL;
+}
+
+void cipher_free(struct cipher_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	switch (ctx->aesni ? CIPHER_MODE_NONE : ctx->cipher->mode) {
+	case CIPHER_MODE_CTR:
+		ctr_done(&ctx->state.ctr);
+		break;
+	case CIPHER_MODE_CBC:
+		cbc_done(&ctx->state.cbc);
+		break;
+	default:
+		break;
+	}
+
+	/* Wipe key schedule and pending keystream */
+	memset(ctx, 0, sizeof(struct cipher_ctx));
+	free(ctx);
+}
+
+/*
+ * XOR with keystream that was generated CIPHER_KS_BATCH bytes at a
+ * time. The SSH counter runs on across packets, so nothing generated
+ * ahead is ever wasted.
+ */
+static int cipher_ctr_xor(struct cipher_ctx *ctx, const unsigned char *in,
+	unsigned char *out, unsigned int len)
+{
+	unsigned int num;
+	unsigned int x;
+
+	while (len > 0) {
+
+		if (ctx->ks_pos == CIPHER_KS_BATCH) {
+			if (ctx->aesni)
+				aesni_ctr_keystream(&ctx->state.aesni, ctx->ks,
+					CIPHER_KS_BATCH / 16);
+			else if (ctr_encrypt(ks_zero, ctx->ks, CIPHER_KS_BATCH,
+				&ctx->state.ctr) != CRYPT_OK)
+				return MACSSH_FAILURE;
+
+			ctx->ks_pos = 0;
+		}
+
+		num = MIN(len, CIPHER_KS_BATCH - ctx->ks_pos);
+
+		/* Word at a time, then the odd bytes */
+		for (x = 0; x + 8 <= num; x += 8) {
+			uint64_t a, b;
+			memcpy(&a, in + x, 8);
+			memcpy(&b, ctx->ks + ctx->ks_pos + x, 8);
+			a ^= b;
+			memcpy(out + x, &a, 8);
+		}
+
+		for (; x < num; x++)
+			out[x] = in[x] ^ ctx->ks[ctx->ks_pos + x];
+
+		ctx->ks_pos += num;
+		in += num;
+		out += num;
+		len -= num;
+	}
+
+	return MACSSH_SUCCESS;
+}
+
+int cipher_crypt(struct cipher_ctx *ctx, const unsigned char *in,
+	unsigned char *out, unsigned int len)
+{
+	unsigned long long start;
+	int ret = MACSSH_SUCCESS;
+
+	start = cipher_clock();
+
+	switch (ctx->cipher->mode) {
+	case CIPHER_MODE_CTR:
+		ret = cipher_ctr_xor(ctx, in, out, len);
+		break;
+	case CIPHER_MODE_CBC:
+		if (ctx->encrypt)
+			ret = cbc_encrypt(in, out, len, &ctx->state.cbc);
+		else
+			ret = cbc_decrypt(in, out, len, &ctx->state.cbc);
+
+		ret = (ret == CRYPT_OK) ? MACSSH_SUCCESS : MACSSH_FAILURE;
+		break;
+	default:
+		if (in != out)
+			memmove(out, in, len);
+		break;
+	}
+
+	ctx->cycles += cipher_clock() - start;
+	ctx->bytes += len;
+
+	return ret;
+}
+
+int cipher_is_aead(struct cipher_ctx *ctx)
+{
+	return ctx->cipher->mode == CIPHER_MODE_CHACHAPOLY ||
+		ctx->cipher->mode == CIPHER_MODE_GCM;
+}
+
+unsigned int cipher_tag_len(struct cipher_ctx *ctx)
+{
+	switch (ctx->cipher->mode) {
+	case CIPHER_MODE_CHACHAPOLY:
+		return POLY1305_TAGLEN;
+	case CIPHER_MODE_GCM:
+		return AESGCM_TAG_LEN;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The packet length is additional data, the rest of the packet is
+ * encrypted. The invocation counter moves on with every packet.
+ */
+static int cipher_gcm(struct cipher_ctx *ctx, unsigned char *buf,
+	unsigned int len, int encrypt)
+{
+	unsigned char tag[AESGCM_TAG_LEN];
+	unsigned long tag_len = sizeof(tag);
+	unsigned char d = 0;
+	int ret = MACSSH_SUCCESS;
+	int x;
+
+	if (ctx->aesni) {
+		if (encrypt)
+			aesgcm_seal(&ctx->state.aesgcm, ctx->nonce, buf, 4,
+				buf + 4, buf + 4, len - 4, buf + len);
+		else
+			ret = aesgcm_open(&ctx->state.aesgcm, ctx->nonce, buf,
+				4, buf + 4, buf + 4, len - 4, buf + len);
+	} else {
+		if (gcm_reset(&ctx->state.gcm) != CRYPT_OK ||
+			gcm_add_iv(&ctx->state.gcm, ctx->nonce,
+				AESGCM_IV_LEN) != CRYPT_OK ||
+			gcm_add_aad(&ctx->state.gcm, buf, 4) != CRYPT_OK ||
+			gcm_process(&ctx->state.gcm, buf + 4, len - 4, buf + 4,
+				encrypt ? GCM_ENCRYPT : GCM_DECRYPT) != CRYPT_OK ||
+			gcm_done(&ctx->state.gcm, tag, &tag_len) != CRYPT_OK)
+			ret = MACSSH_FAILURE;
+
+		if (encrypt) {
+			memcpy(buf + len, tag, AESGCM_TAG_LEN);
+		} else {
+			for (x = 0; x < AESGCM_TAG_LEN; x++)
+				d |= tag[x] ^ buf[len + x];
+
+			if (d)
+				ret = MACSSH_FAILURE;
+		}
+	}
+
+	for (x = AESGCM_IV_LEN - 1; x >= 4; x--)
+		if (++ctx->nonce[x] != 0)
+			break;
+
+	return ret;
+}
+
+int cipher_aead_seal(struct cipher_ctx *ctx, uint32_t seqnr,
+	unsigned char *buf, unsigned int len)
+{
+	unsigned long long start;
+	int ret;
+
+	start = cipher_clock();
+
+	switch (ctx->cipher->mode) {
+	case CIPHER_MODE_CHACHAPOLY:
+		ret = chachapoly_crypt(&ctx->state.chachapoly, seqnr, buf, buf,
+			len - 4, 4, 1);
+		break;
+	case CIPHER_MODE_GCM:
+		ret = cipher_gcm(ctx, buf, len, 1);
+		break;
+	default:
+		ret = MACSSH_FAILURE;
+		break;
+	}
+
+	ctx->cycles += cipher_clock() - start;
+	ctx->bytes += len;
+
+	return ret;
+}
+
+int cipher_aead_open(struct cipher_ctx *ctx, uint32_t seqnr,
+	unsigned char *buf, unsigned int len)
+{
+	unsigned long long start;
+	int ret;
+
+	start = cipher_clock();
+
+	switch (ctx->cipher->mode) {
+	case CIPHER_MODE_CHACHAPOLY:
+		ret = chachapoly_crypt(&ctx->state.chachapoly, seqnr, buf, buf,
+			len - 4, 4, 0);
+		break;
+	case CIPHER_MODE_GCM:
+		ret = cipher_gcm(ctx, buf, len, 0);
+		break;
+	default:
+		ret = MACSSH_FAILURE;
+		break;
+	}
+
+	ctx->cycles += cipher_clock() - start;
+	ctx->bytes += len;
+
+	return ret;
+}
+
+int cipher_aead_length(struct cipher_ctx *ctx, uint32_t seqnr,
+	const unsigned char *buf, uint32_t *len)
+{
+	switch (ctx->cipher->mode) {
+	case CIPHER_MODE_CHACHAPOLY:
+		return chachapoly_get_length(&ctx->state.chachapoly, len, seqnr,
+			buf, 4);
+	case CIPHER_MODE_GCM:
+		/* Sent in the clear */
+		LOAD32H(*len, buf);
+		return MACSSH_SUCCESS;
+	default:
+		return MACSSH_FAILURE;
+	}
+}
+
+void cipher_print_stats(struct cipher_ctx *ctx, const char *dir)
+{
+	if (!ctx || !ctx->bytes)
+		return;
+
+	macssh_info("%s%s %s: %llu bytes, %.2f cycles/byte", ctx->name,
+		ctx->aesni ? " (AES-NI)" : "", dir, ctx->bytes,
+		(double) ctx->cycles / ctx->bytes);
+}
@@ -0,0 +1,126 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include "includes.h"
+#include "aesni.h"
+#include "chachapoly.h"
+#include "aesgcm.h"
+
+enum {
+	CIPHER_MODE_NONE	= 0,
+	CIPHER_MODE_CTR		= 1,
+	CIPHER_MODE_CBC		= 2,
+	CIPHER_MODE_CHACHAPOLY	= 3,
+	CIPHER_MODE_GCM		= 4,
+};
+
+/* Keystream generated ahead per refill in CTR mode */
+#define CIPHER_KS_BATCH		4096
+
+/* A negotiable cipher, as referenced from cipher_list */
+struct ssh_cipher {
+	const struct ltc_cipher_descriptor *desc;
+	int key_len;
+	int blk_size;
+	int mode;
+};
+
+/* One direction of the transport cipher */
+struct cipher_ctx {
+
+	const struct ssh_cipher *cipher;
+	const char *name;
+
+	/* Key schedule, expanded once at NEWKEYS */
+	union {
+		symmetric_CTR ctr;
+		symmetric_CBC cbc;
+		struct aesni_ctx aesni;
+		struct chachapoly_ctx chachapoly;
+		gcm_state gcm;
+		struct aesgcm_ctx aesgcm;
+	} state;
+
+	/* AES-CTR and AES-GCM run on AES-NI rather than libtomcrypt */
+	int aesni;
+
+	/* GCM fixed field and invocation counter, RFC 5647 */
+	unsigned char nonce[AESGCM_IV_LEN];
+
+	int encrypt;
+
+	/* Unused keystream is ks[ks_pos..CIPHER_KS_BATCH) */
+	unsigned char ks[CIPHER_KS_BATCH];
+	unsigned int ks_pos;
+
+	/* Throughput accounting */
+	unsigned long long bytes;
+	unsigned long long cycles;
+};
+
+extern const struct ssh_cipher ssh_aes128_ctr;
+extern const struct ssh_cipher ssh_aes256_ctr;
+extern const struct ssh_cipher ssh_twofish128_ctr;
+extern const struct ssh_cipher ssh_twofish256_ctr;
+extern const struct ssh_cipher ssh_aes128_cbc;
+extern const struct ssh_cipher ssh_aes256_cbc;
+extern const struct ssh_cipher ssh_twofish128_cbc;
+extern const struct ssh_cipher ssh_twofish256_cbc;
+extern const struct ssh_cipher ssh_3des_ctr;
+extern const struct ssh_cipher ssh_3des_cbc;
+extern const struct ssh_cipher ssh_blowfish_cbc;
+extern const struct ssh_cipher ssh_aes128_gcm;
+extern const struct ssh_cipher ssh_aes256_gcm;
+extern const struct ssh_cipher ssh_chachapoly;
+extern const struct ssh_cipher ssh_none;
+
+struct cipher_ctx* cipher_new(const char *name, const struct ssh_cipher *cipher,
+	const unsigned char *key, const unsigned char *iv, int encrypt);
+void cipher_free(struct cipher_ctx *ctx);
+
+/* En- or decrypt 'len' bytes, a multiple of the block size */
+int cipher_crypt(struct cipher_ctx *ctx, const unsigned char *in,
+	unsigned char *out, unsigned int len);
+
+/*
+ * Authenticated ciphers carry their own mac and also encrypt the
+ * packet length, so the length is decrypted separately before the
+ * rest of the packet is in.
+ */
+int cipher_is_aead(struct cipher_ctx *ctx);
+unsigned int cipher_tag_len(struct cipher_ctx *ctx);
+
+/* Encrypt 'len' bytes of packet and append the tag at buf + len */
+int cipher_aead_seal(struct cipher_ctx *ctx, uint32_t seqnr,
+	unsigned char *buf, unsigned int len);
+
+/* Check the tag at buf + len, then decrypt the packet in place */
+int cipher_aead_open(struct cipher_ctx *ctx, uint32_t seqnr,
+	unsigned char *buf, unsigned int len);
+
+/* Packet length from the first four bytes, which are left as they are */
+int cipher_aead_length(struct cipher_ctx *ctx, uint32_t seqnr,
+	const unsigned char *buf, uint32_t *len);
+
+void cipher_print_stats(struct cipher_ctx *ctx, const char *dir);
+
+#endif /* CIPHER_H */
@@ -22,6 +22,8 @@
 
 #include "includes.h"
 #include "kex.h"
+#include "cipher.h"
+#include "mac.h"
 
 struct keys {
 	
@@ -38,6 +40,27 @@ struct crypto {
 	
 	struct keys keys;
 	struct keys old_keys;
+
+	/*
+	 * Block size of the ciphers and length of the,
+	 * mac in each direction. Zero until NEWKEYS.
+	 */
+	unsigned int blk_size_out;
+	unsigned int blk_size_in;
+	unsigned int mac_len_out;
+	unsigned int mac_len_in;
+
+	/*
+	 * Per direction cipher state, NULL until NEWKEYS
+	 */
+	struct cipher_ctx *cipher_in;
+	struct cipher_ctx *cipher_out;
+
+	/*
+	 * Per direction mac state, NULL for "none" and AEAD ciphers
+	 */
+	struct mac_ctx *mac_in;
+	struct mac_ctx *mac_out;
 	
 };
 
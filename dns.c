@@ -0,0 +1,396 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <time.h>
+
+#include "includes.h"
+#include "dns.h"
+#include "threadpool.h"
+#include "dbg.h"
+
+/* A dns_lookup() waiting for its name */
+struct dns_query {
+	struct ev_loop *loop;
+	dns_cb cb;
+	void *arg;
+
+	struct dns_result res;
+	struct ev_post post;
+	struct list_head list;
+};
+
+struct dns_entry {
+	char host[DNS_HOST_MAX];
+	unsigned long long expire;
+
+	/* Being resolved on the pool, the queries waiting for it */
+	int pending;
+	struct list_head waiters;
+	struct work work;
+
+	struct dns_result res;
+
+	struct list_head bucket;
+	struct list_head lru;
+};
+
+/*
+ * One cache for the process, every session and thread shares the
+ * answers. All of it is under dns_lock.
+ */
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head dns_buckets[DNS_CACHE_BUCKETS];
+static LIST_HEAD(dns_lru);
+static unsigned int dns_num;
+static int dns_ready;
+
+static struct threadpool *dns_pool;
+
+static unsigned long long dns_hits;
+static unsigned long long dns_misses;
+static unsigned long long dns_joined;
+
+static unsigned long long dns_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a, names compare case insensitive */
+static unsigned int dns_hash(const char *host)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *host; host++) {
+		h ^= (unsigned char) tolower((unsigned char) *host);
+		h *= 16777619;
+	}
+
+	return h % DNS_CACHE_BUCKETS;
+}
+
+static void dns_setup_locked()
+{
+	if (dns_ready)
+		return;
+
+	int x;
+	for (x = 0; x < DNS_CACHE_BUCKETS; x++)
+		INIT_LIST_HEAD(&dns_buckets[x]);
+
+	dns_ready = 1;
+}
+
+/* Blocking, on whatever thread calls it */
+static void dns_resolve(const char *host, struct dns_result *res)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai, *list;
+	struct addrinfo *first[DNS_MAX_ADDRS];
+	struct addrinfo *second[DNS_MAX_ADDRS];
+	int nf = 0, ns = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	res->num = 0;
+	res->err = getaddrinfo(host, NULL, &hints, &list);
+	if (res->err)
+		return;
+
+	/* Interleave the families, the resolver's first answer leads */
+	for (ai = list; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+
+		if (ai->ai_family == list->ai_family) {
+			if (nf < DNS_MAX_ADDRS)
+				first[nf++] = ai;
+		} else if (ns < DNS_MAX_ADDRS) {
+			second[ns++] = ai;
+		}
+	}
+
+	int x;
+	for (x = 0; res->num < DNS_MAX_ADDRS && (x < nf || x < ns); x++) {
+		if (x < nf)
+			ai = first[x];
+		else
+			ai = second[x];
+
+		res->addrs[res->num].family = ai->ai_family;
+		res->addrs[res->num].len = ai->ai_addrlen;
+		memcpy(&res->addrs[res->num].addr, ai->ai_addr, ai->ai_addrlen);
+		res->num++;
+
+		if (x < nf && x < ns && res->num < DNS_MAX_ADDRS) {
+			ai = second[x];
+			res->addrs[res->num].family = ai->ai_family;
+			res->addrs[res->num].len = ai->ai_addrlen;
+			memcpy(&res->addrs[res->num].addr, ai->ai_addr,
+				ai->ai_addrlen);
+			res->num++;
+		}
+	}
+
+	freeaddrinfo(list);
+
+	if (!res->num)
+		res->err = EAI_NONAME;
+}
+
+/*
+ * Expiry of a fresh answer. Only names known not to exist are cached
+ * negative, a failing resolver is asked again next time.
+ */
+static unsigned long long dns_expire(const struct dns_result *res)
+{
+	if (!res->err)
+		return dns_now() + DNS_TTL_MS;
+
+	if (res->err == EAI_NONAME
+#ifdef EAI_NODATA
+		|| res->err == EAI_NODATA
+#endif
+		)
+		return dns_now() + DNS_NEG_TTL_MS;
+
+	return 0;
+}
+
+static struct dns_entry* dns_find_locked(const char *host)
+{
+	struct dns_entry *e;
+
+	list_for_each_entry(e, &dns_buckets[dns_hash(host)], bucket)
+		if (!strcasecmp(e->host, host))
+			return e;
+
+	return NULL;
+}
+
+static void dns_entry_free_locked(struct dns_entry *e)
+{
+	list_del(&e->bucket);
+	list_del(&e->lru);
+	dns_num--;
+
+	free(e);
+}
+
+/* Least recently used first, names being resolved are kept */
+static void dns_evict_locked()
+{
+	struct dns_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &dns_lru, lru) {
+		if (dns_num < DNS_CACHE_MAX)
+			break;
+
+		if (!e->pending)
+			dns_entry_free_locked(e);
+	}
+}
+
+static struct dns_entry* dns_entry_new_locked(const char *host)
+{
+	struct dns_entry *e;
+
+	dns_evict_locked();
+
+	e = calloc(1, sizeof(struct dns_entry));
+	if (!e)
+		return NULL;
+
+	snprintf(e->host, sizeof(e->host), "%s", host);
+	INIT_LIST_HEAD(&e->waiters);
+
+	list_add_tail(&e->bucket, &dns_buckets[dns_hash(host)]);
+	list_add_tail(&e->lru, &dns_lru);
+	dns_num++;
+
+	return e;
+}
+
+/* Answer from the cache, when there is a live one */
+static int dns_cached_locked(const char *host, struct dns_result *res)
+{
+	struct dns_entry *e;
+
+	e = dns_find_locked(host);
+	if (!e || e->pending || e->expire <= dns_now())
+		return 0;
+
+	*res = e->res;
+	list_move_tail(&e->lru, &dns_lru);
+	dns_hits++;
+
+	return 1;
+}
+
+static void dns_store_locked(struct dns_entry *e, const struct dns_result *res)
+{
+	e->res = *res;
+	e->expire = dns_expire(res);
+	list_move_tail(&e->lru, &dns_lru);
+}
+
+/* Back on the thread of the query's loop */
+static void dns_query_done(struct ev_loop *loop, void *arg)
+{
+	struct dns_query *q = arg;
+
+	q->cb(loop, &q->res, q->arg);
+
+	free(q);
+}
+
+/* On a pool thread */
+static void dns_work_run(struct work *work)
+{
+	struct dns_entry *e = work->arg;
+	struct dns_query *q, *tmp;
+	struct dns_result res;
+
+	/*
+	 * The name doesn't change, and the entry isn't evicted, while
+	 * pending. Once it is cleared and the lock dropped, neither the
+	 * entry nor its work may be touched.
+	 */
+	dns_resolve(e->host, &res);
+
+	pthread_mutex_lock(&dns_lock);
+
+	dns_store_locked(e, &res);
+	e->pending = 0;
+
+	list_for_each_entry_safe(q, tmp, &e->waiters, list) {
+		list_del(&q->list);
+
+		q->res = res;
+		q->post.cb = &dns_query_done;
+		q->post.arg = q;
+
+		if (ev_post(q->loop, &q->post) != MACSSH_SUCCESS) {
+			macssh_warn("Could not post answer for %s", e->host);
+			free(q);
+		}
+	}
+
+	pthread_mutex_unlock(&dns_lock);
+}
+
+int dns_lookup(struct ev_loop *loop, const char *host, dns_cb cb, void *arg)
+{
+	struct dns_entry *e;
+	struct dns_query *q;
+	struct dns_result res;
+
+	if (strlen(host) >= DNS_HOST_MAX)
+		return MACSSH_FAILURE;
+
+	pthread_mutex_lock(&dns_lock);
+	dns_setup_locked();
+
+	if (dns_cached_locked(host, &res)) {
+		pthread_mutex_unlock(&dns_lock);
+		cb(loop, &res, arg);
+		return MACSSH_SUCCESS;
+	}
+
+	q = calloc(1, sizeof(struct dns_query));
+	e = dns_find_locked(host);
+	if (!e)
+		e = dns_entry_new_locked(host);
+
+	if (!q || !e)
+		goto fail;
+
+	q->loop = loop;
+	q->cb = cb;
+	q->arg = arg;
+
+	if (e->pending) {
+		/* Someone asked first, one lookup answers both */
+		list_add_tail(&q->list, &e->waiters);
+		dns_joined++;
+
+		pthread_mutex_unlock(&dns_lock);
+		return MACSSH_SUCCESS;
+	}
+
+	if (!dns_pool)
+		dns_pool = threadpool_new(DNS_THREADS);
+	if (!dns_pool)
+		goto fail;
+
+	e->work.run = &dns_work_run;
+	e->work.done = NULL;
+	e->work.arg = e;
+
+	e->pending = 1;
+	list_add_tail(&q->list, &e->waiters);
+
+	if (threadpool_submit(dns_pool, &e->work) != MACSSH_SUCCESS) {
+		list_del(&q->list);
+		e->pending = 0;
+		goto fail;
+	}
+
+	dns_misses++;
+
+	pthread_mutex_unlock(&dns_lock);
+
+	return MACSSH_SUCCESS;
+fail:
+	pthread_mutex_unlock(&dns_lock);
+	free(q);
+
+	return MACSSH_FAILURE;
+}
+
+void dns_shutdown(void)
+{
+	struct dns_entry *e, *tmp;
+
+	/* Lets the lookups in flight finish, and post their answers */
+	threadpool_free(dns_pool);
+	dns_pool = NULL;
+
+	pthread_mutex_lock(&dns_lock);
+
+	list_for_each_entry_safe(e, tmp, &dns_lru, lru)
+		dns_entry_free_locked(e);
+
+	pthread_mutex_unlock(&dns_lock);
+}
+
+void dns_print_stats(void)
+{
+	pthread_mutex_lock(&dns_lock);
+	macssh_info("dns: %u names, %llu hits, %llu lookups, %llu joined",
+		dns_num, dns_hits, dns_misses, dns_joined);
+	pthread_mutex_unlock(&dns_lock);
+}
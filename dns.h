@@ -0,0 +1,75 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include "includes.h"
+#include "list.h"
+#include "event.h"
+
+/* Addresses kept per name, and the longest name cached */
+#define DNS_MAX_ADDRS		16
+#define DNS_HOST_MAX		256
+
+/*
+ * getaddrinfo() has no TTL to give, answers are kept this long. Names
+ * that do not exist are remembered for a shorter while.
+ */
+#define DNS_TTL_MS		(60 * 1000)
+#define DNS_NEG_TTL_MS		(5 * 1000)
+
+/* Cache size, and the threads resolving for dns_lookup() */
+#define DNS_CACHE_BUCKETS	256
+#define DNS_CACHE_MAX		4096
+#define DNS_THREADS		2
+
+struct dns_addr {
+	int family;
+	socklen_t len;
+	struct sockaddr_storage addr;
+};
+
+/*
+ * Addresses of a name, families interleaved as RFC 8305 section 4, or
+ * the getaddrinfo() error in 'err'. Ports are left for the caller.
+ */
+struct dns_result {
+	int err;
+	int num;
+	struct dns_addr addrs[DNS_MAX_ADDRS];
+};
+
+typedef void (*dns_cb)(struct ev_loop *loop, const struct dns_result *res,
+	void *arg);
+
+/*
+ * Resolve 'host' without blocking 'loop'. A cached answer is handed to
+ * 'cb' before dns_lookup() returns, else it is run on the loop's thread
+ * once resolved. Lookups of a name already being resolved wait for that
+ * one.
+ */
+int dns_lookup(struct ev_loop *loop, const char *host, dns_cb cb, void *arg);
+
+/* Drop every answer, and stop the resolver threads */
+void dns_shutdown(void);
+
+void dns_print_stats(void);
+
+#endif /* DNS_H */
@@ -0,0 +1,854 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <time.h>
+
+#include "includes.h"
+#include "event.h"
+#include "uring.h"
+#include "dbg.h"
+
+#ifdef EV_HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef EV_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/* Events handed out per wait */
+#define EV_BATCH	64
+
+/* io_uring submission entries, and receive buffers */
+#define EV_URING_ENTRIES	256
+#define EV_URING_BUF_NUM	32
+#define EV_URING_BUF_SIZE	(16 * 1024)
+
+static unsigned long long ev_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void ev_wake_cb(struct ev_loop *loop, int fd, int events, void *arg);
+
+/* The wake fd is watched like any other, once the backend is up */
+static int ev_wake_init(struct ev_loop *loop)
+{
+#ifdef EV_HAVE_EVENTFD
+	loop->wake_rd = loop->wake_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wake_rd < 0)
+		return MACSSH_FAILURE;
+#else
+	int fds[2];
+
+	if (pipe(fds) < 0)
+		return MACSSH_FAILURE;
+
+	loop->wake_rd = fds[0];
+	loop->wake_wr = fds[1];
+
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+	return ev_add(loop, loop->wake_rd, EV_READ, &ev_wake_cb, NULL);
+}
+
+struct ev_loop* ev_loop_new(int backend)
+{
+	struct ev_loop *loop = calloc(1, sizeof(struct ev_loop));
+
+	if (!loop)
+		return NULL;
+
+	loop->epfd = -1;
+	loop->wake_rd = loop->wake_wr = -1;
+	INIT_LIST_HEAD(&loop->timers);
+	pthread_mutex_init(&loop->post_lock, NULL);
+
+#ifdef EV_HAVE_URING
+	if (backend == EV_BACKEND_URING) {
+		loop->uring = malloc(sizeof(struct uring));
+		if (!loop->uring || uring_init(loop->uring, EV_URING_ENTRIES,
+			EV_URING_BUF_NUM, EV_URING_BUF_SIZE) != MACSSH_SUCCESS)
+			goto fail;
+
+		loop->backend = EV_BACKEND_URING;
+
+		goto done;
+	}
+#else
+	if (backend == EV_BACKEND_URING)
+		goto fail;
+#endif
+
+#ifdef EV_HAVE_EPOLL
+	if (backend != EV_BACKEND_POLL) {
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epfd >= 0)
+			loop->backend = EV_BACKEND_EPOLL;
+		else if (backend == EV_BACKEND_EPOLL)
+			goto fail;
+	}
+#else
+	if (backend == EV_BACKEND_EPOLL)
+		goto fail;
+#endif
+
+	if (loop->epfd < 0)
+		loop->backend = EV_BACKEND_POLL;
+done:
+	if (ev_wake_init(loop) != MACSSH_SUCCESS) {
+		ev_loop_free(loop);
+		return NULL;
+	}
+
+	return loop;
+fail:
+	free(loop->uring);
+	free(loop);
+	return NULL;
+}
+
+void ev_loop_free(struct ev_loop *loop)
+{
+	struct ev_timer *timer, *tmp;
+
+	if (!loop)
+		return;
+
+	list_for_each_entry_safe(timer, tmp, &loop->timers, list) {
+		list_del(&timer->list);
+		free(timer);
+	}
+
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+
+	if (loop->wake_wr >= 0 && loop->wake_wr != loop->wake_rd)
+		close(loop->wake_wr);
+	if (loop->wake_rd >= 0)
+		close(loop->wake_rd);
+
+	pthread_mutex_destroy(&loop->post_lock);
+
+#ifdef EV_HAVE_URING
+	if (loop->uring) {
+		uring_free(loop->uring);
+		free(loop->uring);
+	}
+#endif
+
+	free(loop->io);
+	free(loop->pfds);
+	free(loop);
+}
+
+static struct ev_io* ev_io_get(struct ev_loop *loop, int fd)
+{
+	if (fd < 0 || fd >= loop->io_size || !loop->io[fd].cb)
+		return NULL;
+
+	return &loop->io[fd];
+}
+
+/* Make the fd table cover 'fd' */
+static int ev_io_grow(struct ev_loop *loop, int fd)
+{
+	struct ev_io *io;
+	int size;
+
+	if (fd < loop->io_size)
+		return MACSSH_SUCCESS;
+
+	size = loop->io_size ? loop->io_size : 64;
+	while (size <= fd)
+		size *= 2;
+
+	io = realloc(loop->io, size * sizeof(struct ev_io));
+	if (!io)
+		return MACSSH_FAILURE;
+
+	memset(io + loop->io_size, 0,
+		(size - loop->io_size) * sizeof(struct ev_io));
+
+	loop->io = io;
+	loop->io_size = size;
+
+	return MACSSH_SUCCESS;
+}
+
+#ifdef EV_HAVE_EPOLL
+/*
+ * Push the interest of 'io' to the kernel. An fd without interest
+ * is taken out of the set, else it would still report hangups.
+ */
+static int ev_epoll_ctl(struct ev_loop *loop, int fd, struct ev_io *io)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (!(io->events & (EV_READ | EV_WRITE))) {
+		if (io->armed && !io->always && epoll_ctl(loop->epfd,
+			EPOLL_CTL_DEL, fd, NULL) < 0)
+			return MACSSH_FAILURE;
+
+		if (io->armed && io->always)
+			loop->always--;
+
+		io->armed = 0;
+
+		return MACSSH_SUCCESS;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+
+	if (io->events & EV_READ)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (io->events & EV_WRITE)
+		ev.events |= EPOLLOUT;
+	if (io->events & EV_ET)
+		ev.events |= EPOLLET;
+
+	op = io->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (!io->always && epoll_ctl(loop->epfd, op, fd, &ev) < 0) {
+		/* Regular files, which poll() reports ready all the time */
+		if (errno != EPERM || op != EPOLL_CTL_ADD)
+			return MACSSH_FAILURE;
+
+		io->always = 1;
+	}
+
+	if (io->always && !io->armed)
+		loop->always++;
+
+	io->armed = 1;
+
+	return MACSSH_SUCCESS;
+}
+#endif
+
+#ifdef EV_HAVE_URING
+/*
+ * Completions carry the operation, the fd and the registration it was
+ * made for, so stale completions of a reused fd are told apart.
+ */
+enum {
+	EV_OP_POLL	= 1,
+	EV_OP_RECV	= 2,
+	EV_OP_SEND	= 3,
+	EV_OP_POLL_MOD	= 4,
+};
+
+#define EV_UDATA(op, io, fd)	(((uint64_t) (op) << 48) | \
+				((uint64_t) (io)->gen << 32) | (uint32_t) (fd))
+#define EV_UDATA_OP(u)		((int) ((u) >> 48))
+#define EV_UDATA_GEN(u)		((unsigned short) ((u) >> 32))
+#define EV_UDATA_FD(u)		((int) (uint32_t) (u))
+
+/*
+ * Readiness is a one-shot poll, armed again after every dispatch. A
+ * poll in flight is updated to new interest, or removed without any.
+ */
+static int ev_uring_poll(struct ev_loop *loop, int fd, struct ev_io *io)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int events = 0;
+
+	if (io->armed && (io->events & EV_READ))
+		events |= POLLIN;
+	if (io->armed && (io->events & EV_WRITE))
+		events |= POLLOUT;
+
+	if (io->polling ? events == io->poll_events : !events)
+		return MACSSH_SUCCESS;
+
+	sqe = uring_get_sqe(loop->uring);
+	if (!sqe)
+		return MACSSH_FAILURE;
+
+	if (io->polling) {
+		/* Its completion arms a new poll if this comes too late */
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = EV_UDATA(EV_OP_POLL, io, fd);
+		if (events)
+			sqe->len = IORING_POLL_UPDATE_EVENTS;
+		sqe->user_data = EV_UDATA(EV_OP_POLL_MOD, io, fd);
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->user_data = EV_UDATA(EV_OP_POLL, io, fd);
+		io->polling = 1;
+	}
+
+	sqe->poll32_events = events;
+	io->poll_events = events;
+
+	return MACSSH_SUCCESS;
+}
+
+static int ev_uring_recv(struct ev_loop *loop, int fd, struct ev_io *io)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(loop->uring);
+	if (!sqe)
+		return MACSSH_FAILURE;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+
+	/* Multishot takes the length from the buffers */
+	if (io->recv_oneshot)
+		sqe->len = loop->uring->buf_size;
+	else
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+
+	sqe->user_data = EV_UDATA(EV_OP_RECV, io, fd);
+
+	return MACSSH_SUCCESS;
+}
+
+static void ev_uring_complete(struct ev_loop *loop, uint64_t udata, int res,
+	unsigned int flags)
+{
+	struct uring *ring = loop->uring;
+	int fd = EV_UDATA_FD(udata);
+	struct ev_io *io = ev_io_get(loop, fd);
+	unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	int events;
+
+	/* The registration it was made for is gone */
+	if (!io || io->gen != EV_UDATA_GEN(udata)) {
+		if (flags & IORING_CQE_F_BUFFER)
+			uring_buf_recycle(ring, bid);
+		return;
+	}
+
+	/* Nothing to do either way, the poll itself completes */
+	if (EV_UDATA_OP(udata) == EV_OP_POLL_MOD)
+		return;
+
+	loop->events++;
+
+	switch (EV_UDATA_OP(udata)) {
+	case EV_OP_POLL:
+		io->polling = 0;
+
+		/* Removed, then armed again before the removal completed */
+		if (!io->armed || res == -ECANCELED) {
+			ev_uring_poll(loop, fd, io);
+			break;
+		}
+
+		/* Completed before an update took, with the old interest */
+		events = 0;
+		if (res < 0 || (res & (POLLERR | POLLNVAL)))
+			events |= EV_ERROR;
+		if (res > 0 && (res & (POLLIN | POLLHUP)) &&
+			(io->events & EV_READ))
+			events |= EV_READ;
+		if (res > 0 && (res & POLLOUT) && (io->events & EV_WRITE))
+			events |= EV_WRITE;
+
+		if (events)
+			io->cb(loop, fd, events, io->arg);
+
+		io = ev_io_get(loop, fd);
+		if (io && io->gen == EV_UDATA_GEN(udata))
+			ev_uring_poll(loop, fd, io);
+		break;
+	case EV_OP_RECV:
+		if (res == -EINVAL && !io->recv_oneshot) {
+			/* Kernel without multishot receives */
+			io->recv_oneshot = 1;
+			ev_uring_recv(loop, fd, io);
+			break;
+		}
+
+		if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+			/* Handed on synchronously, so the buffer is free after */
+			io->recv(loop, fd, uring_buf(ring, bid), res, io->arg);
+			uring_buf_recycle(ring, bid);
+		} else if (res != -ENOBUFS) {
+			io->recv(loop, fd, NULL, res, io->arg);
+			break;
+		}
+
+		/* Ran out of buffers, or a single shot finished */
+		io = ev_io_get(loop, fd);
+		if (io && io->gen == EV_UDATA_GEN(udata) && io->recv &&
+			!(flags & IORING_CQE_F_MORE))
+			ev_uring_recv(loop, fd, io);
+		break;
+	case EV_OP_SEND:
+		if (io->sent)
+			io->sent(loop, fd, res, io->arg);
+		break;
+	}
+}
+
+static int ev_wait_uring(struct ev_loop *loop, int timeout)
+{
+	struct io_uring_cqe *cqe;
+	uint64_t udata;
+	unsigned int flags;
+	int res;
+
+	/* Everything queued since the last wait goes in the same call */
+	if (uring_submit_wait(loop->uring, 1, timeout) < 0)
+		return MACSSH_FAILURE;
+
+	while ((cqe = uring_peek_cqe(loop->uring))) {
+		udata = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		uring_cqe_seen(loop->uring);
+
+		ev_uring_complete(loop, udata, res, flags);
+	}
+
+	return MACSSH_SUCCESS;
+}
+#endif
+
+int ev_recv_start(struct ev_loop *loop, int fd, ev_recv_cb cb)
+{
+	struct ev_io *io = ev_io_get(loop, fd);
+
+	if (!io || !cb || loop->backend != EV_BACKEND_URING)
+		return MACSSH_FAILURE;
+
+	io->recv = cb;
+
+#ifdef EV_HAVE_URING
+	return ev_uring_recv(loop, fd, io);
+#else
+	return MACSSH_FAILURE;
+#endif
+}
+
+int ev_send(struct ev_loop *loop, int fd, const void *data, size_t len,
+	int link, ev_send_cb cb)
+{
+	struct ev_io *io = ev_io_get(loop, fd);
+
+	if (!io || !cb || loop->backend != EV_BACKEND_URING)
+		return MACSSH_FAILURE;
+
+	io->sent = cb;
+
+#ifdef EV_HAVE_URING
+	struct io_uring_sqe *sqe = uring_get_sqe(loop->uring);
+	if (!sqe)
+		return MACSSH_FAILURE;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) data;
+	sqe->len = len;
+
+	/* A short send must fail the link, not let the next one go */
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	if (link)
+		sqe->flags = IOSQE_IO_LINK;
+
+	sqe->user_data = EV_UDATA(EV_OP_SEND, io, fd);
+
+	return MACSSH_SUCCESS;
+#else
+	return MACSSH_FAILURE;
+#endif
+}
+
+static int ev_io_update(struct ev_loop *loop, int fd, struct ev_io *io)
+{
+#ifdef EV_HAVE_EPOLL
+	if (loop->backend == EV_BACKEND_EPOLL)
+		return ev_epoll_ctl(loop, fd, io);
+#endif
+
+#ifdef EV_HAVE_URING
+	if (loop->backend == EV_BACKEND_URING) {
+		io->armed = !!(io->events & (EV_READ | EV_WRITE));
+		return ev_uring_poll(loop, fd, io);
+	}
+#endif
+
+	io->armed = !!(io->events & (EV_READ | EV_WRITE));
+	loop->pfds_dirty = 1;
+
+	return MACSSH_SUCCESS;
+}
+
+int ev_add(struct ev_loop *loop, int fd, int events, ev_io_cb cb, void *arg)
+{
+	struct ev_io *io;
+
+	if (fd < 0 || !cb || ev_io_get(loop, fd))
+		return MACSSH_FAILURE;
+
+	if (ev_io_grow(loop, fd) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	io = &loop->io[fd];
+	io->events = events;
+	io->armed = 0;
+	io->cb = cb;
+	io->arg = arg;
+
+	/* Tells completions for an earlier user of the fd apart */
+	io->gen++;
+	io->recv = NULL;
+	io->sent = NULL;
+	io->polling = 0;
+	io->poll_events = 0;
+	io->recv_oneshot = 0;
+	io->always = 0;
+
+	if (ev_io_update(loop, fd, io) != MACSSH_SUCCESS) {
+		io->cb = NULL;
+		return MACSSH_FAILURE;
+	}
+
+	return MACSSH_SUCCESS;
+}
+
+int ev_mod(struct ev_loop *loop, int fd, int events)
+{
+	struct ev_io *io = ev_io_get(loop, fd);
+
+	if (!io)
+		return MACSSH_FAILURE;
+
+	if (io->events == events)
+		return MACSSH_SUCCESS;
+
+	io->events = events;
+
+	return ev_io_update(loop, fd, io);
+}
+
+int ev_del(struct ev_loop *loop, int fd)
+{
+	struct ev_io *io = ev_io_get(loop, fd);
+
+	if (!io)
+		return MACSSH_FAILURE;
+
+	io->events = 0;
+	ev_io_update(loop, fd, io);
+
+	io->cb = NULL;
+	io->arg = NULL;
+	io->recv = NULL;
+	io->sent = NULL;
+
+	return MACSSH_SUCCESS;
+}
+
+static void ev_wake_cb(struct ev_loop *loop, int fd, int events, void *arg)
+{
+	struct ev_post *post, *next, *list = NULL;
+	unsigned char drain[64];
+
+	/* Clear the wakeup before taking the posts, a later post wakes us
+	 * again */
+	while (read(fd, drain, sizeof(drain)) > 0)
+		;
+
+	pthread_mutex_lock(&loop->post_lock);
+	post = loop->posted;
+	loop->posted = NULL;
+	pthread_mutex_unlock(&loop->post_lock);
+
+	/* Newest first on the list, run them oldest first */
+	for (; post; post = next) {
+		next = post->next;
+		post->next = list;
+		list = post;
+	}
+
+	for (post = list; post; post = next) {
+		next = post->next;
+		post->cb(loop, post->arg);
+		loop->events++;
+	}
+}
+
+int ev_post(struct ev_loop *loop, struct ev_post *post)
+{
+	uint64_t one = 1;
+	int wake;
+
+	pthread_mutex_lock(&loop->post_lock);
+	wake = !loop->posted;
+	post->next = loop->posted;
+	loop->posted = post;
+	pthread_mutex_unlock(&loop->post_lock);
+
+	/* A non-empty list already has a wakeup pending */
+	if (wake && write(loop->wake_wr, &one, sizeof(one)) < 0 &&
+		errno != EAGAIN)
+		return MACSSH_FAILURE;
+
+	return MACSSH_SUCCESS;
+}
+
+struct ev_timer* ev_timer_add(struct ev_loop *loop, unsigned int ms,
+	ev_timer_cb cb, void *arg)
+{
+	struct ev_timer *timer, *pos;
+
+	timer = malloc(sizeof(struct ev_timer));
+	if (!timer)
+		return NULL;
+
+	timer->expire = ev_now() + ms;
+	timer->cb = cb;
+	timer->arg = arg;
+
+	/* Keep the list ordered, the first timer is the next to fire */
+	list_for_each_entry(pos, &loop->timers, list)
+		if (pos->expire > timer->expire)
+			break;
+
+	list_add_tail(&timer->list, &pos->list);
+
+	return timer;
+}
+
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *timer)
+{
+	if (!timer)
+		return;
+
+	list_del(&timer->list);
+	free(timer);
+}
+
+/* Milliseconds until the next timer, -1 for none */
+static int ev_timeout(struct ev_loop *loop)
+{
+	struct ev_timer *timer;
+	unsigned long long now;
+
+	if (list_empty(&loop->timers))
+		return -1;
+
+	timer = list_entry(loop->timers.next, struct ev_timer, list);
+	now = ev_now();
+
+	if (timer->expire <= now)
+		return 0;
+
+	return MIN(timer->expire - now, INT_MAX);
+}
+
+static void ev_run_timers(struct ev_loop *loop)
+{
+	struct ev_timer *timer;
+	unsigned long long now = ev_now();
+
+	while (!list_empty(&loop->timers)) {
+		timer = list_entry(loop->timers.next, struct ev_timer, list);
+		if (timer->expire > now)
+			break;
+
+		/* Unlinked first, the callback may add timers */
+		list_del(&timer->list);
+		timer->cb(loop, timer->arg);
+		free(timer);
+	}
+}
+
+static void ev_dispatch(struct ev_loop *loop, int fd, int events)
+{
+	struct ev_io *io = ev_io_get(loop, fd);
+
+	/* Removed by an earlier callback of this round */
+	if (!io || !io->armed)
+		return;
+
+	loop->events++;
+	io->cb(loop, fd, events, io->arg);
+}
+
+#ifdef EV_HAVE_EPOLL
+static int ev_wait_epoll(struct ev_loop *loop, int timeout)
+{
+	struct epoll_event evs[EV_BATCH];
+	struct ev_io *io;
+	int num, events, fd;
+
+	/* Nothing to sleep for while an fd is always ready */
+	num = epoll_wait(loop->epfd, evs, EV_BATCH,
+		loop->always ? 0 : timeout);
+	if (num < 0)
+		return (errno == EINTR) ? MACSSH_SUCCESS : MACSSH_FAILURE;
+
+	int x;
+	for (x = 0; x < num; x++) {
+		events = 0;
+
+		if (evs[x].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+			events |= EV_READ;
+		if (evs[x].events & EPOLLOUT)
+			events |= EV_WRITE;
+		if (evs[x].events & EPOLLERR)
+			events |= EV_ERROR;
+
+		ev_dispatch(loop, evs[x].data.fd, events);
+	}
+
+	for (fd = 0; loop->always && fd < loop->io_size; fd++) {
+		io = &loop->io[fd];
+		events = io->events & (EV_READ | EV_WRITE);
+
+		if (io->always && io->armed)
+			ev_dispatch(loop, fd, events);
+	}
+
+	return MACSSH_SUCCESS;
+}
+#endif
+
+/* Rebuild the pollfd set from the fd table */
+static int ev_poll_rebuild(struct ev_loop *loop)
+{
+	struct pollfd *pfds;
+	struct ev_io *io;
+	int fd, num = 0;
+
+	pfds = realloc(loop->pfds, (loop->io_size + 1) * sizeof(struct pollfd));
+	if (!pfds)
+		return MACSSH_FAILURE;
+
+	loop->pfds = pfds;
+
+	for (fd = 0; fd < loop->io_size; fd++) {
+		io = &loop->io[fd];
+		if (!io->cb || !io->armed)
+			continue;
+
+		pfds[num].fd = fd;
+		pfds[num].events = 0;
+		if (io->events & EV_READ)
+			pfds[num].events |= POLLIN;
+		if (io->events & EV_WRITE)
+			pfds[num].events |= POLLOUT;
+		num++;
+	}
+
+	loop->pfds_num = num;
+	loop->pfds_dirty = 0;
+
+	return MACSSH_SUCCESS;
+}
+
+static int ev_wait_poll(struct ev_loop *loop, int timeout)
+{
+	int num, events;
+
+	if (loop->pfds_dirty && ev_poll_rebuild(loop) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	num = poll(loop->pfds, loop->pfds_num, timeout);
+	if (num < 0)
+		return (errno == EINTR) ? MACSSH_SUCCESS : MACSSH_FAILURE;
+
+	/* Callbacks may change the set, walk the one that was polled */
+	int x;
+	for (x = 0; x < loop->pfds_num && num > 0; x++) {
+		if (!loop->pfds[x].revents)
+			continue;
+
+		events = 0;
+		if (loop->pfds[x].revents & (POLLIN | POLLHUP))
+			events |= EV_READ;
+		if (loop->pfds[x].revents & POLLOUT)
+			events |= EV_WRITE;
+		if (loop->pfds[x].revents & (POLLERR | POLLNVAL))
+			events |= EV_ERROR;
+
+		num--;
+		ev_dispatch(loop, loop->pfds[x].fd, events);
+	}
+
+	return MACSSH_SUCCESS;
+}
+
+int ev_run_once(struct ev_loop *loop)
+{
+	int timeout = ev_timeout(loop);
+	int ret;
+
+	loop->waits++;
+
+#ifdef EV_HAVE_URING
+	if (loop->backend == EV_BACKEND_URING)
+		ret = ev_wait_uring(loop, timeout);
+	else
+#endif
+#ifdef EV_HAVE_EPOLL
+	if (loop->backend == EV_BACKEND_EPOLL)
+		ret = ev_wait_epoll(loop, timeout);
+	else
+#endif
+		ret = ev_wait_poll(loop, timeout);
+
+	ev_run_timers(loop);
+
+	return ret;
+}
+
+int ev_run(struct ev_loop *loop)
+{
+	loop->stop = 0;
+
+	while (!loop->stop)
+		if (ev_run_once(loop) != MACSSH_SUCCESS)
+			return MACSSH_FAILURE;
+
+	return MACSSH_SUCCESS;
+}
+
+void ev_stop(struct ev_loop *loop)
+{
+	loop->stop = 1;
+}
+
+void ev_print_stats(struct ev_loop *loop)
+{
+	static const char *names[] = { "auto", "epoll", "poll", "io_uring" };
+
+	macssh_info("ev %s: %llu waits, %llu events, %.2f events/wait",
+		names[loop->backend], loop->waits, loop->events,
+		loop->waits ? (double) loop->events / loop->waits : 0.0);
+}
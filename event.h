@@ -0,0 +1,203 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "includes.h"
+#include "list.h"
+
+/*
+ * epoll where the platform has it, poll() everywhere else. The
+ * backend is picked once per loop, EV_BACKEND_AUTO prefers epoll.
+ */
+#if defined(__linux__)
+#define EV_HAVE_EPOLL
+#define EV_HAVE_URING
+#define EV_HAVE_EVENTFD
+#endif
+
+/*
+ * io_uring is only used when asked for. Besides readiness it moves
+ * socket data itself, see ev_recv_start() and ev_send().
+ */
+enum {
+	EV_BACKEND_AUTO		= 0,
+	EV_BACKEND_EPOLL	= 1,
+	EV_BACKEND_POLL		= 2,
+	EV_BACKEND_URING	= 3,
+};
+
+/* Interest and readiness */
+#define EV_READ		0x01
+#define EV_WRITE	0x02
+#define EV_ERROR	0x04
+
+/*
+ * Edge-triggered: an event is only reported when the fd becomes ready,
+ * so the callback must read or write until EAGAIN. Only epoll honours
+ * it. poll() is level-triggered, and io_uring re-arms its one-shot poll
+ * after every completion, both report a ready fd on every wait. Ask
+ * for EV_WRITE only while there is something to write.
+ */
+#define EV_ET		0x08
+
+struct ev_loop;
+
+typedef void (*ev_io_cb)(struct ev_loop *loop, int fd, int events,
+	void *arg);
+typedef void (*ev_timer_cb)(struct ev_loop *loop, void *arg);
+
+/* Received data, or 'len' <= 0 for end of file or -errno */
+typedef void (*ev_recv_cb)(struct ev_loop *loop, int fd,
+	const unsigned char *data, int len, void *arg);
+
+/* Bytes sent, or -errno; -ECANCELED behind a failed linked send */
+typedef void (*ev_send_cb)(struct ev_loop *loop, int fd, int res,
+	void *arg);
+
+/* Run on the loop's own thread, see ev_post() */
+typedef void (*ev_post_cb)(struct ev_loop *loop, void *arg);
+
+/* Posted callback, owned by the poster until it ran */
+struct ev_post {
+	ev_post_cb cb;
+	void *arg;
+	struct ev_post *next;
+};
+
+struct uring;
+
+/* A registered fd. Disabled (no interest) fds stay registered. */
+struct ev_io {
+	int events;
+	int armed;
+	ev_io_cb cb;
+	void *arg;
+
+	/* io_uring: operations in flight, and what they complete to */
+	ev_recv_cb recv;
+	ev_send_cb sent;
+	unsigned short gen;
+	int polling;
+	unsigned int poll_events;	/* what the poll in flight waits for */
+	int recv_oneshot;
+
+	/* epoll: not in the set, reported ready on every wait */
+	int always;
+};
+
+/* One shot timer, kept on a list ordered by expiry */
+struct ev_timer {
+	unsigned long long expire;
+	ev_timer_cb cb;
+	void *arg;
+
+	struct list_head list;
+};
+
+struct ev_loop {
+	int backend;
+
+	/* epoll instance, -1 for the poll backend */
+	int epfd;
+
+	/* Armed fds epoll refused, see struct ev_io */
+	int always;
+
+	/* Indexed by fd */
+	struct ev_io *io;
+	int io_size;
+
+	/* pollfd set of the poll backend, rebuilt when dirty */
+	struct pollfd *pfds;
+	int pfds_num;
+	int pfds_dirty;
+
+	/* io_uring backend */
+	struct uring *uring;
+
+	struct list_head timers;
+
+	/*
+	 * Callbacks posted from other threads, newest first, and the fd
+	 * waking the loop for them. One fd for eventfd, a pipe otherwise.
+	 */
+	pthread_mutex_t post_lock;
+	struct ev_post *posted;
+	int wake_rd;
+	int wake_wr;
+
+	int stop;
+
+	/* Waits (syscalls) and dispatched events, for the stats */
+	unsigned long long waits;
+	unsigned long long events;
+};
+
+struct ev_loop* ev_loop_new(int backend);
+void ev_loop_free(struct ev_loop *loop);
+
+/*
+ * Register 'fd' with interest in 'events' (EV_READ, EV_WRITE, EV_ET).
+ * With no interest the fd is registered, but never reported.
+ */
+int ev_add(struct ev_loop *loop, int fd, int events, ev_io_cb cb, void *arg);
+int ev_mod(struct ev_loop *loop, int fd, int events);
+int ev_del(struct ev_loop *loop, int fd);
+
+/*
+ * io_uring only. Keep receiving from 'fd' into provided buffers, one
+ * multishot request serving every arrival. Registered with ev_add().
+ */
+int ev_recv_start(struct ev_loop *loop, int fd, ev_recv_cb cb);
+
+/*
+ * io_uring only. Queue a send of 'len' bytes, submitted with the next
+ * wait. With 'link' the following ev_send() on the loop only starts
+ * once this one fully completed, else it is canceled.
+ */
+int ev_send(struct ev_loop *loop, int fd, const void *data, size_t len,
+	int link, ev_send_cb cb);
+
+/*
+ * The one thread safe call: have the loop run post->cb(loop, post->arg)
+ * on its own thread, in posting order. 'post' must stay valid until
+ * then.
+ */
+int ev_post(struct ev_loop *loop, struct ev_post *post);
+
+/* Call 'cb' once, 'ms' milliseconds from now */
+struct ev_timer* ev_timer_add(struct ev_loop *loop, unsigned int ms,
+	ev_timer_cb cb, void *arg);
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *timer);
+
+/*
+ * Wait for and dispatch one round of events. Blocks without a timeout
+ * when no timer is pending, so an idle loop never wakes up.
+ */
+int ev_run_once(struct ev_loop *loop);
+
+/* Dispatch until ev_stop(), or an error */
+int ev_run(struct ev_loop *loop);
+void ev_stop(struct ev_loop *loop);
+
+void ev_print_stats(struct ev_loop *loop);
+
+#endif /* EVENT_H */
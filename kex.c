@@ -26,16 +26,25 @@
 #include "ssh-session.h"
 #include "dbg.h"
 #include "keys.h"
+#include "cipher.h"
+#include "shani.h"
 
-int kex_status = 0;
+__thread int kex_status = 0;
+
+static struct threadpool *kex_pool;
 
 /* Used to force mp_ints to be initialised */
 #define DEF_MP_INT(X) mp_int X = {0, 0, 0, NULL}
 
 /* Forward declarations */
-static void kex_negotiate(struct packet *pck);
-static struct algorithm* kex_try_match(struct exchange_list_remote* rem,
+static int kex_negotiate(struct packet *pck);
+static struct algorithm* kex_try_match(struct packet_view *rem,
 	struct exchange_list_local* loc);
+static struct algorithm* kex_try_match_first(struct packet_view *rem,
+	struct exchange_list_local *loc, struct algorithm *first);
+static int kex_first_is(struct packet_view *rem, const struct algorithm *algo);
+static void kex_cache_learn(struct packet_view *rem_kex,
+	struct packet_view *rem_host);
 
 int kex_dh_compute();
 int kex_dh_init();
@@ -81,11 +90,10 @@ struct exchange_list_local kex_list = {
 	.algos =
 	{
 		{"diffie-hellman-group14-sha1", NULL},
-		{"diffie-hellman-group1-sha1", NULL},
 		{"diffie-hellman-group14-sha256", NULL}
 	},
 
-	.num = 3
+	.num = 2
 
 };
 
@@ -109,22 +117,25 @@ struct exchange_list_local cipher_list = {
 
 	.algos =
 	{
-		{"aes128-ctr", &aes_desc},
-		{"aes256-ctr", NULL},
-		{"twofish256-ctr", &twofish_desc},
-		{"twofish128-ctr", NULL},
-		{"aes128-cbc", NULL},
-		{"aes256-cbc", NULL},
-		{"twofish256-cbc", NULL},
-		{"twofish-cbc", NULL},
-		{"twofish128-cbc", NULL},
-		{"3des-ctr", &des3_desc},
-		{"3des-cbc", NULL},
-		{"blowfish-cbc", &blowfish_desc},
-		{"none", NULL},
+		{"aes128-gcm@openssh.com", &ssh_aes128_gcm},
+		{"aes256-gcm@openssh.com", &ssh_aes256_gcm},
+		{"chacha20-poly1305@openssh.com", &ssh_chachapoly},
+		{"aes128-ctr", &ssh_aes128_ctr},
+		{"aes256-ctr", &ssh_aes256_ctr},
+		{"twofish256-ctr", &ssh_twofish256_ctr},
+		{"twofish128-ctr", &ssh_twofish128_ctr},
+		{"aes128-cbc", &ssh_aes128_cbc},
+		{"aes256-cbc", &ssh_aes256_cbc},
+		{"twofish256-cbc", &ssh_twofish256_cbc},
+		{"twofish-cbc", &ssh_twofish256_cbc},
+		{"twofish128-cbc", &ssh_twofish128_cbc},
+		{"3des-ctr", &ssh_3des_ctr},
+		{"3des-cbc", &ssh_3des_cbc},
+		{"blowfish-cbc", &ssh_blowfish_cbc},
+		{"none", &ssh_none},
 	},
 
-	.num = 13
+	.num = 16
 
 };
 
@@ -133,14 +144,22 @@ struct exchange_list_local hash_list = {
 
 	.algos =
 	{
-		{"hmac-sha1", &sha1_desc},
-		{"hmac-sha2-256", &sha256_desc},
-		{"hmac-sha2-512", &sha512_desc},
-		{"hmac-md5", &md5_desc},
+		{"umac-64-etm@openssh.com", &ssh_umac64_etm},
+		{"umac-128-etm@openssh.com", &ssh_umac128_etm},
+		{"hmac-sha2-256-etm@openssh.com", &ssh_hmac_sha256_etm},
+		{"hmac-sha2-512-etm@openssh.com", &ssh_hmac_sha512_etm},
+		{"hmac-sha1-etm@openssh.com", &ssh_hmac_sha1_etm},
+		{"umac-64@openssh.com", &ssh_umac64},
+		{"umac-128@openssh.com", &ssh_umac128},
+		{"hmac-sha1", &ssh_hmac_sha1},
+		{"hmac-sha2-256", &ssh_hmac_sha256},
+		{"hmac-sha2-512", &ssh_hmac_sha512},
+		{"hmac-md5-etm@openssh.com", &ssh_hmac_md5_etm},
+		{"hmac-md5", &ssh_hmac_md5},
 		{"none", NULL},
 	},
 
-	.num = 5
+	.num = 13
 
 };
 
@@ -168,7 +187,25 @@ struct exchange_list_local lang_list = {
 	.num = 1
 };
 
-void kex_init()
+/* Keep a copy of 'len' bytes at 'src', it goes into H later */
+static int kex_save(unsigned char **dst, unsigned int *dst_len,
+	const void *src, unsigned int len)
+{
+	free(*dst);
+	*dst_len = 0;
+
+	*dst = malloc(len ? len : 1);
+	if (!*dst)
+		return KEX_FAIL;
+
+	memcpy(*dst, src, len);
+	*dst_len = len;
+
+	return KEX_OK;
+}
+
+/* Build and seal our KEXINIT */
+struct packet* kex_new_init()
 {
 	/*	
 	byte         SSH_MSG_KEXINIT
@@ -186,90 +223,132 @@ void kex_init()
 	boolean      first_kex_packet_follows
 	uint32       0 (reserved for future extension) */
 
-	struct packet *kex_dh_pck;
-	struct packet *pck = packet_new(1024);
-	pck->len = 5; //Make room for size and pad size
-	char *cookie = (char *) get_random_bytes(16);
-
-	pck->put_byte(pck, SSH_MSG_KEXINIT);
-	pck->put_bytes(pck, cookie, 16);
-	pck->put_exch_list(pck, &kex_list);
-	pck->put_exch_list(pck, &host_list);
-	pck->put_exch_list(pck, &cipher_list);
-	pck->put_exch_list(pck, &cipher_list);
-	pck->put_exch_list(pck, &hash_list);
-	pck->put_exch_list(pck, &hash_list);
-	pck->put_exch_list(pck, &compress_list);
-	pck->put_exch_list(pck, &compress_list);
-	pck->put_int(pck, 0); //Empty language list
-	pck->put_int(pck, 0); //Empty language list
-
-	pck->put_byte(pck, 0); //No guess
-	pck->put_int(pck, 0); //Reserved
-
-	/* Stamp with metadata */
-	put_stamp(pck);
+	struct packet *pck = packet_new_msg(SSH_MSG_KEXINIT, 1024);
+	char *cookie;
 
-	struct packet *kex_resp;
+	if (!pck)
+		return NULL;
 
-	if (ses.state == HAVE_KEX_INIT) {
-		kex_resp = ses.pck_tmp;
-		kex_resp->rd_pos += 5;
-	} else {
-		kex_resp = ses.read_packet();
+	/* Only a client guesses, a server's KEXDH_REPLY needs the client */
+	ses->guess_kex = NULL;
+	ses->guess_host = NULL;
+	ses->kex_guessed = 0;
+	if (!ses->is_server)
+		kex_guess();
+
+	cookie = (char *) get_random_bytes(16);
+
+	packet_put_bytes(pck, cookie, 16);
+	packet_put_exch_list_first(pck, &kex_list, ses->guess_kex);
+	packet_put_exch_list_first(pck, &host_list, ses->guess_host);
+	packet_put_exch_list(pck, &cipher_list);
+	packet_put_exch_list(pck, &cipher_list);
+	packet_put_exch_list(pck, &hash_list);
+	packet_put_exch_list(pck, &hash_list);
+	packet_put_exch_list(pck, &compress_list);
+	packet_put_exch_list(pck, &compress_list);
+	packet_put_int(pck, 0); //Empty language list
+	packet_put_int(pck, 0); //Empty language list
+
+	packet_put_byte(pck, ses->kex_guessed); //first_kex_packet_follows
+	packet_put_int(pck, 0); //Reserved
+
+	/* The payload is I_C or I_S of the exchange hash */
+	if (kex_save(&ses->dh->init_local, &ses->dh->init_local_len,
+		pck->data + PACKET_HDR_LEN,
+		pck->len - PACKET_HDR_LEN) != KEX_OK) {
+		packet_free(pck);
+		return NULL;
 	}
 
-	/*
-	 * Check that we indeed have a KEX_INIT packet waiting in,
-	 * the buffer.
-	 */
-	if (kex_resp->get_byte(kex_resp) == SSH_MSG_KEXINIT) {
-		kex_negotiate(kex_resp);
-	} else {
+	/* Pad and stamp with metadata */
+	packet_seal(pck);
+
+	return pck;
+}
+
+/*
+ * Check that 'pck' is indeed the remote KEX_INIT, and agree on the
+ * algorithms
+ */
+int kex_recv_init(struct packet *pck)
+{
+	unsigned char msg, pad;
+
+	if (packet_read_byte(pck, &msg) != MACSSH_SUCCESS ||
+		msg != SSH_MSG_KEXINIT) {
 		macssh_err("Expected remote KEX_INIT. "
 			"Found something else.", -1);
+		return KEX_FAIL;
+	}
 
-		exit(EXIT_FAILURE);
+	/* Payload without the padding, the other KEXINIT of H */
+	pad = (unsigned char) pck->data[4];
+	if (pad > pck->len - PACKET_HDR_LEN ||
+		kex_save(&ses->dh->init_remote, &ses->dh->init_remote_len,
+		pck->data + PACKET_HDR_LEN,
+		pck->len - PACKET_HDR_LEN - pad) != KEX_OK)
+		return KEX_FAIL;
+
+	if (kex_negotiate(pck) != KEX_OK) {
+		macssh_warn("No common algorithms, or malformed KEX_INIT");
+		return KEX_FAIL;
 	}
 
-	if (ses.state == HAVE_KEX_INIT)
-		ses.pck_tmp = NULL;
+	return KEX_OK;
+}
+
+void kex_init()
+{
+	struct packet *pck = kex_new_init();
+	struct packet *kex_resp;
 
-	free(kex_resp);
+	if (!pck)
+		exit(EXIT_FAILURE);
 
 	/* Send our KEX packet */
 	macssh_print_array(pck->data, pck->len);
 	macssh_print_embedded_string(pck->data, pck->len);
 
-	if (ses.write_packet(pck) == pck->len)
+	if (ses->write_packet(pck) == pck->len)
 		fprintf(stderr, "All bytes were transmitted\n");
 
-}
+	/*
+	 * A guess sends our DH values right away, instead of a round trip
+	 * later, after the server's KEXINIT
+	 */
+	if (ses->kex_guessed && kex_dh_init() != KEX_OK)
+		exit(EXIT_FAILURE);
 
-/* Initialize the diffie-hellman part of the key-exchange.
- * This will be done initially after connection has been,
- * established, but can also occur anytime during a ses. */
-int kex_dh_init()
-{
-	struct packet *pck = packet_new(1024);
+	/* Might already be in the receive ring, behind the id string */
+	kex_resp = ses->read_packet();
+	if (!kex_resp)
+		exit(EXIT_FAILURE);
 
-	pck->len = 5; //Make room for size and pad size
-	char *cookie = (char *) get_random_bytes(16);
+	if (kex_recv_init(kex_resp) != KEX_OK)
+		exit(EXIT_FAILURE);
 
-	pck->put_byte(pck, SSH_MSG_KEXDH_INIT);
-	//pck->put_bytes(pck, cookie, 16);
+	packet_free(kex_resp);
 
-	/*
-	 * Create our part of the DH values.
-	 */
-	struct diffie_hellman *dh = ses.dh;
+	if (ses->kex_guessed && !ses->kex_guess_ok)
+		macssh_info("Wrong KEX guess, the server ignores it");
+}
 
+/*
+ * Our private y and public g^y mod p, group14. Only touches 'dh', so
+ * it may run on any thread with a seeded prng.
+ */
+int kex_dh_gen(struct diffie_hellman *dh)
+{
 	DEF_MP_INT(dh_p);
 	DEF_MP_INT(dh_q);
 	DEF_MP_INT(dh_g);
+	int ret = KEX_FAIL;
 
-	/* Initialize dh struct and mp_int's */
-	dh = malloc(sizeof(struct diffie_hellman));
+	/* A new kex, or a second try after a wrong guess, start over */
+	mp_clear_multi(&dh->pub_key, &dh->priv_key, NULL);
+
+	/* Initialize mp_int's */
 	mp_init_multi(&dh->pub_key, &dh->priv_key, &dh_g, &dh_p, &dh_q, NULL);
 
 	unsigned int dh_p_len = 256;
@@ -278,15 +357,15 @@ int kex_dh_init()
 
 	/* Set the dh g value */
 	if (mp_set_int(&dh_g, DH_G_VAL) != MP_OKAY)
-		macssh_warn("Diffie-Hellman error");
+		goto out;
 
 	/* calculate q = (p-1)/2 */
 	/* dh_priv is just a temp var here */
 	if (mp_sub_d(&dh_p, 1, &dh->priv_key) != MP_OKAY)
-		macssh_warn("Diffie-Hellman error");
+		goto out;
 
 	if (mp_div_2(&dh->priv_key, &dh_q) != MP_OKAY)
-		macssh_warn("Diffie-Hellman error");
+		goto out;
 
 	/* Generate a private portion 0 < dh_priv < dh_q */
 	gen_random_mpint(&dh_q, &dh->priv_key);
@@ -294,49 +373,209 @@ int kex_dh_init()
 	/* f = g^y mod p 
 	 * public key portion */
 	if (mp_exptmod(&dh_g, &dh->priv_key, &dh_p, &dh->pub_key) != MP_OKAY)
-		macssh_warn("Diffie-Hellman error");
+		goto out;
 
+	ret = KEX_OK;
+out:
 	mp_clear_multi(&dh_g, &dh_p, &dh_q, NULL);
 
-	pck->put_mpint(pck, &dh->pub_key);
+	return ret;
+}
+
+/*
+ * Shared secret K = them^y mod p, after checking that 'them' is in the
+ * range [2, p-2]. Like kex_dh_gen() it only touches 'dh'.
+ */
+int kex_dh_shared(struct diffie_hellman *dh, mp_int *them)
+{
+	DEF_MP_INT(dh_p);
+	DEF_MP_INT(dh_p_min1);
+	int ret = KEX_FAIL;
+
+	unsigned int dh_p_len = 256;
+
+	mp_init_multi(&dh_p, &dh_p_min1, &dh->dh_k, NULL);
+
+	mp_read_unsigned_bin(&dh_p, dh_p_14, dh_p_len);
+
+	if (mp_sub_d(&dh_p, 1, &dh_p_min1) != MP_OKAY)
+		goto out;
+
+	if (mp_cmp(them, &dh_p_min1) != MP_LT || mp_cmp_d(them, 1) != MP_GT)
+		goto out;
+
+	if (mp_exptmod(them, &dh->priv_key, &dh_p, &dh->dh_k) != MP_OKAY)
+		goto out;
+
+	ret = KEX_OK;
+out:
+	mp_clear_multi(&dh_p, &dh_p_min1, NULL);
+
+	return ret;
+}
+
+static void kex_dh_gen_run(struct work *work)
+{
+	struct diffie_hellman *dh = work->arg;
+
+	dh->gen_ret = kex_dh_gen(dh);
+}
+
+static void kex_dh_gen_done(struct ev_loop *loop, void *arg)
+{
+	struct diffie_hellman *dh = arg;
+
+	dh->gen_state = KEX_DH_READY;
+}
+
+/*
+ * The exponentiation then overlaps the identification and KEXINIT
+ * round trips, instead of following them.
+ */
+int kex_dh_start(struct ev_loop *loop)
+{
+	struct diffie_hellman *dh = ses->dh;
+
+	if (!kex_pool)
+		kex_pool = threadpool_new(KEX_THREADS);
+	if (!kex_pool)
+		return KEX_FAIL;
+
+	dh->work.run = &kex_dh_gen_run;
+	dh->work.done = &kex_dh_gen_done;
+	dh->work.loop = loop;
+	dh->work.arg = dh;
+
+	dh->gen_state = KEX_DH_RUNNING;
+
+	if (threadpool_submit(kex_pool, &dh->work) != MACSSH_SUCCESS) {
+		dh->gen_state = KEX_DH_IDLE;
+		return KEX_FAIL;
+	}
+
+	return KEX_OK;
+}
+
+void kex_shutdown(void)
+{
+	threadpool_free(kex_pool);
+	kex_pool = NULL;
+}
+
+/* Our DH values, from the pool when started there, else computed here */
+static int kex_dh_values()
+{
+	struct diffie_hellman *dh = ses->dh;
+
+	if (dh->gen_state == KEX_DH_IDLE)
+		return kex_dh_gen(dh);
+
+	while (dh->gen_state == KEX_DH_RUNNING)
+		if (ev_run_once(dh->work.loop) != MACSSH_SUCCESS)
+			return KEX_FAIL;
+
+	/* A second kex_dh_init(), after a wrong guess, starts over */
+	dh->gen_state = KEX_DH_IDLE;
+
+	return dh->gen_ret;
+}
+
+/* Initialize the diffie-hellman part of the key-exchange.
+ * This will be done initially after connection has been,
+ * established, but can also occur anytime during a session. */
+int kex_dh_init()
+{
+	struct packet *pck;
+	int ret = KEX_FAIL;
+
+	/*
+	 * Create our part of the DH values.
+	 */
+	if (kex_dh_values() != KEX_OK) {
+		macssh_warn("Diffie-Hellman error");
+		return KEX_FAIL;
+	}
+
+	/* e is at most 4 + 1 + 256 bytes for group14 */
+	pck = packet_new_msg(SSH_MSG_KEXDH_INIT, 512);
+	if (!pck)
+		return KEX_FAIL;
+
+	packet_put_mpint(pck, &ses->dh->pub_key);
 
-	/* Stamp with metadata */
-	put_stamp_2(pck);
+	/* Pad and stamp with metadata */
+	packet_seal(pck);
 
 	macssh_info("Sending KEX_DH_INIT packet");
 
-	ses.write_packet(pck);
+	if (ses->write_packet(pck) == pck->len)
+		ret = KEX_OK;
+	else
+		macssh_warn("Could not send KEX_DH_INIT");
+
+	packet_free(pck);
+
+	return ret;
 }
 
 /* Server response to a client kex_dh_init */
 int kex_dh_reply()
 {
+	/*
+	byte      SSH_MSG_KEXDH_REPLY
+	string    server public host key and certificates (K_S)
+	mpint     f
+	string    signature of H */
+
 	struct packet *pck;
+	struct packet key_rd;
+	struct packet_view blob;
+	struct packet_view name;
+	struct packet_view sig;
+	struct ssh_rsa_key *rsa_key = &ses->dh->key;
+	unsigned char msg;
+
+	pck = ses->read_packet();
+
+	/* Sent on the server's wrong guess, ignored (RFC 4253 7.1) */
+	if (pck && ses->kex_discard) {
+		ses->kex_discard = 0;
+		packet_free(pck);
+		pck = ses->read_packet();
+	}
 
-	pck = ses.read_packet();
+	if (!pck)
+		return KEX_FAIL;
 
 	macssh_print_array(pck->data, pck->len);
 	macssh_print_embedded_string(pck->data, pck->len);
 
+	if (packet_read_byte(pck, &msg) != MACSSH_SUCCESS ||
+		msg != SSH_MSG_KEXDH_REPLY)
+		goto malformed;
+
 	/*
-	 * Get the host-key.
+	 * Get the host-key, and parse it where it is.
 	 */
-	INCREMENT_RD_POS(pck, 1);
+	if (packet_read_string(pck, &blob) != MACSSH_SUCCESS)
+		goto malformed;
 
-	int key_len = pck->get_int(pck);
-	int str_len = pck->get_int(pck);
+	/* K_S goes into H as it was sent */
+	if (kex_save(&ses->dh->host_key, &ses->dh->host_key_len, blob.ptr,
+		blob.len) != KEX_OK)
+		goto malformed;
 
-	struct ssh_rsa_key *rsa_key = malloc(sizeof(struct ssh_rsa_key));
+	packet_view_reader(&key_rd, &blob);
 
-	rsa_key->blob = pck->get_bytes(pck, key_len);
-	
-	/* Rewind :-) */
-	INCREMENT_RD_POS(pck, -key_len);
+	mp_init_multi(&rsa_key->e, &rsa_key->n, &ses->dh->dh_f, NULL);
 
-	rsa_key->e = pck->get_mpint(pck, NULL);
-	rsa_key->n = pck->get_mpint(pck, NULL);
+	if (packet_read_string(&key_rd, &name) != MACSSH_SUCCESS ||
+		!packet_view_eq(&name, "ssh-rsa") ||
+		packet_read_mpint(&key_rd, &rsa_key->e) != MACSSH_SUCCESS ||
+		packet_read_mpint(&key_rd, &rsa_key->n) != MACSSH_SUCCESS)
+		goto malformed;
 
-	if (mp_count_bits(rsa_key->n) < MIN_RSA_KEYLEN)
+	if (mp_count_bits(&rsa_key->n) < MIN_RSA_KEYLEN)
 		macssh_warn("RSA key too short");
 
 	/*
@@ -347,156 +586,637 @@ int kex_dh_reply()
 	if(!f)
 		macssh_err("Could not open ~.ssh/known_hosts");
 	
-	hostkey_validate(rsa_key->blob, key_len, "ssh-rsa");
+	hostkey_validate((unsigned char *) blob.ptr, blob.len, "ssh-rsa");
 
 	/*
-	 * Get 'f' value.
+	 * Get 'f' value, and the signature of H.
 	 */
-	mp_int *dh_f = pck->get_mpint(pck, NULL);
+	if (packet_read_mpint(pck, &ses->dh->dh_f) != MACSSH_SUCCESS ||
+		packet_read_string(pck, &sig) != MACSSH_SUCCESS)
+		goto malformed;
 
-	/*
-	 * Store a copy in DH struct.
-	 */
-	mp_copy(dh_f, &ses.dh->dh_f);
+	packet_free(pck);
 
-	ses.dh->key = rsa_key;
+	return KEX_OK;
 
+malformed:
+	macssh_warn("Malformed KEXDH_REPLY");
+
+	packet_free(pck);
+
+	return KEX_FAIL;
 }
 
-int kex_dh_exchange_hash()
+/* Hash function of the negotiated kex method */
+static const struct ltc_hash_descriptor* kex_hash_desc()
 {
-	DEF_MP_INT(dh_p);
-	DEF_MP_INT(dh_p_min1);
-	DEF_MP_INT(dh_e);
-	DEF_MP_INT(dh_f);
+	const char *name = ses->crypto->keys.kex->name;
+	int len = strlen(name);
 
-	unsigned int dh_p_len = 256;
+	if (len > 7 && !strcmp(name + len - 7, "-sha256"))
+		return &ssh_sha256_desc;
 
-	mp_init_multi(&dh_e, &dh_f, &dh_p, &dh_p_min1);
+	return &ssh_sha1_desc;
+}
 
-	mp_read_unsigned_bin(&dh_p, dh_p_14, dh_p_len);
+/* A length prefixed string into a running hash */
+static void kex_hash_string(const struct ltc_hash_descriptor *hash,
+	hash_state *hst, const void *data, unsigned int len)
+{
+	unsigned char buf[4];
 
-	if (mp_sub_d(&dh_p, 1, &dh_p_min1) != MP_OKAY) {
-		macssh_warn("Diffie-Hellman error");
-		exit(EXIT_FAILURE);
-	}
+	STORE32H(len, buf);
 
-	/* 
-	 * Check that dh_pub_them (dh_e or dh_f) is in the range [2, p-2] 
-	 */
-	if (mp_cmp(&dh_f, &dh_p_min1) != MP_LT
-		|| mp_cmp_d(&dh_f, 1) != MP_GT) {
-		macssh_warn("Diffie-Hellman error");
-		exit(EXIT_FAILURE);
-	}
+	hash->process(hst, buf, 4);
+	hash->process(hst, (const unsigned char *) data, len);
+}
+
+/*
+ * H = HASH(V_C || V_S || I_C || I_S || K_S || e || f || K), RFC 4253
+ * section 8. The id strings go in without their CR LF.
+ */
+int kex_dh_exchange_hash()
+{
+	struct diffie_hellman *dh = ses->dh;
+	const char *id_local = IDENTIFICATION_STRING;
+	unsigned int id_local_len = strlen(id_local) - 2;
+	DEF_MP_INT(dh_f);
+
+	mp_init(&dh_f);
+
+	/* Their f, as parsed by kex_dh_reply() */
+	mp_copy(&dh->dh_f, &dh_f);
 
 	/* 
 	 * K = e^y mod p = f^x mod p 
 	 */
-	mp_init(&ses.dh->dh_k);
-	if (mp_exptmod(&dh_f, &ses.dh->priv_key, &dh_p,
-		&ses.dh->dh_k) != MP_OKAY) {
+	if (kex_dh_shared(dh, &dh_f) != KEX_OK) {
 		macssh_warn("Diffie-Hellman error");
 		exit(EXIT_FAILURE);
 	}
 
-	/* clear no longer needed vars */
-	mp_clear_multi(&dh_p, &dh_p_min1, NULL);
+	if (!dh->init_local || !dh->init_remote || !dh->host_key) {
+		mp_clear(&dh_f);
+		return KEX_FAIL;
+	}
 
-	/*
-	 * Build the exchange hash packet
-	 */
-	struct packet *pck = packet_new(4096);
+	/* e, f and K, group14 values are 261 bytes at most each */
+	struct packet *pck = packet_new(1024);
 	const struct ltc_hash_descriptor *hash;
 	hash_state hst;
 
-	pck->put_str(pck, "ssh-rsa");
-	pck->put_mpint(pck, ses.dh->key->e); //Their RSA exponent
-	pck->put_mpint(pck, ses.dh->key->n); //Their RSA modulus
-
-	pck->put_mpint(pck, &ses.dh->pub_key); //dh_e
-	pck->put_mpint(pck, &dh_f); //dh_f
-	pck->put_mpint(pck, &ses.dh->dh_k); //dh_k
+	/* e is the client's public value, f the server's */
+	if (ses->is_server) {
+		packet_put_mpint(pck, &dh_f);
+		packet_put_mpint(pck, &dh->pub_key);
+	} else {
+		packet_put_mpint(pck, &dh->pub_key);
+		packet_put_mpint(pck, &dh_f);
+	}
+	packet_put_mpint(pck, &dh->dh_k);
 
-	hash = (const struct ltc_hash_descriptor *)
-		ses.crypto->keys.hash->algorithm;
+	hash = kex_hash_desc();
 
 	/*
-	 * Compute the hash and send it.
-	 * 
-	 * The packet might be resized to make room for the hash,
-	 * which will be concatenated to the original data.
+	 * Compute H. Keys are derived from it at NEWKEYS, and the
+	 * H of the first kex is the session id.
 	 */
 	hash->init(&hst);
-	hash->process(&hst, pck->data, pck->len);
 
-	SET_WR_POS(pck, pck->len);
+	if (ses->is_server) {
+		kex_hash_string(hash, &hst, ses->remote_id,
+			strlen(ses->remote_id));
+		kex_hash_string(hash, &hst, id_local, id_local_len);
+		kex_hash_string(hash, &hst, dh->init_remote,
+			dh->init_remote_len);
+		kex_hash_string(hash, &hst, dh->init_local,
+			dh->init_local_len);
+	} else {
+		kex_hash_string(hash, &hst, id_local, id_local_len);
+		kex_hash_string(hash, &hst, ses->remote_id,
+			strlen(ses->remote_id));
+		kex_hash_string(hash, &hst, dh->init_local,
+			dh->init_local_len);
+		kex_hash_string(hash, &hst, dh->init_remote,
+			dh->init_remote_len);
+	}
+
+	kex_hash_string(hash, &hst, dh->host_key, dh->host_key_len);
+	hash->process(&hst, (unsigned char *) pck->data, pck->len);
+	hash->done(&hst, dh->h);
+
+	dh->h_len = hash->hashsize;
+
+	if (!ses->sess_id_len) {
+		memcpy(ses->sess_id, dh->h, dh->h_len);
+		ses->sess_id_len = dh->h_len;
+	}
+
+	memset(pck->data, 0, pck->len);
+	packet_free(pck);
+	mp_clear(&dh_f);
+
+	return KEX_OK;
+}
+
+/*
+ * Derive key material as of RFC 4253 section 7.2:
+ * K1 = HASH(K || H || X || session_id), Kn = HASH(K || H || K1..Kn-1)
+ */
+static void kex_derive_key(char x, unsigned char *out, unsigned int len)
+{
+	const struct ltc_hash_descriptor *hash = kex_hash_desc();
+	unsigned char tmp[MAX_HASH_SIZE];
+	unsigned int done = 0;
+	struct packet *k;
+	hash_state hst;
+
+	/* K is hashed in its mpint encoding */
+	k = packet_new(MAX_HASH_SIZE * 8);
+	packet_put_mpint(k, &ses->dh->dh_k);
+
+	while (done < len) {
+		hash->init(&hst);
+		hash->process(&hst, (unsigned char *) k->data, k->len);
+		hash->process(&hst, ses->dh->h, ses->dh->h_len);
+
+		if (done == 0) {
+			hash->process(&hst, (unsigned char *) &x, 1);
+			hash->process(&hst, ses->sess_id,
+				ses->sess_id_len);
+		} else {
+			hash->process(&hst, out, done);
+		}
+
+		hash->done(&hst, tmp);
+
+		memcpy(out + done, tmp, MIN(len - done, hash->hashsize));
+		done += MIN(len - done, hash->hashsize);
+	}
+
+	memset(tmp, 0, sizeof(tmp));
+	memset(k->data, 0, k->len);
+	packet_free(k);
+}
+
+/* Set up one direction of the transport cipher */
+static struct cipher_ctx* kex_new_cipher(char iv_x, char key_x, int encrypt)
+{
+	const struct ssh_cipher *cipher;
+	unsigned char iv[PACKET_MAX_BLOCK];
+	unsigned char key[MAX_HASH_SIZE];
+	struct cipher_ctx *ctx;
+
+	cipher = ses->crypto->keys.ciper->algorithm;
+
+	kex_derive_key(iv_x, iv, cipher->blk_size);
+	kex_derive_key(key_x, key, cipher->key_len);
+
+	ctx = cipher_new(ses->crypto->keys.ciper->name, cipher, key, iv,
+		encrypt);
+
+	memset(key, 0, sizeof(key));
+
+	return ctx;
+}
+
+/* Set up one direction of the mac, not used with AEAD ciphers */
+static struct mac_ctx* kex_new_mac(char key_x, struct cipher_ctx *cipher)
+{
+	const struct ssh_mac *mac;
+	unsigned char key[MAX_HASH_SIZE];
+	struct mac_ctx *ctx;
+
+	mac = ses->crypto->keys.hash->algorithm;
+
+	if (!mac || !cipher || cipher_is_aead(cipher))
+		return NULL;
+
+	kex_derive_key(key_x, key, mac->key_len);
 
-	if (pck->len + hash->hashsize > pck->size)
-		pck->resize(pck, hash->hashsize);
+	ctx = mac_new(ses->crypto->keys.hash->name, mac, key);
 
-	hash->done(&hst, pck->data + pck->wr_pos);
+	memset(key, 0, sizeof(key));
 
-	ses.write_packet(pck);
+	return ctx;
 }
 
+/*
+ * Send our NEWKEYS and switch the outgoing direction. Incoming packets
+ * stay under the old keys until the peer's NEWKEYS, kex_recv_new_keys().
+ */
 int kex_dh_new_keys()
 {
 	struct packet *pck;
 
-	pck = packet_new(1024);
+	pck = packet_new_msg(SSH_MSG_NEWKEYS, 0);
 
-	pck->put_byte(pck, SSH_MSG_NEWKEYS);
+	packet_seal(pck);
+
+	if (ses->buf_out->buf_add(ses->buf_out, pck) != MACSSH_SUCCESS)
+		return KEX_FAIL;
 
 	/*
-	 * Packets needs to be encrypted from here on
+	 * Packets needs to be encrypted from here on.
+	 * Client to server uses IV 'A' and key 'C', server to client,
+	 * IV 'B' and key 'D'.
 	 */
+	/* Anything sealed under the old keys gets its mac first */
+	if (packet_mac_flush() != MACSSH_SUCCESS)
+		return KEX_FAIL;
+
+	cipher_free(ses->crypto->cipher_out);
+	mac_free(ses->crypto->mac_out);
+
+	/* Integrity keys are 'E' client to server and 'F' the other way */
+	if (ses->is_server) {
+		ses->crypto->cipher_out = kex_new_cipher('B', 'D', 1);
+		ses->crypto->mac_out = kex_new_mac('F', ses->crypto->cipher_out);
+	} else {
+		ses->crypto->cipher_out = kex_new_cipher('A', 'C', 1);
+		ses->crypto->mac_out = kex_new_mac('E', ses->crypto->cipher_out);
+	}
+
+	if (!ses->crypto->cipher_out)
+		return KEX_FAIL;
+
+	if (ses->crypto->keys.hash->algorithm &&
+		!cipher_is_aead(ses->crypto->cipher_out) &&
+		!ses->crypto->mac_out)
+		return KEX_FAIL;
+
+	ses->crypto->blk_size_out = ses->crypto->cipher_out->cipher->blk_size;
+
+	/* An AEAD cipher replaces the negotiated mac */
+	ses->crypto->mac_len_out = ses->crypto->mac_out ?
+		ses->crypto->mac_out->len :
+		cipher_tag_len(ses->crypto->cipher_out);
+
+	return KEX_OK;
+}
+
+/*
+ * The peer's NEWKEYS is the last packet under the old keys, everything
+ * behind it is read with the new ones.
+ */
+int kex_recv_new_keys()
+{
+	struct packet *pck;
+	unsigned char msg;
+
+	pck = ses->read_packet();
+	if (!pck)
+		return KEX_FAIL;
+
+	if (packet_read_byte(pck, &msg) != MACSSH_SUCCESS ||
+		msg != SSH_MSG_NEWKEYS) {
+		macssh_warn("Expected remote NEWKEYS. Found something else.");
+		packet_free(pck);
+		return KEX_FAIL;
+	}
+
+	packet_free(pck);
+
+	cipher_free(ses->crypto->cipher_in);
+	mac_free(ses->crypto->mac_in);
+
+	if (ses->is_server) {
+		ses->crypto->cipher_in = kex_new_cipher('A', 'C', 0);
+		ses->crypto->mac_in = kex_new_mac('E', ses->crypto->cipher_in);
+	} else {
+		ses->crypto->cipher_in = kex_new_cipher('B', 'D', 0);
+		ses->crypto->mac_in = kex_new_mac('F', ses->crypto->cipher_in);
+	}
+
+	if (!ses->crypto->cipher_in)
+		return KEX_FAIL;
+
+	if (ses->crypto->keys.hash->algorithm &&
+		!cipher_is_aead(ses->crypto->cipher_in) &&
+		!ses->crypto->mac_in)
+		return KEX_FAIL;
+
+	ses->crypto->blk_size_in = ses->crypto->cipher_in->cipher->blk_size;
+
+	ses->crypto->mac_len_in = ses->crypto->mac_in ?
+		ses->crypto->mac_in->len :
+		cipher_tag_len(ses->crypto->cipher_in);
+
+	ses->kex_num++;
+	ses->state = KEXED;
+
+	return KEX_OK;
 }
 
 /* Negotiate algorithms by mathing remote and local versions */
-static void kex_negotiate(struct packet *pck)
+static int kex_negotiate(struct packet *pck)
 {
+	struct packet_view list[10];
+	unsigned char follows;
+
+	/* Per negotiation, a server runs many of them */
+	kex_status = 0;
+
 	/* Skip the 16 byte cookie */
-	INCREMENT_RD_POS(pck, 16);
+	if (packet_read_skip(pck, 16) != MACSSH_SUCCESS)
+		return KEX_FAIL;
 
-	ses.crypto->keys.kex =
-		kex_try_match(pck->get_exch_list(pck), &kex_list);
+	/*
+	 * kex, host key, then cipher, mac, compression and language,
+	 * each client to server followed by server to client.
+	 */
+	int x;
+	for (x = 0; x < 10; x++)
+		if (packet_read_string(pck, &list[x]) != MACSSH_SUCCESS)
+			return KEX_FAIL;
+
+	if (packet_read_byte(pck, &follows) != MACSSH_SUCCESS)
+		return KEX_FAIL;
 
-	ses.crypto->keys.host =
-		kex_try_match(pck->get_exch_list(pck), &host_list);
+	ses->crypto->keys.kex = kex_try_match_first(&list[0], &kex_list,
+		ses->guess_kex);
+	ses->crypto->keys.host = kex_try_match_first(&list[1], &host_list,
+		ses->guess_host);
+	ses->crypto->keys.ciper = kex_try_match(&list[2], &cipher_list);
+	ses->crypto->keys.hash = kex_try_match(&list[4], &hash_list);
+	ses->crypto->keys.compress = kex_try_match(&list[6], &compress_list);
 
-	ses.crypto->keys.ciper =
-		kex_try_match(pck->get_exch_list(pck), &cipher_list);
+	/* Language lists are usually empty, nothing to agree on */
+	ses->crypto->keys.lang = NULL;
 
-	ses.crypto->keys.hash =
-		kex_try_match(pck->get_exch_list(pck), &hash_list);
+	/*
+	 * A guess is right when both ends list the same kex and host key
+	 * algorithms first. The packet behind a wrong one is ignored.
+	 */
+	ses->kex_guess_ok = kex_first_is(&list[0], ses->guess_kex ?
+		ses->guess_kex : &kex_list.algos[0]) &&
+		kex_first_is(&list[1], ses->guess_host ?
+		ses->guess_host : &host_list.algos[0]);
+	ses->kex_discard = follows && !ses->kex_guess_ok;
 
-	ses.crypto->keys.compress =
-		kex_try_match(pck->get_exch_list(pck), &compress_list);
+	if (!ses->is_server && !(kex_status & KEX_FAIL))
+		kex_cache_learn(&list[0], &list[1]);
 
-	ses.crypto->keys.lang =
-		kex_try_match(pck->get_exch_list(pck), &lang_list);
+	return kex_status & KEX_FAIL ? KEX_FAIL : KEX_OK;
 }
 
-/* Try to match remote and local version of single algorithm */
-static struct algorithm* kex_try_match(struct exchange_list_remote *rem,
+/*
+ * Try to match remote and local version of single algorithm. The
+ * client's order decides, ours or theirs.
+ */
+static struct algorithm* kex_try_match(struct packet_view *rem,
 	struct exchange_list_local *loc)
 {
-	int x, y;
-	for (x = 0; x < loc->num; x++) {
-		for (y = 0; y < rem->end; y++) {
-			if (strcmp(loc->algos[x].name, rem->algos[y]->name) == 0)
-				return &loc->algos[x];
+	struct packet_view names;
+	struct packet_view name;
+
+	int x;
+	if (ses->is_server) {
+		names = *rem;
+		while (packet_namelist_next(&names, &name) == MACSSH_SUCCESS)
+			for (x = 0; x < loc->num; x++)
+				if (packet_view_eq(&name, loc->algos[x].name))
+					return &loc->algos[x];
+	} else {
+		for (x = 0; x < loc->num; x++) {
+			names = *rem;
+			while (packet_namelist_next(&names, &name) ==
+				MACSSH_SUCCESS) {
+				if (packet_view_eq(&name, loc->algos[x].name))
+					return &loc->algos[x];
+			}
 		}
 	}
 
 	kex_status |= KEX_FAIL;
+
+	return NULL;
+}
+
+static int kex_has(struct packet_view *rem, const char *algo)
+{
+	struct packet_view names = *rem;
+	struct packet_view name;
+
+	while (packet_namelist_next(&names, &name) == MACSSH_SUCCESS)
+		if (packet_view_eq(&name, algo))
+			return 1;
+
+	return 0;
+}
+
+/* Is 'algo' the first name of the remote list */
+static int kex_first_is(struct packet_view *rem, const struct algorithm *algo)
+{
+	struct packet_view names = *rem;
+	struct packet_view name;
+
+	return packet_namelist_next(&names, &name) == MACSSH_SUCCESS &&
+		packet_view_eq(&name, algo->name);
+}
+
+/* As kex_try_match(), with 'first' moved ahead as in our KEXINIT */
+static struct algorithm* kex_try_match_first(struct packet_view *rem,
+	struct exchange_list_local *loc, struct algorithm *first)
+{
+	if (first && !ses->is_server && kex_has(rem, first->name))
+		return first;
+
+	return kex_try_match(rem, loc);
+}
+
+/* Our entry of the remote list's first name, if we support it */
+static struct algorithm* kex_find_first(struct packet_view *rem,
+	struct exchange_list_local *loc)
+{
+	struct packet_view names = *rem;
+	struct packet_view name;
+
+	if (packet_namelist_next(&names, &name) != MACSSH_SUCCESS)
+		return NULL;
+
+	int x;
+	for (x = 0; x < loc->num; x++)
+		if (packet_view_eq(&name, loc->algos[x].name))
+			return &loc->algos[x];
+
+	return NULL;
+}
+
+static struct algorithm* kex_find(struct exchange_list_local *loc,
+	const char *algo)
+{
+	int x;
+	for (x = 0; x < loc->num; x++)
+		if (!strcmp(loc->algos[x].name, algo))
+			return &loc->algos[x];
+
+	return NULL;
 }
 
-/* Send a KEX guess */
+static int kex_cache_path(char *path, size_t len)
+{
+	const char *homedir = getenv("HOME");
+
+	if (!homedir) {
+		struct passwd *pw = getpwuid(getuid());
+
+		if (pw)
+			homedir = pw->pw_dir;
+	}
+
+	if (!homedir)
+		return MACSSH_FAILURE;
+
+	snprintf(path, len, "%s/%s", homedir, KEX_CACHE_FILE);
+
+	return MACSSH_SUCCESS;
+}
+
+/*
+ * Lines of "host port kex hostkey", the latest first. The names of
+ * this host's line go to 'kex_name' and 'host_name', 64 bytes each.
+ */
+static int kex_cache_find(char *kex_name, char *host_name)
+{
+	char path[1024];
+	char line[512];
+	char name[256];
+	int port, ret = MACSSH_FAILURE;
+	FILE *f;
+
+	if (!ses->remote_host[0] ||
+		kex_cache_path(path, sizeof(path)) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	f = fopen(path, "r");
+	if (!f)
+		return MACSSH_FAILURE;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%255s %d %63s %63s", name, &port, kex_name,
+			host_name) != 4)
+			continue;
+
+		if (port == ses->remote_port &&
+			!strcmp(name, ses->remote_host)) {
+			ret = MACSSH_SUCCESS;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+/*
+ * 1 when the server's favourites are known, and ours too. They are
+ * then the guess.
+ */
+static int kex_cache_get()
+{
+	struct algorithm *kex, *host;
+	char kex_name[64];
+	char host_name[64];
+
+	if (kex_cache_find(kex_name, host_name) != MACSSH_SUCCESS)
+		return 0;
+
+	/* KEX_CACHE_NO_GUESS names neither */
+	kex = kex_find(&kex_list, kex_name);
+	host = kex_find(&host_list, host_name);
+	if (!kex || !host)
+		return 0;
+
+	ses->guess_kex = kex;
+	ses->guess_host = host;
+
+	return 1;
+}
+
+static void kex_cache_put(const char *kex, const char *host)
+{
+	char path[1024];
+	char tmp[1040];
+	char line[512];
+	char name[256];
+	int port, num = 1;
+	FILE *in, *out;
+
+	if (!ses->remote_host[0] ||
+		kex_cache_path(path, sizeof(path)) != MACSSH_SUCCESS)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+
+	out = fopen(tmp, "w");
+	if (!out)
+		return;
+
+	fprintf(out, "%s %d %s %s\n", ses->remote_host, ses->remote_port,
+		kex, host);
+
+	in = fopen(path, "r");
+	if (in) {
+		while (num < KEX_CACHE_MAX && fgets(line, sizeof(line), in)) {
+			if (sscanf(line, "%255s %d", name, &port) != 2)
+				continue;
+
+			if (port == ses->remote_port &&
+				!strcmp(name, ses->remote_host))
+				continue;
+
+			fputs(line, out);
+			num++;
+		}
+		fclose(in);
+	}
+
+	/* Replaced whole, a concurrent client never reads half a file */
+	if (fclose(out) || rename(tmp, path))
+		unlink(tmp);
+}
+
+/*
+ * Remember the server's favourites, when we support them, so the
+ * next guess for this host is right. When we don't, remember not to
+ * guess. Written only when they changed.
+ */
+static void kex_cache_learn(struct packet_view *rem_kex,
+	struct packet_view *rem_host)
+{
+	struct algorithm *kex = kex_find_first(rem_kex, &kex_list);
+	struct algorithm *host = kex_find_first(rem_host, &host_list);
+	const char *kex_name = KEX_CACHE_NO_GUESS;
+	const char *host_name = KEX_CACHE_NO_GUESS;
+	char old_kex[64];
+	char old_host[64];
+
+	if (kex && host) {
+		kex_name = kex->name;
+		host_name = host->name;
+	}
+
+	if (kex_cache_find(old_kex, old_host) == MACSSH_SUCCESS &&
+		!strcmp(old_kex, kex_name) && !strcmp(old_host, host_name))
+		return;
+
+	kex_cache_put(kex_name, host_name);
+}
+
+/*
+ * Guess the server's favourite kex and host key algorithms, only when
+ * the cache knows them from last time. Our KEXINIT lists the guesses
+ * first, with KEXDH_INIT following right behind it. Without a guess
+ * our own favourites go first, and nothing follows.
+ */
 void kex_guess()
 {
+	ses->guess_kex = &kex_list.algos[0];
+	ses->guess_host = &host_list.algos[0];
 
+	ses->kex_guessed = kex_cache_get();
 }
 
 static FILE* hostkey_open_db()
@@ -21,15 +21,27 @@
 #define KEX_H
 
 #include "includes.h"
+#include "keys.h"
+#include "threadpool.h"
 
 enum {
 	KEX_OK = 0b00000001,
 	KEX_FAIL = 0b00000010
 };
 
+/* Our DH values on the pool, see kex_dh_start() */
+enum {
+	KEX_DH_IDLE	= 0,
+	KEX_DH_RUNNING	= 1,
+	KEX_DH_READY	= 2,
+};
+
+/* Threads computing client DH values */
+#define KEX_THREADS	1
+
 struct diffie_hellman {
 	
-	struct ssh_rsa_key *key;
+	struct ssh_rsa_key key;
 	
 	/*
 	 * Our
@@ -42,6 +54,29 @@ struct diffie_hellman {
 	 * Their
 	 */
 	mp_int dh_f;
+
+	/*
+	 * Inputs to H, both KEXINIT payloads and the server's K_S blob
+	 */
+	unsigned char *init_local;
+	unsigned int init_local_len;
+	unsigned char *init_remote;
+	unsigned int init_remote_len;
+	unsigned char *host_key;
+	unsigned int host_key_len;
+
+	/*
+	 * Exchange hash H of this kex
+	 */
+	unsigned char h[MAX_HASH_SIZE];
+	unsigned int h_len;
+
+	/*
+	 * Client: kex_dh_gen() running on the pool, and its result
+	 */
+	struct work work;
+	int gen_state;
+	int gen_ret;
 	
 };
 
@@ -55,13 +90,16 @@ struct exchange_list_local {
 	struct algorithm algos[];
 };
 
-struct exchange_list_remote {
-	int num;
-	int end;
-	struct algorithm **algos;
-};
+/*
+ * Per host record of the server's favourite kex and host key
+ * algorithms, under $HOME. Makes the next guess right. A host whose
+ * favourites we don't support gets KEX_CACHE_NO_GUESS for both.
+ */
+#define KEX_CACHE_FILE		".ssh/macssh_kex"
+#define KEX_CACHE_NO_GUESS	"-"
+#define KEX_CACHE_MAX		1024
 
-extern int kex_status;
+extern __thread int kex_status;
 
 extern struct exchange_list_local kex_list;
 extern struct exchange_list_local host_list;
@@ -71,13 +109,25 @@ extern struct exchange_list_local compress_list;
 extern struct exchange_list_local lang_list;
 
 void kex_init();
+struct packet* kex_new_init();
+int kex_recv_init(struct packet *pck);
 void kex_guess();
 
+/*
+ * Client: compute our DH values on the pool, completing on 'loop'.
+ * kex_dh_init() runs the loop until they are there.
+ */
+int kex_dh_start(struct ev_loop *loop);
+void kex_shutdown(void);
+
 int kex_dh_init();
+int kex_dh_gen(struct diffie_hellman *dh);
+int kex_dh_shared(struct diffie_hellman *dh, mp_int *them);
 int kex_dh_compute();
 int kex_dh_reply();
 int kex_dh_exchange_hash();
 int kex_dh_new_keys();
+int kex_recv_new_keys();
 
 #endif /* KEX_H */
 
@@ -165,10 +165,10 @@ int ssh_generate_rsa_key()
 	 */
 	int pck_len = 256 + strlen("ssh-rsa") + 4; //4 + for str length
 	struct packet *pck = packet_new(pck_len);
-	pck->put_int(pck, strlen("ssh-rsa"));
-	pck->put_str(pck, "ssh-rsa");
-	pck->put_mpint(pck, k.e);
-	pck->put_mpint(pck, k.N);
+	packet_put_int(pck, strlen("ssh-rsa"));
+	packet_put_str(pck, "ssh-rsa");
+	packet_put_mpint(pck, k.e);
+	packet_put_mpint(pck, k.N);
 	
 	fwrite((void *) pck->data, pck->len, 1, f);
 }
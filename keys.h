@@ -35,9 +35,8 @@
 #define HOSTKEY_HEADER_PRIVATE	"x-"
 
 struct ssh_rsa_key {
-	char *blob;
-	mp_int *e;
-	mp_int *n;
+	mp_int e;
+	mp_int n;
 };
 
 struct ssh_dss_key {
@@ -0,0 +1,373 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "mac.h"
+#include "sha256mb.h"
+#include "shani.h"
+#include "dbg.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define HMAC_IPAD	0x36
+#define HMAC_OPAD	0x5c
+
+/* Largest hash block, SHA-512 */
+#define MAC_MAX_BLOCK	128
+
+/* Messages per run of the multi-buffer engine */
+#define MAC_BATCH	32
+
+/* Fewer leave most lanes idle, a serial mac is faster then */
+#define MAC_BATCH_MIN	4
+
+const struct ssh_mac ssh_hmac_sha1 = { &ssh_sha1_desc, 20, 20, MAC_MODE_HMAC, 0 };
+const struct ssh_mac ssh_hmac_sha256 = { &ssh_sha256_desc, 32, 32, MAC_MODE_HMAC, 0 };
+const struct ssh_mac ssh_hmac_sha512 = { &sha512_desc, 64, 64, MAC_MODE_HMAC, 0 };
+const struct ssh_mac ssh_hmac_md5 = { &md5_desc, 16, 16, MAC_MODE_HMAC, 0 };
+const struct ssh_mac ssh_hmac_sha1_etm = { &ssh_sha1_desc, 20, 20, MAC_MODE_HMAC, 1 };
+const struct ssh_mac ssh_hmac_sha256_etm = { &ssh_sha256_desc, 32, 32, MAC_MODE_HMAC, 1 };
+const struct ssh_mac ssh_hmac_sha512_etm = { &sha512_desc, 64, 64, MAC_MODE_HMAC, 1 };
+const struct ssh_mac ssh_hmac_md5_etm = { &md5_desc, 16, 16, MAC_MODE_HMAC, 1 };
+const struct ssh_mac ssh_umac64 = { NULL, UMAC_KEY_LEN, 8, MAC_MODE_UMAC, 0 };
+const struct ssh_mac ssh_umac128 = { NULL, UMAC_KEY_LEN, 16, MAC_MODE_UMAC, 0 };
+const struct ssh_mac ssh_umac64_etm = { NULL, UMAC_KEY_LEN, 8, MAC_MODE_UMAC, 1 };
+const struct ssh_mac ssh_umac128_etm = { NULL, UMAC_KEY_LEN, 16, MAC_MODE_UMAC, 1 };
+
+static unsigned long long mac_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Hash one block of key ^ pad, the state is kept for every packet */
+static int mac_pad_state(const struct ltc_hash_descriptor *desc,
+	hash_state *hs, const unsigned char *key, unsigned int key_len,
+	unsigned char pad)
+{
+	unsigned char block[MAC_MAX_BLOCK];
+
+	memset(block, pad, desc->blocksize);
+
+	int x;
+	for (x = 0; x < key_len; x++)
+		block[x] ^= key[x];
+
+	if (desc->init(hs) != CRYPT_OK ||
+		desc->process(hs, block, desc->blocksize) != CRYPT_OK)
+		return MACSSH_FAILURE;
+
+	memset(block, 0, sizeof(block));
+
+	return MACSSH_SUCCESS;
+}
+
+struct mac_ctx* mac_new(const char *name, const struct ssh_mac *mac,
+	const unsigned char *key)
+{
+	const struct ltc_hash_descriptor *desc = mac->desc;
+	struct mac_ctx *ctx;
+
+	if ((ctx = calloc(1, sizeof(struct mac_ctx))) == NULL)
+		return NULL;
+
+	ctx->mac = mac;
+	ctx->name = name;
+	ctx->len = mac->len;
+
+	switch (mac->mode) {
+	case MAC_MODE_UMAC:
+		if (umac_init(&ctx->state.umac, key,
+			mac->len) != MACSSH_SUCCESS)
+			goto error;
+		break;
+	default:
+		if (desc->blocksize > MAC_MAX_BLOCK || register_hash(desc) < 0)
+			goto error;
+
+		if (mac_pad_state(desc, &ctx->state.hmac.inner, key,
+			mac->key_len, HMAC_IPAD) != MACSSH_SUCCESS ||
+			mac_pad_state(desc, &ctx->state.hmac.outer, key,
+			mac->key_len, HMAC_OPAD) != MACSSH_SUCCESS)
+			goto error;
+		break;
+	}
+
+	return ctx;
+
+error:
+	macssh_warn("Could not set up mac %s", name);
+	free(ctx);
+	return NULL;
+}
+
+void mac_free(struct mac_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	/* Wipe the keyed states */
+	memset(ctx, 0, sizeof(struct mac_ctx));
+	free(ctx);
+}
+
+int mac_compute(struct mac_ctx *ctx, uint32_t seqnr,
+	const unsigned char *data, unsigned int len, unsigned char *out)
+{
+	const struct ltc_hash_descriptor *desc = ctx->mac->desc;
+	unsigned char inner[MAX_HASH_SIZE];
+	unsigned char seq[4];
+	unsigned long long start;
+	hash_state hs;
+	int err;
+
+	start = mac_clock();
+
+	if (ctx->mac->mode == MAC_MODE_UMAC) {
+		unsigned char nonce[UMAC_NONCE_LEN];
+
+		/* 64 bit sequence number as nonce */
+		memset(nonce, 0, 4);
+		STORE32H(seqnr, nonce + 4);
+
+		err = umac_compute(&ctx->state.umac, nonce, data, len, out);
+
+		ctx->cycles += mac_clock() - start;
+		ctx->bytes += len;
+
+		return err;
+	}
+
+	STORE32H(seqnr, seq);
+
+	/* Copy the keyed state instead of hashing the pads again */
+	hs = ctx->state.hmac.inner;
+	err = desc->process(&hs, seq, sizeof(seq));
+	err |= desc->process(&hs, data, len);
+	err |= desc->done(&hs, inner);
+
+	hs = ctx->state.hmac.outer;
+	err |= desc->process(&hs, inner, desc->hashsize);
+	err |= desc->done(&hs, out);
+
+	memset(inner, 0, sizeof(inner));
+
+	ctx->cycles += mac_clock() - start;
+	ctx->bytes += len;
+
+	return (err == CRYPT_OK) ? MACSSH_SUCCESS : MACSSH_FAILURE;
+}
+
+int mac_verify(struct mac_ctx *ctx, uint32_t seqnr,
+	const unsigned char *data, unsigned int len, const unsigned char *mac)
+{
+	unsigned char calc[MAX_HASH_SIZE];
+	unsigned char d = 0;
+
+	if (mac_compute(ctx, seqnr, data, len, calc) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	int x;
+	for (x = 0; x < ctx->len; x++)
+		d |= calc[x] ^ mac[x];
+
+	return d ? MACSSH_FAILURE : MACSSH_SUCCESS;
+}
+
+int mac_can_stream(struct mac_ctx *ctx)
+{
+	return ctx->mac->mode == MAC_MODE_HMAC;
+}
+
+int mac_stream_start(struct mac_ctx *ctx, struct mac_stream *st,
+	uint32_t seqnr)
+{
+	unsigned char seq[4];
+
+	if (!mac_can_stream(ctx))
+		return MACSSH_FAILURE;
+
+	STORE32H(seqnr, seq);
+
+	st->hs = ctx->state.hmac.inner;
+
+	if (ctx->mac->desc->process(&st->hs, seq, sizeof(seq)) != CRYPT_OK)
+		return MACSSH_FAILURE;
+
+	return MACSSH_SUCCESS;
+}
+
+int mac_stream_update(struct mac_ctx *ctx, struct mac_stream *st,
+	const unsigned char *data, unsigned int len)
+{
+	unsigned long long start;
+	int err;
+
+	start = mac_clock();
+
+	err = ctx->mac->desc->process(&st->hs, data, len);
+
+	ctx->cycles += mac_clock() - start;
+	ctx->bytes += len;
+
+	return (err == CRYPT_OK) ? MACSSH_SUCCESS : MACSSH_FAILURE;
+}
+
+int mac_stream_verify(struct mac_ctx *ctx, struct mac_stream *st,
+	const unsigned char *mac)
+{
+	const struct ltc_hash_descriptor *desc = ctx->mac->desc;
+	unsigned char inner[MAX_HASH_SIZE];
+	unsigned char calc[MAX_HASH_SIZE];
+	unsigned long long start;
+	unsigned char d = 0;
+	hash_state hs;
+	int err;
+
+	start = mac_clock();
+
+	err = desc->done(&st->hs, inner);
+
+	hs = ctx->state.hmac.outer;
+	err |= desc->process(&hs, inner, desc->hashsize);
+	err |= desc->done(&hs, calc);
+
+	memset(inner, 0, sizeof(inner));
+
+	ctx->cycles += mac_clock() - start;
+
+	if (err != CRYPT_OK)
+		return MACSSH_FAILURE;
+
+	int x;
+	for (x = 0; x < ctx->len; x++)
+		d |= calc[x] ^ mac[x];
+
+	return d ? MACSSH_FAILURE : MACSSH_SUCCESS;
+}
+
+/* SHA-NI beats eight AVX2 lanes, batching is for CPUs without it */
+int mac_can_batch(struct mac_ctx *ctx)
+{
+	return ctx->mac->mode == MAC_MODE_HMAC &&
+		ctx->mac->desc == &ssh_sha256_desc && sha256mb_available() &&
+		!shani_available();
+}
+
+/* Continue every job from 'hs', which has hashed one pad block */
+static void mac_batch_start(struct sha256mb_job *jobs, unsigned int num,
+	const hash_state *hs)
+{
+	int x, w;
+	for (x = 0; x < num; x++) {
+		for (w = 0; w < 8; w++)
+			jobs[x].state[w] = hs->sha256.state[w];
+
+		jobs[x].prefix_len = 64;
+	}
+}
+
+int mac_compute_batch(struct mac_ctx *ctx, const uint32_t *seqnr,
+	const unsigned char *const *data, const unsigned int *len,
+	unsigned char *const *out, unsigned int num)
+{
+	struct sha256mb_job jobs[MAC_BATCH];
+	unsigned char seq[MAC_BATCH][4];
+	unsigned char inner[MAC_BATCH][32];
+	unsigned long long start;
+	unsigned int done, n, x;
+	int ret = MACSSH_SUCCESS;
+
+	if (!mac_can_batch(ctx) || num < MAC_BATCH_MIN) {
+		for (x = 0; x < num; x++)
+			ret |= mac_compute(ctx, seqnr[x], data[x], len[x],
+				out[x]);
+
+		return ret;
+	}
+
+	start = mac_clock();
+
+	ctx->batches++;
+	ctx->batched += num;
+
+	for (done = 0; done < num; done += n) {
+		n = MIN(num - done, MAC_BATCH);
+
+		/* Inner hash, seqnr || packet */
+		mac_batch_start(jobs, n, &ctx->state.hmac.inner);
+		for (x = 0; x < n; x++) {
+			STORE32H(seqnr[done + x], seq[x]);
+			jobs[x].hdr = seq[x];
+			jobs[x].hdr_len = 4;
+			jobs[x].data = data[done + x];
+			jobs[x].len = len[done + x];
+			ctx->bytes += len[done + x];
+		}
+
+		sha256mb_run(jobs, n);
+
+		for (x = 0; x < n; x++)
+			memcpy(inner[x], jobs[x].digest, 32);
+
+		/* Outer hash, a single block each */
+		mac_batch_start(jobs, n, &ctx->state.hmac.outer);
+		for (x = 0; x < n; x++) {
+			jobs[x].hdr = inner[x];
+			jobs[x].hdr_len = 32;
+			jobs[x].data = inner[x];
+			jobs[x].len = 0;
+		}
+
+		sha256mb_run(jobs, n);
+
+		for (x = 0; x < n; x++)
+			memcpy(out[done + x], jobs[x].digest, 32);
+	}
+
+	memset(inner, 0, sizeof(inner));
+	memset(jobs, 0, sizeof(jobs));
+
+	ctx->cycles += mac_clock() - start;
+
+	return ret;
+}
+
+void mac_print_stats(struct mac_ctx *ctx, const char *dir)
+{
+	if (!ctx || !ctx->bytes)
+		return;
+
+	macssh_info("%s %s: %llu bytes, %.2f cycles/byte", ctx->name, dir,
+		ctx->bytes, (double) ctx->cycles / ctx->bytes);
+
+	if (ctx->batches)
+		macssh_info("%s %s: %llu batches, %.2f packets/batch",
+			ctx->name, dir, ctx->batches,
+			(double) ctx->batched / ctx->batches);
+}
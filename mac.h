@@ -0,0 +1,128 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAC_H
+#define MAC_H
+
+#include "includes.h"
+#include "umac.h"
+
+enum {
+	MAC_MODE_HMAC		= 0,
+	MAC_MODE_UMAC		= 1,
+};
+
+/* A negotiable mac, as referenced from hash_list */
+struct ssh_mac {
+	const struct ltc_hash_descriptor *desc;
+	int key_len;
+	int len;
+	int mode;
+
+	/* Encrypt-then-mac, the mac covers the ciphertext */
+	int etm;
+};
+
+/* One direction of the transport mac */
+struct mac_ctx {
+
+	const struct ssh_mac *mac;
+	const char *name;
+
+	/* Keyed state, set up once at NEWKEYS */
+	union {
+		/* State after the ipad and opad blocks */
+		struct {
+			hash_state inner;
+			hash_state outer;
+		} hmac;
+		struct umac_ctx umac;
+	} state;
+
+	unsigned int len;
+
+	/* Throughput accounting */
+	unsigned long long bytes;
+	unsigned long long cycles;
+
+	/* Runs of the multi-buffer engine, and the macs they computed */
+	unsigned long long batches;
+	unsigned long long batched;
+};
+
+extern const struct ssh_mac ssh_hmac_sha1;
+extern const struct ssh_mac ssh_hmac_sha256;
+extern const struct ssh_mac ssh_hmac_sha512;
+extern const struct ssh_mac ssh_hmac_md5;
+extern const struct ssh_mac ssh_hmac_sha1_etm;
+extern const struct ssh_mac ssh_hmac_sha256_etm;
+extern const struct ssh_mac ssh_hmac_sha512_etm;
+extern const struct ssh_mac ssh_hmac_md5_etm;
+extern const struct ssh_mac ssh_umac64;
+extern const struct ssh_mac ssh_umac128;
+extern const struct ssh_mac ssh_umac64_etm;
+extern const struct ssh_mac ssh_umac128_etm;
+
+struct mac_ctx* mac_new(const char *name, const struct ssh_mac *mac,
+	const unsigned char *key);
+void mac_free(struct mac_ctx *ctx);
+
+/*
+ * mac = HMAC(key, seqnr || data), or UMAC(key, data) with seqnr as
+ * the nonce, written to 'out'
+ */
+int mac_compute(struct mac_ctx *ctx, uint32_t seqnr,
+	const unsigned char *data, unsigned int len, unsigned char *out);
+
+/* Compare against the mac at 'mac' in constant time */
+int mac_verify(struct mac_ctx *ctx, uint32_t seqnr,
+	const unsigned char *data, unsigned int len, const unsigned char *mac);
+
+/*
+ * mac_compute() over data that arrives in pieces. Only HMAC can be
+ * fed incrementally, UMAC needs the whole message.
+ */
+struct mac_stream {
+	hash_state hs;
+};
+
+int mac_can_stream(struct mac_ctx *ctx);
+int mac_stream_start(struct mac_ctx *ctx, struct mac_stream *st,
+	uint32_t seqnr);
+int mac_stream_update(struct mac_ctx *ctx, struct mac_stream *st,
+	const unsigned char *data, unsigned int len);
+
+/* Finish the stream, and compare against 'mac' in constant time */
+int mac_stream_verify(struct mac_ctx *ctx, struct mac_stream *st,
+	const unsigned char *mac);
+
+/* Non-zero if mac_compute_batch() does better than a loop */
+int mac_can_batch(struct mac_ctx *ctx);
+
+/*
+ * mac_compute() for 'num' independent messages. HMAC-SHA-256 runs
+ * them through the multi-buffer engine, several at once.
+ */
+int mac_compute_batch(struct mac_ctx *ctx, const uint32_t *seqnr,
+	const unsigned char *const *data, const unsigned int *len,
+	unsigned char *const *out, unsigned int num);
+
+void mac_print_stats(struct mac_ctx *ctx, const char *dir);
+
+#endif /* MAC_H */
@@ -0,0 +1,337 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "poly1305.h"
+
+/*
+ * Poly1305 after D. J. Bernstein's specification, with the limb layout
+ * of poly1305-donna: three 44/44/42 bit limbs on 64 bit hosts with
+ * 128 bit products, five 26 bit limbs elsewhere.
+ */
+
+#define U8TO32(p) ((uint32_t) (p)[0] | ((uint32_t) (p)[1] << 8) | \
+	((uint32_t) (p)[2] << 16) | ((uint32_t) (p)[3] << 24))
+
+static void U32TO8(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#ifdef __SIZEOF_INT128__
+
+typedef unsigned __int128 uint128_t;
+
+#define U8TO64(p) ((uint64_t) U8TO32(p) | ((uint64_t) U8TO32((p) + 4) << 32))
+
+static void U64TO8(unsigned char *p, uint64_t v)
+{
+	U32TO8(p, v);
+	U32TO8(p + 4, v >> 32);
+}
+
+#define M44 0xfffffffffffULL
+#define M42 0x3ffffffffffULL
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char *key)
+{
+	uint64_t t0 = U8TO64(key);
+	uint64_t t1 = U8TO64(key + 8);
+
+	/* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+	ctx->r[0] = t0 & 0xffc0fffffffULL;
+	ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	ctx->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+
+	ctx->h[0] = ctx->h[1] = ctx->h[2] = 0;
+
+	ctx->pad[0] = U8TO64(key + 16);
+	ctx->pad[1] = U8TO64(key + 24);
+
+	ctx->leftover = 0;
+	ctx->final = 0;
+}
+
+static void poly1305_blocks(struct poly1305_ctx *ctx, const unsigned char *m,
+	unsigned int len)
+{
+	const uint64_t hibit = ctx->final ? 0 : (1ULL << 40);
+	uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+	uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint64_t s1 = r1 * (5 << 2);
+	uint64_t s2 = r2 * (5 << 2);
+	uint128_t d0, d1, d2;
+	uint64_t c, t0, t1;
+
+	while (len >= POLY1305_BLOCKLEN) {
+		t0 = U8TO64(m);
+		t1 = U8TO64(m + 8);
+
+		h0 += t0 & M44;
+		h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+		h2 += ((t1 >> 24) & M42) | hibit;
+
+		d0 = (uint128_t) h0 * r0 + (uint128_t) h1 * s2 +
+			(uint128_t) h2 * s1;
+		d1 = (uint128_t) h0 * r1 + (uint128_t) h1 * r0 +
+			(uint128_t) h2 * s2;
+		d2 = (uint128_t) h0 * r2 + (uint128_t) h1 * r1 +
+			(uint128_t) h2 * r0;
+
+		c = (uint64_t) (d0 >> 44); h0 = (uint64_t) d0 & M44;
+		d1 += c; c = (uint64_t) (d1 >> 44); h1 = (uint64_t) d1 & M44;
+		d2 += c; c = (uint64_t) (d2 >> 42); h2 = (uint64_t) d2 & M42;
+		h0 += c * 5; c = h0 >> 44; h0 &= M44;
+		h1 += c;
+
+		m += POLY1305_BLOCKLEN;
+		len -= POLY1305_BLOCKLEN;
+	}
+
+	ctx->h[0] = h0;
+	ctx->h[1] = h1;
+	ctx->h[2] = h2;
+}
+
+static void poly1305_tag(struct poly1305_ctx *ctx, unsigned char *tag)
+{
+	uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint64_t g0, g1, g2, c, mask, t0, t1;
+
+	/* Fully carry h */
+	c = h1 >> 44; h1 &= M44;
+	h2 += c; c = h2 >> 42; h2 &= M42;
+	h0 += c * 5; c = h0 >> 44; h0 &= M44;
+	h1 += c; c = h1 >> 44; h1 &= M44;
+	h2 += c; c = h2 >> 42; h2 &= M42;
+	h0 += c * 5; c = h0 >> 44; h0 &= M44;
+	h1 += c;
+
+	/* g = h - p, select it if h >= p */
+	g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+	g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+	g2 = h2 + c - (1ULL << 42);
+
+	mask = (g2 >> 63) - 1;
+	g0 &= mask; g1 &= mask; g2 &= mask;
+	mask = ~mask;
+	h0 = (h0 & mask) | g0;
+	h1 = (h1 & mask) | g1;
+	h2 = (h2 & mask) | g2;
+
+	/* h += pad */
+	t0 = ctx->pad[0];
+	t1 = ctx->pad[1];
+
+	h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+	h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+	h2 += ((t1 >> 24) & M42) + c; h2 &= M42;
+
+	U64TO8(tag, h0 | (h1 << 44));
+	U64TO8(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+#else /* !__SIZEOF_INT128__ */
+
+#define M26 0x3ffffff
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char *key)
+{
+	ctx->r[0] = (U8TO32(key)) & 0x3ffffff;
+	ctx->r[1] = (U8TO32(key + 3) >> 2) & 0x3ffff03;
+	ctx->r[2] = (U8TO32(key + 6) >> 4) & 0x3ffc0ff;
+	ctx->r[3] = (U8TO32(key + 9) >> 6) & 0x3f03fff;
+	ctx->r[4] = (U8TO32(key + 12) >> 8) & 0x00fffff;
+
+	memset(ctx->h, 0, sizeof(ctx->h));
+
+	ctx->pad[0] = U8TO32(key + 16);
+	ctx->pad[1] = U8TO32(key + 20);
+	ctx->pad[2] = U8TO32(key + 24);
+	ctx->pad[3] = U8TO32(key + 28);
+
+	ctx->leftover = 0;
+	ctx->final = 0;
+}
+
+static void poly1305_blocks(struct poly1305_ctx *ctx, const unsigned char *m,
+	unsigned int len)
+{
+	const uint32_t hibit = ctx->final ? 0 : (1UL << 24);
+	uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+	uint32_t r3 = ctx->r[3], r4 = ctx->r[4];
+	uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint32_t h3 = ctx->h[3], h4 = ctx->h[4];
+	uint64_t d0, d1, d2, d3, d4;
+	uint32_t c;
+
+	while (len >= POLY1305_BLOCKLEN) {
+		h0 += (U8TO32(m)) & M26;
+		h1 += (U8TO32(m + 3) >> 2) & M26;
+		h2 += (U8TO32(m + 6) >> 4) & M26;
+		h3 += (U8TO32(m + 9) >> 6) & M26;
+		h4 += (U8TO32(m + 12) >> 8) | hibit;
+
+		d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 +
+			(uint64_t) h2 * s3 + (uint64_t) h3 * s2 +
+			(uint64_t) h4 * s1;
+		d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 +
+			(uint64_t) h2 * s4 + (uint64_t) h3 * s3 +
+			(uint64_t) h4 * s2;
+		d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 +
+			(uint64_t) h2 * r0 + (uint64_t) h3 * s4 +
+			(uint64_t) h4 * s3;
+		d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 +
+			(uint64_t) h2 * r1 + (uint64_t) h3 * r0 +
+			(uint64_t) h4 * s4;
+		d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 +
+			(uint64_t) h2 * r2 + (uint64_t) h3 * r1 +
+			(uint64_t) h4 * r0;
+
+		c = (uint32_t) (d0 >> 26); h0 = (uint32_t) d0 & M26;
+		d1 += c; c = (uint32_t) (d1 >> 26); h1 = (uint32_t) d1 & M26;
+		d2 += c; c = (uint32_t) (d2 >> 26); h2 = (uint32_t) d2 & M26;
+		d3 += c; c = (uint32_t) (d3 >> 26); h3 = (uint32_t) d3 & M26;
+		d4 += c; c = (uint32_t) (d4 >> 26); h4 = (uint32_t) d4 & M26;
+		h0 += c * 5; c = h0 >> 26; h0 &= M26;
+		h1 += c;
+
+		m += POLY1305_BLOCKLEN;
+		len -= POLY1305_BLOCKLEN;
+	}
+
+	ctx->h[0] = h0;
+	ctx->h[1] = h1;
+	ctx->h[2] = h2;
+	ctx->h[3] = h3;
+	ctx->h[4] = h4;
+}
+
+static void poly1305_tag(struct poly1305_ctx *ctx, unsigned char *tag)
+{
+	uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint32_t h3 = ctx->h[3], h4 = ctx->h[4];
+	uint32_t g0, g1, g2, g3, g4, c, mask;
+	uint64_t f;
+
+	/* Fully carry h */
+	c = h1 >> 26; h1 &= M26;
+	h2 += c; c = h2 >> 26; h2 &= M26;
+	h3 += c; c = h3 >> 26; h3 &= M26;
+	h4 += c; c = h4 >> 26; h4 &= M26;
+	h0 += c * 5; c = h0 >> 26; h0 &= M26;
+	h1 += c;
+
+	/* g = h - p, select it if h >= p */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= M26;
+	g1 = h1 + c; c = g1 >> 26; g1 &= M26;
+	g2 = h2 + c; c = g2 >> 26; g2 &= M26;
+	g3 = h3 + c; c = g3 >> 26; g3 &= M26;
+	g4 = h4 + c - (1UL << 26);
+
+	mask = (g4 >> 31) - 1;
+	g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+	mask = ~mask;
+	h0 = (h0 & mask) | g0;
+	h1 = (h1 & mask) | g1;
+	h2 = (h2 & mask) | g2;
+	h3 = (h3 & mask) | g3;
+	h4 = (h4 & mask) | g4;
+
+	/* h = h % 2^128, then h += pad */
+	h0 = (h0 | (h1 << 26));
+	h1 = ((h1 >> 6) | (h2 << 20));
+	h2 = ((h2 >> 12) | (h3 << 14));
+	h3 = ((h3 >> 18) | (h4 << 8));
+
+	f = (uint64_t) h0 + ctx->pad[0]; h0 = (uint32_t) f;
+	f = (uint64_t) h1 + ctx->pad[1] + (f >> 32); h1 = (uint32_t) f;
+	f = (uint64_t) h2 + ctx->pad[2] + (f >> 32); h2 = (uint32_t) f;
+	f = (uint64_t) h3 + ctx->pad[3] + (f >> 32); h3 = (uint32_t) f;
+
+	U32TO8(tag, h0);
+	U32TO8(tag + 4, h1);
+	U32TO8(tag + 8, h2);
+	U32TO8(tag + 12, h3);
+}
+
+#endif /* __SIZEOF_INT128__ */
+
+void poly1305_update(struct poly1305_ctx *ctx, const unsigned char *m,
+	unsigned int len)
+{
+	unsigned int num;
+
+	if (ctx->leftover) {
+		num = MIN(POLY1305_BLOCKLEN - ctx->leftover, len);
+
+		memcpy(ctx->buffer + ctx->leftover, m, num);
+		ctx->leftover += num;
+		m += num;
+		len -= num;
+
+		if (ctx->leftover < POLY1305_BLOCKLEN)
+			return;
+
+		poly1305_blocks(ctx, ctx->buffer, POLY1305_BLOCKLEN);
+		ctx->leftover = 0;
+	}
+
+	num = len & ~(POLY1305_BLOCKLEN - 1);
+	if (num) {
+		poly1305_blocks(ctx, m, num);
+		m += num;
+		len -= num;
+	}
+
+	if (len) {
+		memcpy(ctx->buffer, m, len);
+		ctx->leftover = len;
+	}
+}
+
+void poly1305_finish(struct poly1305_ctx *ctx, unsigned char *tag)
+{
+	/* Last partial block is padded with 1, then zeros */
+	if (ctx->leftover) {
+		ctx->buffer[ctx->leftover] = 1;
+		memset(ctx->buffer + ctx->leftover + 1, 0,
+			POLY1305_BLOCKLEN - ctx->leftover - 1);
+		ctx->final = 1;
+		poly1305_blocks(ctx, ctx->buffer, POLY1305_BLOCKLEN);
+	}
+
+	poly1305_tag(ctx, tag);
+
+	memset(ctx, 0, sizeof(struct poly1305_ctx));
+}
+
+void poly1305_auth(unsigned char *tag, const unsigned char *m,
+	unsigned int len, const unsigned char *key)
+{
+	struct poly1305_ctx ctx;
+
+	poly1305_init(&ctx, key);
+	poly1305_update(&ctx, m, len);
+	poly1305_finish(&ctx, tag);
+}
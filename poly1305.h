@@ -0,0 +1,53 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POLY1305_H
+#define POLY1305_H
+
+#include "includes.h"
+
+#define POLY1305_KEYLEN		32
+#define POLY1305_TAGLEN		16
+#define POLY1305_BLOCKLEN	16
+
+struct poly1305_ctx {
+#ifdef __SIZEOF_INT128__
+	uint64_t r[3];
+	uint64_t h[3];
+	uint64_t pad[2];
+#else
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+#endif
+	unsigned int leftover;
+	unsigned char buffer[POLY1305_BLOCKLEN];
+	unsigned char final;
+};
+
+void poly1305_init(struct poly1305_ctx *ctx, const unsigned char *key);
+void poly1305_update(struct poly1305_ctx *ctx, const unsigned char *m,
+	unsigned int len);
+void poly1305_finish(struct poly1305_ctx *ctx, unsigned char *tag);
+
+/* One-shot tag of 'm' */
+void poly1305_auth(unsigned char *tag, const unsigned char *m,
+	unsigned int len, const unsigned char *key);
+
+#endif /* POLY1305_H */
@@ -0,0 +1,148 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "pool.h"
+#include "ssh-packet.h"
+#include "dbg.h"
+
+static const unsigned int class_sizes[POOL_NUM_CLASSES] = POOL_CLASS_SIZES;
+
+/* Smallest class that fits 'size', -1 if none does */
+static int pool_class_fit(unsigned int size)
+{
+	int x;
+	for (x = 0; x < POOL_NUM_CLASSES; x++)
+		if (size <= class_sizes[x])
+			return x;
+
+	return -1;
+}
+
+void pool_init(struct packet_pool *pool)
+{
+	int x;
+	for (x = 0; x < POOL_NUM_CLASSES; x++) {
+		memset(&pool->classes[x], 0, sizeof(struct pool_class));
+		pool->classes[x].size = class_sizes[x];
+		INIT_LIST_HEAD(&pool->classes[x].free);
+	}
+}
+
+void pool_destroy(struct packet_pool *pool)
+{
+	struct packet *pck;
+	struct packet *safe;
+
+	int x;
+	for (x = 0; x < POOL_NUM_CLASSES; x++) {
+		list_for_each_entry_safe(pck, safe,
+			&pool->classes[x].free, list) {
+			list_del(&pck->list);
+			free(pck->data);
+			free(pck);
+		}
+		pool->classes[x].nfree = 0;
+	}
+}
+
+struct packet* pool_get(struct packet_pool *pool, unsigned int size)
+{
+	struct pool_class *cls;
+	struct packet *pck;
+	int x;
+
+	if (!pool || (x = pool_class_fit(size)) < 0) {
+		if ((pck = calloc(1, sizeof(struct packet))) == NULL)
+			return NULL;
+
+		if ((pck->data = calloc(1, size)) == NULL) {
+			free(pck);
+			return NULL;
+		}
+
+		pck->size = size;
+		return pck;
+	}
+
+	cls = &pool->classes[x];
+
+	if (!list_empty(&cls->free)) {
+		pck = list_entry(cls->free.next, struct packet, list);
+		list_del(&pck->list);
+		cls->nfree--;
+		cls->hits++;
+	} else {
+		if ((pck = calloc(1, sizeof(struct packet))) == NULL)
+			return NULL;
+
+		if ((pck->data = malloc(cls->size)) == NULL) {
+			free(pck);
+			return NULL;
+		}
+
+		pck->size = cls->size;
+		cls->misses++;
+	}
+
+	pck->pool = pool;
+	pck->pool_cls = x;
+
+	if (++cls->used > cls->hwm)
+		cls->hwm = cls->used;
+
+	return pck;
+}
+
+void pool_put(struct packet *pck)
+{
+	struct pool_class *cls;
+
+	if (!pck->pool) {
+		free(pck->data);
+		free(pck);
+		return;
+	}
+
+	cls = &pck->pool->classes[pck->pool_cls];
+	cls->used--;
+
+	/* A resized packet no longer matches its class */
+	if (pck->size != cls->size || cls->nfree >= POOL_MAX_FREE) {
+		free(pck->data);
+		free(pck);
+		return;
+	}
+
+	list_add(&pck->list, &cls->free);
+	cls->nfree++;
+}
+
+void pool_print_stats(struct packet_pool *pool)
+{
+	struct pool_class *cls;
+
+	int x;
+	for (x = 0; x < POOL_NUM_CLASSES; x++) {
+		cls = &pool->classes[x];
+		macssh_info("pool class %5u: hits %lu misses %lu "
+			"used %u hwm %u free %u", cls->size, cls->hits,
+			cls->misses, cls->used, cls->hwm, cls->nfree);
+	}
+}
@@ -0,0 +1,67 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "includes.h"
+
+/*
+ * Packet size classes. Requests are rounded up to the nearest class,
+ * anything above PACKET_MAX_SIZE is served by malloc directly.
+ */
+#define POOL_NUM_CLASSES	6
+#define POOL_CLASS_SIZES	{ 128, 512, 2048, 4096, 16384, PACKET_MAX_SIZE }
+
+/* Upper bound on idle packets kept per class */
+#define POOL_MAX_FREE		64
+
+struct packet;
+
+struct pool_class {
+
+	unsigned int size;	/* Data size of packets in this class */
+
+	unsigned int nfree;	/* Packets on the free list */
+	unsigned int used;	/* Packets handed out */
+	unsigned int hwm;	/* High-water mark of 'used' */
+
+	unsigned long hits;	/* Served from the free list */
+	unsigned long misses;	/* Served by malloc */
+
+	struct list_head free;
+};
+
+/* Per-session packet slab pool */
+struct packet_pool {
+	struct pool_class classes[POOL_NUM_CLASSES];
+};
+
+void pool_init(struct packet_pool *pool);
+void pool_destroy(struct packet_pool *pool);
+
+/* Get a packet with at least 'size' bytes of data */
+struct packet* pool_get(struct packet_pool *pool, unsigned int size);
+
+/* Return a packet to the pool it came from */
+void pool_put(struct packet *pck);
+
+void pool_print_stats(struct packet_pool *pool);
+
+#endif /* POOL_H */
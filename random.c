@@ -21,14 +21,20 @@
 #include "random.h"
 #include "ssh-options.h"
 #include "misc.h"
+#include "shani.h"
+
+/*
+ * The pool is per thread, so server workers never contend on it. Each
+ * thread must call seedrandom() before drawing from it.
+ */
 
 /* this is used to generate unique output from the same hashpool */
-static uint32_t counter = 0;
+static __thread uint32_t counter = 0;
 /* the max value for the counter, so it won't integer overflow */
 #define MAX_COUNTER 1<<30 
 
-static unsigned char hashpool[SHA1_HASH_SIZE] = {0};
-static int donerandinit = 0;
+static __thread unsigned char hashpool[SHA1_HASH_SIZE] = {0};
+static __thread int donerandinit = 0;
 
 #define INIT_SEED_SIZE 32 /* 256 bits */
 
@@ -117,7 +123,7 @@ process_file(hash_state *hs, const char *filename,
 			}
 			goto out;
 		}
-		sha1_process(hs, readbuf, readlen);
+		ssh_sha1_desc.process(hs, readbuf, readlen);
 		readcount += readlen;
 	}
 	ret = MACSSH_SUCCESS;
@@ -131,13 +137,13 @@ void addrandom(unsigned char * buf, unsigned int len)
 	hash_state hs;
 
 	/* hash in the new seed data */
-	sha1_init(&hs);
+	ssh_sha1_desc.init(&hs);
 	/* existing state (zeroes on startup) */
-	sha1_process(&hs, (void*) hashpool, sizeof(hashpool));
+	ssh_sha1_desc.process(&hs, (void*) hashpool, sizeof(hashpool));
 
 	/* new */
-	sha1_process(&hs, buf, len);
-	sha1_done(&hs, hashpool);
+	ssh_sha1_desc.process(&hs, buf, len);
+	ssh_sha1_desc.done(&hs, hashpool);
 }
 
 static void write_urandom()
@@ -167,9 +173,9 @@ void seedrandom()
 	clock_t clockval;
 
 	/* hash in the new seed data */
-	sha1_init(&hs);
+	ssh_sha1_desc.init(&hs);
 	/* existing state */
-	sha1_process(&hs, (void*) hashpool, sizeof(hashpool));
+	ssh_sha1_desc.process(&hs, (void*) hashpool, sizeof(hashpool));
 
 #ifdef DROPBEAR_PRNGD_SOCKET
 	if (process_file(&hs, DROPBEAR_PRNGD_SOCKET, INIT_SEED_SIZE, 1)
@@ -208,21 +214,21 @@ void seedrandom()
 #endif
 
 	pid = getpid();
-	sha1_process(&hs, (void*) &pid, sizeof(pid));
+	ssh_sha1_desc.process(&hs, (void*) &pid, sizeof(pid));
 
 	/* gettimeofday() doesn't completely fill out struct timeval on 
 	   OS X (10.8.3), avoid valgrind warnings by clearing it first */
 	memset(&tv, 0x0, sizeof(tv));
 	gettimeofday(&tv, NULL);
-	sha1_process(&hs, (void*) &tv, sizeof(tv));
+	ssh_sha1_desc.process(&hs, (void*) &tv, sizeof(tv));
 
 	clockval = clock();
-	sha1_process(&hs, (void*) &clockval, sizeof(clockval));
+	ssh_sha1_desc.process(&hs, (void*) &clockval, sizeof(clockval));
 
 	/* When a private key is read by the client or server it will
 	 * be added to the hashpool - see runopts.c */
 
-	sha1_done(&hs, hashpool);
+	ssh_sha1_desc.done(&hs, hashpool);
 
 	counter = 0;
 	donerandinit = 1;
@@ -245,10 +251,10 @@ void genrandom(unsigned char* buf, unsigned int len)
 	}
 
 	while (len > 0) {
-		sha1_init(&hs);
-		sha1_process(&hs, (void*) hashpool, sizeof(hashpool));
-		sha1_process(&hs, (void*) &counter, sizeof(counter));
-		sha1_done(&hs, hash);
+		ssh_sha1_desc.init(&hs);
+		ssh_sha1_desc.process(&hs, (void*) hashpool, sizeof(hashpool));
+		ssh_sha1_desc.process(&hs, (void*) &counter, sizeof(counter));
+		ssh_sha1_desc.done(&hs, hash);
 
 		counter++;
 		if (counter > MAX_COUNTER) {
@@ -0,0 +1,121 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "ringbuf.h"
+
+int ringbuf_init(struct ringbuf *rb, unsigned int size)
+{
+	/* Masking needs a power of two */
+	if (!size || (size & (size - 1)))
+		return MACSSH_FAILURE;
+
+	rb->data = malloc(size);
+	if (!rb->data)
+		return MACSSH_FAILURE;
+
+	rb->size = size;
+	rb->head = 0;
+	rb->tail = 0;
+
+	return MACSSH_SUCCESS;
+}
+
+void ringbuf_free(struct ringbuf *rb)
+{
+	free(rb->data);
+
+	rb->data = NULL;
+	rb->size = 0;
+	rb->head = 0;
+	rb->tail = 0;
+}
+
+ssize_t ringbuf_read_fd(struct ringbuf *rb, int fd)
+{
+	struct iovec iov[2];
+	unsigned int pos = rb->tail & (rb->size - 1);
+	unsigned int room = ringbuf_room(rb);
+	ssize_t len;
+	int num = 1;
+
+	if (!room)
+		return 0;
+
+	iov[0].iov_base = rb->data + pos;
+	iov[0].iov_len = MIN(room, rb->size - pos);
+
+	/* Free space wraps around the end */
+	if (iov[0].iov_len < room) {
+		iov[1].iov_base = rb->data;
+		iov[1].iov_len = room - iov[0].iov_len;
+		num = 2;
+	}
+
+	len = readv(fd, iov, num);
+	if (len > 0)
+		rb->tail += len;
+
+	return len;
+}
+
+unsigned int ringbuf_put(struct ringbuf *rb, const void *in,
+	unsigned int len)
+{
+	unsigned int pos = rb->tail & (rb->size - 1);
+	unsigned int first;
+
+	len = MIN(len, ringbuf_room(rb));
+	first = MIN(len, rb->size - pos);
+
+	memcpy(rb->data + pos, in, first);
+	memcpy(rb->data, (const unsigned char *) in + first, len - first);
+
+	rb->tail += len;
+
+	return len;
+}
+
+unsigned int ringbuf_peek(const struct ringbuf *rb, void *out,
+	unsigned int len)
+{
+	unsigned int pos = rb->head & (rb->size - 1);
+	unsigned int first;
+
+	len = MIN(len, ringbuf_len(rb));
+	first = MIN(len, rb->size - pos);
+
+	memcpy(out, rb->data + pos, first);
+	memcpy((unsigned char *) out + first, rb->data, len - first);
+
+	return len;
+}
+
+unsigned int ringbuf_get(struct ringbuf *rb, void *out, unsigned int len)
+{
+	len = ringbuf_peek(rb, out, len);
+	rb->head += len;
+
+	return len;
+}
+
+void ringbuf_consume(struct ringbuf *rb, unsigned int len)
+{
+	rb->head += MIN(len, ringbuf_len(rb));
+}
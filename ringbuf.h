@@ -0,0 +1,71 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include "includes.h"
+
+/*
+ * Byte ring, used to read as much as the socket has in one syscall.
+ * The size is a power of two, head and tail run freely and wrap, so
+ * tail - head is always the number of buffered bytes.
+ */
+struct ringbuf {
+	unsigned char *data;
+	unsigned int size;
+
+	unsigned int head;	/* Next byte to take out */
+	unsigned int tail;	/* Next byte to fill in */
+};
+
+int ringbuf_init(struct ringbuf *rb, unsigned int size);
+void ringbuf_free(struct ringbuf *rb);
+
+static inline unsigned int ringbuf_len(const struct ringbuf *rb)
+{
+	return rb->tail - rb->head;
+}
+
+static inline unsigned int ringbuf_room(const struct ringbuf *rb)
+{
+	return rb->size - ringbuf_len(rb);
+}
+
+/*
+ * One read into all the free space, wrapped or not. Returns as
+ * read(), 0 on a full ring is not end of file.
+ */
+ssize_t ringbuf_read_fd(struct ringbuf *rb, int fd);
+
+/* Copy up to 'len' bytes in, as much as there is room for */
+unsigned int ringbuf_put(struct ringbuf *rb, const void *in,
+	unsigned int len);
+
+/* Copy up to 'len' bytes out, without taking them */
+unsigned int ringbuf_peek(const struct ringbuf *rb, void *out,
+	unsigned int len);
+
+/* Copy up to 'len' bytes out, and take them */
+unsigned int ringbuf_get(struct ringbuf *rb, void *out, unsigned int len);
+
+/* Drop up to 'len' bytes */
+void ringbuf_consume(struct ringbuf *rb, unsigned int len);
+
+#endif /* RINGBUF_H */
@@ -0,0 +1,306 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "sha256mb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#define SHA256MB_TARGET __attribute__((target("avx2")))
+
+static const uint32_t sha256mb_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), \
+	_mm256_slli_epi32(x, 32 - (n)))
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+#define ADD(a, b) _mm256_add_epi32(a, b)
+
+/* Word 'w' of lanes 0..7 from eight rows of the same eight words */
+static inline SHA256MB_TARGET void sha256mb_transpose(__m256i *r)
+{
+	__m256i t[8], u[8];
+
+	t[0] = _mm256_unpacklo_epi32(r[0], r[1]);
+	t[1] = _mm256_unpackhi_epi32(r[0], r[1]);
+	t[2] = _mm256_unpacklo_epi32(r[2], r[3]);
+	t[3] = _mm256_unpackhi_epi32(r[2], r[3]);
+	t[4] = _mm256_unpacklo_epi32(r[4], r[5]);
+	t[5] = _mm256_unpackhi_epi32(r[4], r[5]);
+	t[6] = _mm256_unpacklo_epi32(r[6], r[7]);
+	t[7] = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	u[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+	u[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+	u[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+	u[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+	u[4] = _mm256_unpacklo_epi64(t[4], t[6]);
+	u[5] = _mm256_unpackhi_epi64(t[4], t[6]);
+	u[6] = _mm256_unpacklo_epi64(t[5], t[7]);
+	u[7] = _mm256_unpackhi_epi64(t[5], t[7]);
+
+	r[0] = _mm256_permute2x128_si256(u[0], u[4], 0x20);
+	r[1] = _mm256_permute2x128_si256(u[1], u[5], 0x20);
+	r[2] = _mm256_permute2x128_si256(u[2], u[6], 0x20);
+	r[3] = _mm256_permute2x128_si256(u[3], u[7], 0x20);
+	r[4] = _mm256_permute2x128_si256(u[0], u[4], 0x31);
+	r[5] = _mm256_permute2x128_si256(u[1], u[5], 0x31);
+	r[6] = _mm256_permute2x128_si256(u[2], u[6], 0x31);
+	r[7] = _mm256_permute2x128_si256(u[3], u[7], 0x31);
+}
+
+/* One block for each lane, st[word][lane] */
+static SHA256MB_TARGET void sha256mb_compress(uint32_t st[8][8],
+	const unsigned char **blk)
+{
+	const __m256i bswap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i w[16];
+	__m256i s[8];
+	__m256i t1, t2;
+	int x, h;
+
+	for (h = 0; h < 2; h++) {
+		for (x = 0; x < 8; x++)
+			w[8 * h + x] = _mm256_loadu_si256(
+				(const __m256i *) (blk[x] + 32 * h));
+
+		sha256mb_transpose(w + 8 * h);
+	}
+
+	for (x = 0; x < 16; x++)
+		w[x] = _mm256_shuffle_epi8(w[x], bswap);
+
+	for (x = 0; x < 8; x++)
+		s[x] = _mm256_load_si256((const __m256i *) st[x]);
+
+	/* Message schedule kept as a ring of sixteen words */
+	for (x = 0; x < 64; x++) {
+		__m256i wx;
+
+		if (x < 16) {
+			wx = w[x];
+		} else {
+			__m256i w15 = w[(x - 15) & 15], w2 = w[(x - 2) & 15];
+
+			wx = ADD(ADD(w[x & 15], w[(x - 7) & 15]),
+				ADD(XOR3(ROR(w15, 7), ROR(w15, 18),
+				_mm256_srli_epi32(w15, 3)),
+				XOR3(ROR(w2, 17), ROR(w2, 19),
+				_mm256_srli_epi32(w2, 10))));
+			w[x & 15] = wx;
+		}
+
+		t1 = ADD(ADD(s[7], XOR3(ROR(s[4], 6), ROR(s[4], 11),
+			ROR(s[4], 25))),
+			ADD(_mm256_xor_si256(_mm256_and_si256(s[4], s[5]),
+			_mm256_andnot_si256(s[4], s[6])),
+			ADD(_mm256_set1_epi32(sha256mb_k[x]), wx)));
+		t2 = ADD(XOR3(ROR(s[0], 2), ROR(s[0], 13), ROR(s[0], 22)),
+			_mm256_or_si256(_mm256_and_si256(s[0], s[1]),
+			_mm256_and_si256(s[2], _mm256_or_si256(s[0], s[1]))));
+
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = ADD(s[3], t1);
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = ADD(t1, t2);
+	}
+
+	for (x = 0; x < 8; x++)
+		_mm256_store_si256((__m256i *) st[x],
+			ADD(s[x], _mm256_load_si256((const __m256i *) st[x])));
+}
+
+/*
+ * Split hdr || data into a copied first block, blocks read in place
+ * and one or two copied blocks of tail with the padding.
+ */
+static void sha256mb_prepare(struct sha256mb_job *job)
+{
+	unsigned int len = job->hdr_len + job->len;
+	unsigned int rest;
+
+	job->nfull = len / 64;
+	rest = len % 64;
+
+	if (job->nfull) {
+		memcpy(job->first, job->hdr, job->hdr_len);
+		memcpy(job->first + job->hdr_len, job->data,
+			64 - job->hdr_len);
+		memcpy(job->last, job->data + job->len - rest, rest);
+	} else {
+		memcpy(job->last, job->hdr, job->hdr_len);
+		memcpy(job->last + job->hdr_len, job->data, job->len);
+	}
+
+	job->nblocks = job->nfull + (rest + 9 > 64 ? 2 : 1);
+
+	memset(job->last + rest, 0, sizeof(job->last) - rest);
+	job->last[rest] = 0x80;
+	STORE64H((job->prefix_len + len) * 8,
+		job->last + 64 * (job->nblocks - job->nfull) - 8);
+
+	job->pos = 0;
+}
+
+static const unsigned char* sha256mb_block(struct sha256mb_job *job)
+{
+	unsigned int x = job->pos;
+
+	if (x >= job->nfull)
+		return job->last + 64 * (x - job->nfull);
+
+	if (x == 0)
+		return job->first;
+
+	return job->data + 64 * x - job->hdr_len;
+}
+
+SHA256MB_TARGET void sha256mb_run(struct sha256mb_job *jobs, unsigned int num)
+{
+	static const unsigned char idle[64];
+	uint32_t st[8][8] __attribute__((aligned(32)));
+	struct sha256mb_job *lane[SHA256MB_LANES];
+	const unsigned char *blk[SHA256MB_LANES];
+	unsigned int next = 0;
+	int x, w, active;
+
+	memset(lane, 0, sizeof(lane));
+
+	for (;;) {
+		active = 0;
+
+		for (x = 0; x < SHA256MB_LANES; x++) {
+			if (!lane[x] && next < num) {
+				lane[x] = &jobs[next++];
+				sha256mb_prepare(lane[x]);
+
+				for (w = 0; w < 8; w++)
+					st[w][x] = lane[x]->state[w];
+			}
+
+			/* Idle lanes hash a dummy block */
+			blk[x] = lane[x] ? sha256mb_block(lane[x]) : idle;
+			active += (lane[x] != NULL);
+		}
+
+		if (!active)
+			break;
+
+		sha256mb_compress(st, blk);
+
+		for (x = 0; x < SHA256MB_LANES; x++) {
+			if (!lane[x] || ++lane[x]->pos < lane[x]->nblocks)
+				continue;
+
+			for (w = 0; w < 8; w++) {
+				lane[x]->state[w] = st[w][x];
+				STORE32H(st[w][x], lane[x]->digest + 4 * w);
+			}
+
+			lane[x] = NULL;
+		}
+	}
+}
+
+/* SHA-256("abc"), on every lane, next to longer messages */
+static int sha256mb_selftest()
+{
+	static const unsigned char abc[32] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	static unsigned char buf[1000];
+	struct sha256mb_job jobs[SHA256MB_LANES + 1];
+	int x;
+
+	memset(jobs, 0, sizeof(jobs));
+
+	for (x = 0; x <= SHA256MB_LANES; x++) {
+		memcpy(jobs[x].state, iv, sizeof(iv));
+		jobs[x].hdr = (const unsigned char *) "abc";
+		jobs[x].hdr_len = (x & 1) ? 3 : 0;
+		jobs[x].data = (x & 1) ? buf : (const unsigned char *) "abc";
+		jobs[x].len = (x & 1) ? 100 * x : 3;
+	}
+
+	sha256mb_run(jobs, SHA256MB_LANES + 1);
+
+	for (x = 0; x <= SHA256MB_LANES; x += 2)
+		if (memcmp(jobs[x].digest, abc, sizeof(abc)))
+			return 0;
+
+	return 1;
+}
+
+int sha256mb_available()
+{
+	static int available = -1;
+
+	if (available < 0) {
+		__builtin_cpu_init();
+
+		available = __builtin_cpu_supports("avx2") &&
+			sha256mb_selftest();
+	}
+
+	return available;
+}
+
+#else
+
+int sha256mb_available()
+{
+	return 0;
+}
+
+void sha256mb_run(struct sha256mb_job *jobs, unsigned int num)
+{
+}
+
+#endif
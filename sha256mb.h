@@ -0,0 +1,58 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHA256MB_H
+#define SHA256MB_H
+
+#include "includes.h"
+
+/* Messages hashed in lockstep, one per 32 bit lane of AVX2 */
+#define SHA256MB_LANES		8
+
+/*
+ * One message, hdr || data, continued from a chaining value that
+ * already covers 'prefix_len' bytes. 'hdr' is at most one block.
+ */
+struct sha256mb_job {
+	uint32_t state[8];
+	uint64_t prefix_len;
+
+	const unsigned char *hdr;
+	unsigned int hdr_len;
+	const unsigned char *data;
+	unsigned int len;
+
+	/* Result */
+	unsigned char digest[32];
+
+	/* First block and padded tail, the rest is read from 'data' */
+	unsigned char first[64];
+	unsigned char last[128];
+	unsigned int nfull;
+	unsigned int nblocks;
+	unsigned int pos;
+};
+
+/* Non-zero if the CPU has AVX2 and the known-answer test passes */
+int sha256mb_available();
+
+/* Hash all jobs, lanes are refilled as soon as a message is done */
+void sha256mb_run(struct sha256mb_job *jobs, unsigned int num);
+
+#endif /* SHA256MB_H */
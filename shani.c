@@ -0,0 +1,388 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "shani.h"
+
+typedef void (*shani_compress_fn)(ulong32 *state, const unsigned char *in,
+	unsigned long blocks);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+static const ulong32 shani_k256[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * Four rounds per group, the message schedule rotates through four
+ * registers, see the Intel SHA extensions paper.
+ */
+static SHANI_TARGET void shani_sha1_compress(ulong32 *state,
+	const unsigned char *in, unsigned long blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e_save;
+	__m128i e[2], m[4];
+	int g;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state),
+		0x1b);
+	e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+	while (blocks--) {
+		abcd_save = abcd;
+		e_save = e[0];
+
+		for (g = 0; g < 20; g++) {
+			if (g < 4)
+				m[g] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *) (in + 16 * g)), mask);
+
+			if (g == 0)
+				e[0] = _mm_add_epi32(e[0], m[0]);
+			else
+				e[g & 1] = _mm_sha1nexte_epu32(e[g & 1],
+					m[g & 3]);
+
+			e[(g + 1) & 1] = abcd;
+
+			if (g >= 3 && g <= 18)
+				m[(g + 1) & 3] = _mm_sha1msg2_epu32(
+					m[(g + 1) & 3], m[g & 3]);
+
+			/* The round function is an immediate */
+			switch (g / 5) {
+			case 0:
+				abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 0);
+				break;
+			case 1:
+				abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 1);
+				break;
+			case 2:
+				abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 2);
+				break;
+			default:
+				abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], 3);
+				break;
+			}
+
+			if (g >= 1 && g <= 16)
+				m[(g - 1) & 3] = _mm_sha1msg1_epu32(
+					m[(g - 1) & 3], m[g & 3]);
+
+			if (g >= 2 && g <= 17)
+				m[(g - 2) & 3] = _mm_xor_si128(m[(g - 2) & 3],
+					m[g & 3]);
+		}
+
+		e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		in += 64;
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+static SHANI_TARGET void shani_sha256_compress(ulong32 *state,
+	const unsigned char *in, unsigned long blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+		0x0405060700010203ULL);
+	__m128i s0, s1, tmp, msg, abef_save, cdgh_save;
+	__m128i m[4];
+	int g;
+
+	/* ABEF and CDGH, as the round instruction wants them */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state),
+		0xb1);
+	s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)),
+		0x1b);
+	s0 = _mm_alignr_epi8(tmp, s1, 8);
+	s1 = _mm_blend_epi16(s1, tmp, 0xf0);
+
+	while (blocks--) {
+		abef_save = s0;
+		cdgh_save = s1;
+
+		for (g = 0; g < 16; g++) {
+			if (g < 4)
+				m[g] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *) (in + 16 * g)), mask);
+
+			msg = _mm_add_epi32(m[g & 3], _mm_load_si128(
+				(const __m128i *) (shani_k256 + 4 * g)));
+			s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+
+			if (g >= 3 && g <= 14) {
+				tmp = _mm_alignr_epi8(m[g & 3],
+					m[(g - 1) & 3], 4);
+				m[(g + 1) & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(m[(g + 1) & 3], tmp),
+					m[g & 3]);
+			}
+
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			s0 = _mm_sha256rnds2_epu32(s0, s1, msg);
+
+			if (g >= 1 && g <= 12)
+				m[(g - 1) & 3] = _mm_sha256msg1_epu32(
+					m[(g - 1) & 3], m[g & 3]);
+		}
+
+		s0 = _mm_add_epi32(s0, abef_save);
+		s1 = _mm_add_epi32(s1, cdgh_save);
+
+		in += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(s0, 0x1b);
+	s1 = _mm_shuffle_epi32(s1, 0xb1);
+	s0 = _mm_blend_epi16(tmp, s1, 0xf0);
+	s1 = _mm_alignr_epi8(s1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *) state, s0);
+	_mm_storeu_si128((__m128i *) (state + 4), s1);
+}
+
+static int shani_cpu()
+{
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) ||
+		!(c & bit_SSSE3))
+		return 0;
+
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return 0;
+
+	return (b & bit_SHA) != 0;
+}
+
+#else
+
+static int shani_cpu()
+{
+	return 0;
+}
+
+#define shani_sha1_compress NULL
+#define shani_sha256_compress NULL
+
+#endif
+
+/* libtomcrypt's buffering, with the compression swapped */
+static void shani_update(ulong64 *length, ulong32 *curlen,
+	unsigned char *buf, ulong32 *state, shani_compress_fn compress,
+	const unsigned char *in, unsigned long inlen)
+{
+	unsigned long num;
+
+	if (*curlen) {
+		num = MIN(inlen, 64 - *curlen);
+		memcpy(buf + *curlen, in, num);
+		*curlen += num;
+		in += num;
+		inlen -= num;
+
+		if (*curlen < 64)
+			return;
+
+		compress(state, buf, 1);
+		*length += 512;
+		*curlen = 0;
+	}
+
+	/* Whole blocks straight from the input */
+	num = inlen / 64;
+	if (num) {
+		compress(state, in, num);
+		*length += 512ULL * num;
+		in += 64 * num;
+		inlen -= 64 * num;
+	}
+
+	memcpy(buf, in, inlen);
+	*curlen = inlen;
+}
+
+static void shani_final(ulong64 *length, ulong32 *curlen,
+	unsigned char *buf, ulong32 *state, shani_compress_fn compress,
+	int words, unsigned char *out)
+{
+	*length += *curlen * 8ULL;
+	buf[(*curlen)++] = 0x80;
+
+	if (*curlen > 56) {
+		memset(buf + *curlen, 0, 64 - *curlen);
+		compress(state, buf, 1);
+		*curlen = 0;
+	}
+
+	memset(buf + *curlen, 0, 56 - *curlen);
+	STORE64H(*length, buf + 56);
+	compress(state, buf, 1);
+
+	int x;
+	for (x = 0; x < words; x++)
+		STORE32H(state[x], out + 4 * x);
+}
+
+static int shani_sha1_process(hash_state *md, const unsigned char *in,
+	unsigned long inlen)
+{
+	if (!shani_available())
+		return sha1_process(md, in, inlen);
+
+	shani_update(&md->sha1.length, &md->sha1.curlen, md->sha1.buf,
+		md->sha1.state, shani_sha1_compress, in, inlen);
+
+	return CRYPT_OK;
+}
+
+static int shani_sha1_done(hash_state *md, unsigned char *out)
+{
+	if (!shani_available())
+		return sha1_done(md, out);
+
+	shani_final(&md->sha1.length, &md->sha1.curlen, md->sha1.buf,
+		md->sha1.state, shani_sha1_compress, 5, out);
+	zeromem(md, sizeof(hash_state));
+
+	return CRYPT_OK;
+}
+
+static int shani_sha256_process(hash_state *md, const unsigned char *in,
+	unsigned long inlen)
+{
+	if (!shani_available())
+		return sha256_process(md, in, inlen);
+
+	shani_update(&md->sha256.length, &md->sha256.curlen, md->sha256.buf,
+		md->sha256.state, shani_sha256_compress, in, inlen);
+
+	return CRYPT_OK;
+}
+
+static int shani_sha256_done(hash_state *md, unsigned char *out)
+{
+	if (!shani_available())
+		return sha256_done(md, out);
+
+	shani_final(&md->sha256.length, &md->sha256.curlen, md->sha256.buf,
+		md->sha256.state, shani_sha256_compress, 8, out);
+	zeromem(md, sizeof(hash_state));
+
+	return CRYPT_OK;
+}
+
+const struct ltc_hash_descriptor ssh_sha1_desc = {
+	.name = "sha1",
+	.ID = 2,
+	.hashsize = 20,
+	.blocksize = 64,
+	.OID = { 1, 3, 14, 3, 2, 26 },
+	.OIDlen = 6,
+	.init = &sha1_init,
+	.process = &shani_sha1_process,
+	.done = &shani_sha1_done,
+	.test = &sha1_test,
+};
+
+const struct ltc_hash_descriptor ssh_sha256_desc = {
+	.name = "sha256",
+	.ID = 0,
+	.hashsize = 32,
+	.blocksize = 64,
+	.OID = { 2, 16, 840, 1, 101, 3, 4, 2, 1 },
+	.OIDlen = 9,
+	.init = &sha256_init,
+	.process = &shani_sha256_process,
+	.done = &shani_sha256_done,
+	.test = &sha256_test,
+};
+
+/* "abc" against FIPS 180 */
+static int shani_selftest()
+{
+	static const unsigned char sha1_abc[20] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+	};
+	static const unsigned char sha256_abc[32] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	unsigned char out[32];
+	hash_state md;
+
+	sha1_init(&md);
+	shani_update(&md.sha1.length, &md.sha1.curlen, md.sha1.buf,
+		md.sha1.state, shani_sha1_compress,
+		(const unsigned char *) "abc", 3);
+	shani_final(&md.sha1.length, &md.sha1.curlen, md.sha1.buf,
+		md.sha1.state, shani_sha1_compress, 5, out);
+	if (memcmp(out, sha1_abc, sizeof(sha1_abc)))
+		return 0;
+
+	sha256_init(&md);
+	shani_update(&md.sha256.length, &md.sha256.curlen, md.sha256.buf,
+		md.sha256.state, shani_sha256_compress,
+		(const unsigned char *) "abc", 3);
+	shani_final(&md.sha256.length, &md.sha256.curlen, md.sha256.buf,
+		md.sha256.state, shani_sha256_compress, 8, out);
+	if (memcmp(out, sha256_abc, sizeof(sha256_abc)))
+		return 0;
+
+	return 1;
+}
+
+int shani_available()
+{
+	static int available = -1;
+
+	if (available < 0)
+		available = shani_cpu() && shani_selftest();
+
+	return available;
+}
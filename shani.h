@@ -0,0 +1,36 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHANI_H
+#define SHANI_H
+
+#include "includes.h"
+
+/*
+ * SHA-1 and SHA-256 descriptors that compress on the SHA extensions
+ * when the CPU has them, and run libtomcrypt's code otherwise. The
+ * hash state is libtomcrypt's, so both can be mixed on one state.
+ */
+extern const struct ltc_hash_descriptor ssh_sha1_desc;
+extern const struct ltc_hash_descriptor ssh_sha256_desc;
+
+/* Non-zero if the CPU has SHA-NI and the known-answer tests pass */
+int shani_available();
+
+#endif /* SHANI_H */
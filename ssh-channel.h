@@ -23,6 +23,10 @@
 #include "buffer.h"
 #include "list.h"
 
+/* byte SSH_MSG_CHANNEL_DATA, uint32 recipient channel, uint32 length */
+#define CHANNEL_DATA_HDR_LEN	9
+#define CHANNEL_DATA_MAX	(PACKET_MAX_PAYLOAD - CHANNEL_DATA_HDR_LEN)
+
 /* Channel data encapsulation */
 struct channel {
 	
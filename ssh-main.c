@@ -26,6 +26,9 @@
 #include "kex.h"
 #include "dbg.h"
 #include "keys.h"
+#include "random.h"
+#include "event.h"
+#include "dns.h"
 
 void ssh_version()
 {
@@ -35,7 +38,7 @@ void ssh_version()
 
 void ssh_help()
 {
-	printf("SSH [OPTIONS...] {COMMAND} ...\n\n"
+	printf("SSH [OPTIONS...] [HOST]\n\n"
 		"Query or send control commands to SSH.\n\n"
 		"  -h --help			Show this help\n"
 		"     --version			Show version and CPP definitions\n"
@@ -43,7 +46,16 @@ void ssh_help()
 		"     --debug			Print extra debug information during runtime\n"
 		"\n"
 		"  -p --port			Specify remote port\n"
+		"     --connect-timeout=MS	Give up connecting after this long\n"
+		"     --sndq-high=BYTES		Stop reading channels above this much queued output\n"
+		"     --sndq-low=BYTES		Resume reading channels below this much\n"
+		"     --io=BACKEND		Event loop: epoll, poll or uring\n"
 		"  -k --key			Create PK key (rsa or dss)\n"
+		"\n"
+		"  -s --server			Run as server\n"
+		"     --workers=N		Server event loop threads, default one per cpu\n"
+		"     --backlog=N		Listen backlog of each server worker\n"
+		"     --pin-cpu			Bind each server worker to its own cpu\n"
 		);
 }
 
@@ -58,6 +70,13 @@ int ssh_parse_argv(int argc, char **argv)
 		ARG_HELP,
 		ARG_PORT,
 		ARG_KEY,
+		ARG_SNDQ_HIGH,
+		ARG_SNDQ_LOW,
+		ARG_IO,
+		ARG_WORKERS,
+		ARG_BACKLOG,
+		ARG_PIN_CPU,
+		ARG_CONNECT_TIMEOUT,
 	};
 
 	static const struct option options[] = {
@@ -67,12 +86,21 @@ int ssh_parse_argv(int argc, char **argv)
 		{ "debug", no_argument, NULL, ARG_DEBUG},
 		{ "port", required_argument, NULL, ARG_PORT},
 		{ "key", required_argument, NULL, ARG_KEY},
+		{ "sndq-high", required_argument, NULL, ARG_SNDQ_HIGH},
+		{ "sndq-low", required_argument, NULL, ARG_SNDQ_LOW},
+		{ "io", required_argument, NULL, ARG_IO},
+		{ "server", no_argument, NULL, 's'},
+		{ "workers", required_argument, NULL, ARG_WORKERS},
+		{ "backlog", required_argument, NULL, ARG_BACKLOG},
+		{ "pin-cpu", no_argument, NULL, ARG_PIN_CPU},
+		{ "connect-timeout", required_argument, NULL,
+			ARG_CONNECT_TIMEOUT},
 		{}
 	};
 
 
 	int c;
-	while ((c = getopt_long(argc, argv, "hv:p:k:", options, NULL)) >= 0) {
+	while ((c = getopt_long(argc, argv, "hv:p:k:s", options, NULL)) >= 0) {
 		switch (c) {
 		case 'h':
 			ssh_help();
@@ -80,10 +108,15 @@ int ssh_parse_argv(int argc, char **argv)
 		case 'v':
 			return 0;
 		case 'p':
-			argv_options.server_port = 22;
+		case ARG_PORT:
+			argv_options.server_port = strtol(optarg, NULL, 0);
+			break;
 		case 'k':
 			ssh_generate_rsa_key();
 			return 0;
+		case 's':
+			argv_options.server = 1;
+			break;
 		case ARG_HELP:
 			ssh_help();
 			return 0;
@@ -99,29 +132,78 @@ int ssh_parse_argv(int argc, char **argv)
 		case ARG_KEY:
 			ssh_generate_rsa_key();
 			return 0;
+		case ARG_SNDQ_HIGH:
+			argv_options.sndq_high = strtoul(optarg, NULL, 0);
+			break;
+		case ARG_SNDQ_LOW:
+			argv_options.sndq_low = strtoul(optarg, NULL, 0);
+			break;
+		case ARG_IO:
+			if (!strcmp(optarg, "epoll"))
+				argv_options.io_backend = EV_BACKEND_EPOLL;
+			else if (!strcmp(optarg, "poll"))
+				argv_options.io_backend = EV_BACKEND_POLL;
+			else if (!strcmp(optarg, "uring"))
+				argv_options.io_backend = EV_BACKEND_URING;
+			else {
+				ssh_help();
+				return 0;
+			}
+			break;
+		case ARG_WORKERS:
+			argv_options.workers = strtol(optarg, NULL, 0);
+			break;
+		case ARG_BACKLOG:
+			argv_options.backlog = strtol(optarg, NULL, 0);
+			break;
+		case ARG_PIN_CPU:
+			argv_options.pin_cpu = 1;
+			break;
+		case ARG_CONNECT_TIMEOUT:
+			argv_options.connect_timeout = strtol(optarg, NULL, 0);
+			break;
 		default:
 			ssh_help();
 			return 0;
 		}
 	}
 
+	/* Host to connect to */
+	if (optind < argc)
+		snprintf(argv_options.server_addr,
+			sizeof(argv_options.server_addr), "%s", argv[optind]);
+
 	return 1;
 }
 
 /*
- * Client main
+ * Client main, or server with --server
  */
 int main(int argc, char **argv)
 {
 	if (!ssh_parse_argv(argc, argv))
 		return EXIT_SUCCESS;
 
+	/* Padding and key exchange draw from the prng */
+	seedrandom();
+
+	if (argv_options.server) {
+		server_session_loop();
+		return(EXIT_SUCCESS);
+	}
+
 	/* Setup session state */
-	session_init(&ses);
+	ses = session_new();
         
         client_session_loop();
 
-	session_free(&ses);
+	session_free(ses);
+	ses = NULL;
+
+	if (argv_options.debug)
+		dns_print_stats();
+	dns_shutdown();
+	kex_shutdown();
 
 	return(EXIT_SUCCESS);
 }
@@ -38,7 +38,29 @@ struct options {
 	
 	/* SSH options */
 	int server_port;
-	char server_addr[32];
+	char server_addr[256];
+
+	/* Connection setup limit in milliseconds, 0 for the default */
+	int connect_timeout;
+
+	/* Send queue watermarks in bytes, 0 for the default */
+	unsigned int sndq_high;
+	unsigned int sndq_low;
+
+	/* Event loop backend, EV_BACKEND_* */
+	int io_backend;
+
+	/* Server: run instead of the client */
+	int server;
+
+	/* Server: event loop threads, 0 for one per cpu */
+	int workers;
+
+	/* Server: listen() backlog of each worker, 0 for the default */
+	int backlog;
+
+	/* Server: bind each worker thread to its own cpu */
+	int pin_cpu;
 	
 	/* Internal options */
 	int verbose;
@@ -21,6 +21,11 @@
 #include "ssh-packet.h"
 #include "kex.h"
 #include "misc.h"
+#include "pool.h"
+#include "cipher.h"
+#include "mac.h"
+#include "random.h"
+#include "ssh-session.h"
 #include "dbg.h"
 
 void put_size(struct packet *pck, int data)
@@ -33,76 +38,14 @@ void put_pad_size(struct packet *pck, int data)
 	*(pck->data + 4) = data;
 }
 
-/* Fill our the meta-data of the packet */
-void put_stamp(struct packet* pck)
-{
-
-	int pad;
-	if ((pad = (pck->len % 8)) != 0) {
-		put_pad_size(pck, 4);
-	} else {
-		put_pad_size(pck, 4);
-	}
-
-	int x;
-	for (x = 0; x < 4; x++)
-		pck->put_byte(pck, 0);
-
-	put_size(pck, pck->len - 4); //4 fo u32 packet length
-}
-
-/* Fill our the meta-data of the packet */
-void put_stamp_2(struct packet* pck)
-{
-
-	int pad;
-	if ((pad = (pck->len % 8)) != 0) {
-		put_pad_size(pck, 6);
-	} else {
-		put_pad_size(pck, 6);
-	}
-
-	int x;
-	for (x = 0; x < 6; x++)
-		pck->put_byte(pck, 0);
-
-	put_size(pck, pck->len - 4); //4 fo u32 packet length
-}
-
-void put_byte(struct packet *pck, unsigned char data)
-{
-	*(pck->data + pck->len) = data;
-
-	pck->len++;
-}
-
-/* This function does NOT increment the write offset */
-static void put_byte_at(struct packet *pck, unsigned char data, int index)
-{
-	*(pck->data + index) = data;
-}
-
-static void put_bytes(struct packet *pck, void *data, int len)
+void packet_put_bytes(struct packet *pck, void *data, int len)
 {
 	memcpy(pck->data + pck->len, (unsigned char*) data, len);
 
 	pck->len += len;
 }
 
-static void put_char(struct packet *pck, unsigned char data)
-{
-	put_byte(pck, data);
-}
-
-static void put_int(struct packet *pck, int data)
-{
-	/* Macro from tomcrypt */
-	STORE32H(data, pck->data + pck->len);
-
-	pck->len += 4;
-}
-
-static void put_str(struct packet *pck, const char *data)
+void packet_put_str(struct packet *pck, const char *data)
 {
 	memcpy(pck->data + pck->len, data, strlen(data));
 	pck->len += strlen(data);
@@ -113,7 +56,7 @@ static void put_str(struct packet *pck, const char *data)
  * Unnecessary leading bytes with the value 0 or 255 MUST NOT be
  * included.  The value zero MUST be stored as a string with zero
  * bytes of data. */
-static void put_mpint(struct packet *pck, mp_int *mpi)
+void packet_put_mpint(struct packet *pck, mp_int *mpi)
 {
 	unsigned int len, pad = 0;
 
@@ -136,12 +79,12 @@ static void put_mpint(struct packet *pck, mp_int *mpi)
 	}
 
 	/* store the length */
-	pck->put_int(pck, len);
+	packet_put_int(pck, len);
 
 	/* store the actual value */
 	if (len > 0) {
 		if (pad) {
-			pck->put_byte(pck, 0x00);
+			packet_put_byte(pck, 0x00);
 		}
 		if (mp_to_unsigned_bin(mpi, pck->data + pck->len) != MP_OKAY) {
 			macssh_warn("mpint error");
@@ -151,273 +94,599 @@ static void put_mpint(struct packet *pck, mp_int *mpi)
 
 }
 
-static void put_exch_list(struct packet* pck, struct exchange_list_local* data)
+void packet_put_exch_list(struct packet* pck, struct exchange_list_local* data)
+{
+	packet_put_exch_list_first(pck, data, NULL);
+}
+
+void packet_put_exch_list_first(struct packet *pck,
+	struct exchange_list_local *data, const struct algorithm *first)
 {
-	struct packet *tmp = packet_new(1024);
+	unsigned int len_pos = pck->len;
+	int sep = 0;
+
+	/* Build the name-list in place, the length is known afterwards */
+	pck->len += 4;
+
+	if (first) {
+		packet_put_str(pck, first->name);
+		sep = 1;
+	}
 
 	int x;
 	for (x = 0; x < data->num; x++) {
 
-		tmp->put_str(tmp, data->algos[x].name);
+		if (&data->algos[x] == first)
+			continue;
 
-		if (x != (data->num - 1))
-			tmp->put_char(tmp, ',');
+		if (sep)
+			packet_put_byte(pck, ',');
 
+		packet_put_str(pck, data->algos[x].name);
+		sep = 1;
 	}
 
-	pck->put_int(pck, tmp->len);
-	pck->put_str(pck, tmp->data);
+	STORE32H(pck->len - len_pos - 4, pck->data + len_pos);
 
 }
 
-static int get_int(struct packet * pck)
+/*
+ * Bounds-checked readers.
+ *
+ * All of them read at rd_pos, advance it on success and leave it
+ * untouched on failure. Views point into the packet memory and are
+ * only valid as long as the packet is.
+ */
+int packet_read_byte(struct packet *pck, unsigned char *val)
 {
-	int ret;
+	if (pck->rd_pos >= pck->len)
+		return MACSSH_FAILURE;
 
-	char *ptr = (char *) &ret;
-	LOAD32H(ret, pck->data + pck->rd_pos);
+	*val = packet_get_byte(pck);
 
+	return MACSSH_SUCCESS;
+}
+
+int packet_read_u32(struct packet *pck, uint32_t *val)
+{
+	if (pck->len < 4 || pck->rd_pos > pck->len - 4)
+		return MACSSH_FAILURE;
+
+	LOAD32H(*val, pck->data + pck->rd_pos);
 	pck->rd_pos += 4;
-	return ret;
+
+	return MACSSH_SUCCESS;
+}
+
+int packet_read_skip(struct packet *pck, unsigned int num)
+{
+	if (num > pck->len - pck->rd_pos)
+		return MACSSH_FAILURE;
+
+	pck->rd_pos += num;
+
+	return MACSSH_SUCCESS;
 }
 
-static mp_int* get_mpint(struct packet *pck, mp_int *mp)
+int packet_read_string(struct packet *pck, struct packet_view *view)
 {
-	mp_int *dh_e;
+	uint32_t len;
+	unsigned int pos = pck->rd_pos;
 
-	if (!mp)
-		dh_e = malloc(sizeof(mp_int));
-	else
-		dh_e = mp;
+	if (packet_read_u32(pck, &len) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
 
-	mp_init_size(dh_e, 128);
+	if (len > pck->len - pck->rd_pos) {
+		pck->rd_pos = pos;
+		return MACSSH_FAILURE;
+	}
 
-	macssh_print_array(pck->data, pck->len);
+	view->ptr = (unsigned char *) pck->data + pck->rd_pos;
+	view->len = len;
 
-	unsigned int len = pck->get_int(pck);
+	pck->rd_pos += len;
 
-	if (len < 0)
-		macssh_exit("error in get_mpint", errno);
+	return MACSSH_SUCCESS;
+}
 
-	/* Check if ms bit is set */
-	if (*((unsigned char *) (pck->data + pck->rd_pos)) & (1 << (CHAR_BIT - 1)))
-		macssh_exit("error in get_mpint", errno);
+/* 'mp' must be initialised. Negative values are rejected. */
+int packet_read_mpint(struct packet *pck, mp_int *mp)
+{
+	struct packet_view view;
+	unsigned int pos = pck->rd_pos;
 
-	if (mp_read_unsigned_bin(dh_e, (unsigned char *) (pck->data + pck->rd_pos),
-		len) != MP_OKAY)
-		macssh_exit("error in get_mpint", errno);
+	if (packet_read_string(pck, &view) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
 
-	/* Increment read position */
-	pck->data += len;
+	if (view.len == 0) {
+		mp_zero(mp);
+		return MACSSH_SUCCESS;
+	}
 
-	/* Remember to free */
-	return dh_e;
+	if ((view.ptr[0] & 0x80) ||
+		mp_read_unsigned_bin(mp, (unsigned char *) view.ptr,
+		view.len) != MP_OKAY) {
+		pck->rd_pos = pos;
+		return MACSSH_FAILURE;
+	}
 
+	return MACSSH_SUCCESS;
 }
 
-static char* get_str(struct packet * pck)
+/*
+ * Split the next name off a name-list view. Returns MACSSH_FAILURE,
+ * when the list is exhausted.
+ */
+int packet_namelist_next(struct packet_view *list, struct packet_view *name)
 {
+	const unsigned char *comma;
 
-	/*
-	 * Assumption: pck->data is a zero terminates string
-	 */
+	if (list->len == 0)
+		return MACSSH_FAILURE;
 
-	char *str;
-	int len;
+	name->ptr = list->ptr;
 
-	len = strlen(pck->data + pck->rd_pos);
+	comma = memchr(list->ptr, ',', list->len);
+	if (comma) {
+		name->len = comma - list->ptr;
+		list->ptr = comma + 1;
+		list->len -= name->len + 1;
+	} else {
+		name->len = list->len;
+		list->ptr += list->len;
+		list->len = 0;
+	}
 
-	str = calloc(len, 1);
-	strcpy(str, (pck->data + pck->rd_pos));
+	return MACSSH_SUCCESS;
+}
 
-	return str;
+int packet_view_eq(const struct packet_view *view, const char *str)
+{
+	return strlen(str) == view->len && !memcmp(view->ptr, str, view->len);
+}
 
+/*
+ * Set up 'pck' as a read-only packet over 'view', so nested
+ * structures can be parsed without copying them out.
+ */
+void packet_view_reader(struct packet *pck, const struct packet_view *view)
+{
+	memset(pck, 0, sizeof(struct packet));
+
+	pck->data = (char *) view->ptr;
+	pck->len = view->len;
+	pck->size = view->len;
 }
 
-static unsigned char get_byte(struct packet *pck)
+/*
+ * Resize the packet.
+ * 
+ * Size can be positive or negative in order to grow,
+ * or shrink the size.
+ */
+int packet_resize(struct packet *pck, int size)
 {
-	unsigned char ret;
+	char *data;
 
-	ret = ((unsigned char *) pck->data)[pck->rd_pos];
+	if ((data = realloc(pck->data, pck->size + size)) == NULL)
+		return -1;
 
-	pck->rd_pos++;
+	pck->data = data;
+	pck->size += size;
 
-	return ret;
+	return 0;
 }
 
-static unsigned char get_byte_at(struct packet *pck, int index)
+void packet_init(struct packet * pck)
 {
-	unsigned char ret;
+	pck->len = 0;
+	pck->wr_pos = 0;
+	pck->rd_pos = 0;
+}
 
-	ret = *(((unsigned char *) pck->data) + index);
+struct packet * packet_new(unsigned int size)
+{
+	struct packet *pck;
 
-	return ret;
+	/* Recycled packets keep their old contents */
+	if ((pck = pool_get(ses->pool, size)) == NULL)
+		return NULL;
+
+	packet_init(pck);
+
+	return pck;
 }
 
-static unsigned char get_byte_at_offset(struct packet *pck, int offset)
+struct packet* packet_wrap(char *data, int size)
 {
-	unsigned char ret;
-
-	ret = *(((unsigned char *) pck->data) + pck->rd_pos + offset);
+	struct packet *pck;
 
-	return ret;
+	if ((pck = packet_new(size)) == NULL)
+		return NULL;
+	
+	memcpy(pck->data, data, size);
+	
+	pck->len = size;
+	
+	return pck;
 }
 
-static unsigned char* get_bytes(struct packet *pck, int num)
+struct packet* packet_new_msg(unsigned char msg, unsigned int payload)
 {
-	unsigned char *ret;
-	ret = malloc(num);
-	memcpy(ret, pck->data + pck->rd_pos, num);
-	pck->rd_pos += num;
-	return ret;
+	struct packet *pck;
+
+	pck = packet_new(PACKET_HDR_LEN + 1 + payload + PACKET_TAIL_ROOM);
+	if (!pck)
+		return NULL;
+
+	/* Length and padding length are filled in by packet_seal() */
+	pck->len = PACKET_HDR_LEN;
+	packet_put_byte(pck, msg);
+
+	return pck;
 }
 
-static unsigned char get_char(struct packet * pck)
+unsigned int packet_room(struct packet *pck)
 {
-	return get_byte(pck);
+	if (pck->len + PACKET_TAIL_ROOM >= pck->size)
+		return 0;
+
+	return pck->size - pck->len - PACKET_TAIL_ROOM;
 }
 
-/* Iterate through remote KEX_INIT packet */
-static struct exchange_list_remote* get_exch_list(struct packet * pck)
+/*
+ * Each packet is padded with random bytes, so that the length of
+ * packet_length || padding_length || payload || padding is a multiple
+ * of the cipher block size or 8, whichever is larger. The padding is
+ * between 4 and 255 bytes, here it is kept below 4 + block size.
+ * AEAD ciphers and encrypt-then-mac leave packet_length out of the
+ * alignment.
+ */
+void packet_seal(struct packet *pck)
 {
-	struct exchange_list_remote *ret;
-	int len;
-	int pos;
+	struct cipher_ctx *ctx = ses->crypto->cipher_out;
+	unsigned int blk, pad, aligned;
 
-	/* Initialize exchange list and make room for 10 initial
-	 * algorithms - realloc if necessaray */
-	ret = malloc(sizeof(struct exchange_list_remote));
-	ret->algos = malloc(sizeof(struct algorithm *) * 10);
-	ret->num = 10;
-	ret->end = 0;
+	blk = MAX(ses->crypto->blk_size_out, PACKET_MIN_BLOCK);
 
-	len = get_int(pck);
-	pos = pck->rd_pos;
+	aligned = pck->len;
+	if ((ctx && cipher_is_aead(ctx)) ||
+		(ses->crypto->mac_out && ses->crypto->mac_out->mac->etm))
+		aligned -= 4;
 
-	int x;
-	for (x = pos; x <= pos + len; x++) {
+	pad = blk - (aligned % blk);
+	if (pad < PACKET_MIN_PAD)
+		pad += blk;
 
-		if (((unsigned char *) pck->data)[x] == ',' ||
-			x == (len + pos)) {
+	genrandom((unsigned char *) pck->data + pck->len, pad);
+	pck->len += pad;
 
-			if (ret->end >= ret->num) {
-				ret->algos = realloc(ret->algos,
-					sizeof(struct algorithm) * ret->num + 5);
-				ret->num += 5;
-			}
+	put_size(pck, pck->len - 4); //4 for u32 packet length
+	put_pad_size(pck, pad);
 
-			ret->algos[ret->end] =
-				malloc(sizeof(struct algorithm));
+	/* Cipher and mac work in place, mac goes into the tail room */
+	packet_encrypt(pck);
+
+	ses->seq_out++;
+}
 
-			unsigned char *name;
-			name = pck->get_bytes(pck, (x - pck->rd_pos));
+/* Encrypt the packet in place and append the mac. Nothing to do
+ * before the first NEWKEYS. */
+int packet_encrypt(struct packet * pck)
+{
+	struct cipher_ctx *ctx = ses->crypto->cipher_out;
+	struct mac_ctx *mac = ses->crypto->mac_out;
+	unsigned char *data = (unsigned char *) pck->data;
+	int ret;
 
-			if (x != (len + pos))
-				pck->rd_pos++;
+	if (!ctx)
+		return MACSSH_SUCCESS;
 
-			ret->algos[ret->end]->name = name;
+	if (cipher_is_aead(ctx)) {
+		ret = cipher_aead_seal(ctx, ses->seq_out, data, pck->len);
+		pck->len += cipher_tag_len(ctx);
 
-			//log_info("%s\n", ret->algos[ret->end]->name);
+		return ret;
+	}
 
-			ret->end++;
+	if (!mac)
+		return cipher_crypt(ctx, data, data, pck->len);
 
+	/* Encrypt-then-mac sends the length in the clear */
+	if (mac->mac->etm) {
+		ret = cipher_crypt(ctx, data + 4, data + 4, pck->len - 4);
+
+		/* The mac is the last stage, so it can wait for others */
+		if (mac_can_batch(mac)) {
+			pck->seq = ses->seq_out;
+			pck->len += mac->len;
+
+			ses->mac_pending[ses->mac_pending_num++] = pck;
+			if (ses->mac_pending_num == PACKET_MAC_BATCH)
+				ret |= packet_mac_flush();
+
+			return ret;
 		}
+
+		ret |= mac_compute(mac, ses->seq_out, data, pck->len,
+			data + pck->len);
+	} else {
+		ret = mac_compute(mac, ses->seq_out, data, pck->len,
+			data + pck->len);
+		ret |= cipher_crypt(ctx, data, data, pck->len);
 	}
 
+	pck->len += mac->len;
+
 	return ret;
 }
 
 /*
- * Resize the packet.
- * 
- * Size can be positive or negative in order to grow,
- * or shrink the size.
+ * Compute the macs of all packets sealed since the last flush. Must
+ * run before any of them is sent, and before the keys change.
  */
-int resize(struct packet *pck, int size)
+int packet_mac_flush()
 {
-	pck->data = realloc(pck->data, pck->size + size);
+	const unsigned char *data[PACKET_MAC_BATCH];
+	unsigned char *out[PACKET_MAC_BATCH];
+	unsigned int len[PACKET_MAC_BATCH];
+	uint32_t seq[PACKET_MAC_BATCH];
+	struct mac_ctx *mac = ses->crypto->mac_out;
+	struct packet *pck;
+	unsigned int x;
+	int ret;
+
+	if (!ses->mac_pending_num)
+		return MACSSH_SUCCESS;
+
+	for (x = 0; x < ses->mac_pending_num; x++) {
+		pck = ses->mac_pending[x];
 
-	pck->size + size;
+		data[x] = (unsigned char *) pck->data;
+		len[x] = pck->len - mac->len;
+		out[x] = (unsigned char *) pck->data + len[x];
+		seq[x] = pck->seq;
+	}
+
+	ret = mac_compute_batch(mac, seq, data, len, out,
+		ses->mac_pending_num);
+
+	ses->mac_pending_num = 0;
+
+	return ret;
 }
 
-void packet_init(struct packet * pck)
+/* The minimum size of a packet is 16 (or the cipher block size,
+whichever is larger) bytes (plus 'mac').  Implementations SHOULD
+decrypt the length after receiving the first 8 (or cipher block size,
+whichever is larger) bytes of a packet. */
+int packet_descrypt(struct packet * pck, unsigned int from, unsigned int len)
 {
-	pck->len = 0;
-	pck->wr_pos = 0;
-	pck->rd_pos = 0;
+	if (!ses->crypto->cipher_in)
+		return MACSSH_SUCCESS;
 
-	/* Puts */
-	pck->put_byte = &put_byte;
-	pck->put_char = &put_char;
-	pck->put_int = &put_int;
-	pck->put_str = &put_str;
-	pck->put_bytes = &put_bytes;
-	pck->put_exch_list = &put_exch_list;
-	pck->put_mpint = &put_mpint;
-
-	/* Gets */
-	pck->get_int = &get_int;
-	pck->get_byte = &get_byte;
-	pck->get_byte_at = &get_byte_at;
-	pck->get_byte_at_offset = &get_byte_at_offset;
-	pck->get_bytes = &get_bytes;
-	pck->get_str = &get_str;
-	pck->get_exch_list = &get_exch_list;
-	pck->get_mpint = &get_mpint;
-
-	/* Other */
-	pck->resize = &resize;
+	return cipher_crypt(ses->crypto->cipher_in,
+		(unsigned char *) pck->data + from,
+		(unsigned char *) pck->data + from, len);
 }
 
-struct packet * packet_new(unsigned int size)
+/* Length is sent in the clear, or decrypted on its own */
+static int packet_length_apart()
 {
-	struct packet *pck;
+	struct cipher_ctx *ctx = ses->crypto->cipher_in;
 
-	if ((pck = calloc(1, sizeof(struct packet))) == NULL)
-		return NULL;
+	return !ctx || cipher_is_aead(ctx) ||
+		(ses->crypto->mac_in && ses->crypto->mac_in->mac->etm);
+}
 
-	if ((pck->data = calloc(1, size)) == NULL)
-		return NULL;
+unsigned int packet_first_len()
+{
+	if (packet_length_apart())
+		return PACKET_MIN_BLOCK;
 
-	packet_init(pck);
+	return MAX(ses->crypto->blk_size_in, PACKET_MIN_BLOCK);
+}
 
-	pck->size = size;
+/*
+ * Get the packet length from the first packet_first_len() bytes.
+ * Without encrypt-then-mac this decrypts the first block in place.
+ */
+int packet_decrypt_length(struct packet *pck, uint32_t *len)
+{
+	struct cipher_ctx *ctx = ses->crypto->cipher_in;
 
-	return pck;
+	if (pck->len < packet_first_len())
+		return MACSSH_FAILURE;
+
+	if (ctx && cipher_is_aead(ctx))
+		return cipher_aead_length(ctx, ses->seq_in,
+			(unsigned char *) pck->data, len);
+
+	if (!packet_length_apart() &&
+		packet_descrypt(pck, 0, packet_first_len()) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	LOAD32H(*len, pck->data);
+
+	return MACSSH_SUCCESS;
 }
 
-struct packet* packet_wrap(char *data, int size)
+/*
+ * Counterpart of packet_seal(), for a complete packet with its mac.
+ * The mac is checked, before decryption where the mode allows it, and
+ * stripped. Reading starts at the payload afterwards.
+ */
+int packet_open(struct packet *pck)
 {
+	struct cipher_ctx *ctx = ses->crypto->cipher_in;
+	struct mac_ctx *mac = ses->crypto->mac_in;
+	unsigned char *data = (unsigned char *) pck->data;
+	unsigned int first = packet_first_len();
+	int ret = MACSSH_SUCCESS;
+
+	if (pck->len < first + ses->crypto->mac_len_in)
+		return MACSSH_FAILURE;
+
+	pck->len -= ses->crypto->mac_len_in;
+
+	if (ctx && cipher_is_aead(ctx)) {
+		ret = cipher_aead_open(ctx, ses->seq_in, data, pck->len);
+	} else if (mac && mac->mac->etm) {
+		/* Garbage is rejected without decrypting it */
+		ret = mac_verify(mac, ses->seq_in, data, pck->len,
+			data + pck->len);
+		if (ret == MACSSH_SUCCESS)
+			ret = packet_descrypt(pck, 4, pck->len - 4);
+	} else {
+		ret = packet_descrypt(pck, first, pck->len - first);
+		if (ret == MACSSH_SUCCESS && mac)
+			ret = mac_verify(mac, ses->seq_in, data, pck->len,
+				data + pck->len);
+	}
+
+	ses->seq_in++;
+
+	pck->rd_pos = PACKET_HDR_LEN;
+
+	return ret;
+}
+
+/*
+ * Called with the first packet_first_len() bytes at 'block'. Takes the
+ * length, and gets rx->pck from the pool class that fits the packet,
+ * starting with the block.
+ */
+int packet_rx_start(struct packet_rx *rx, unsigned char *block)
+{
+	struct cipher_ctx *ctx = ses->crypto->cipher_in;
+	struct mac_ctx *mac = ses->crypto->mac_in;
+	struct packet hdr;
 	struct packet *pck;
+	unsigned int first = packet_first_len();
+	uint32_t len;
 
-	if ((pck = calloc(1, sizeof(struct packet))) == NULL)
-		return NULL;
-	
-	memcpy(pck->data, data, size);
-	
-	packet_init(pck);
-	
-	pck->size = size;
-	
-	return pck;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.data = (char *) block;
+	hdr.len = hdr.size = first;
+
+	if (packet_decrypt_length(&hdr, &len) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	if (len > PACKET_MAX_SIZE || len + 4 < first)
+		return MACSSH_FAILURE;
+
+	rx->total = len + 4 + ses->crypto->mac_len_in;
+	rx->done = 0;
+
+	rx->pck = pck = packet_new(rx->total);
+	if (!pck)
+		return MACSSH_FAILURE;
+
+	memcpy(pck->data, block, first);
+	pck->len = first;
+
+	/* AEAD tags and UMAC need the whole packet at once */
+	rx->stream = ctx && !cipher_is_aead(ctx) &&
+		(!mac || mac_can_stream(mac));
+	if (!rx->stream)
+		return MACSSH_SUCCESS;
+
+	if (mac && mac_stream_start(mac, &rx->mac, ses->seq_in) !=
+		MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	/*
+	 * With encrypt-then-mac only the length is in the clear. Else
+	 * the whole first block was decrypted along with it.
+	 */
+	rx->done = (mac && mac->mac->etm) ? 4 : first;
+
+	if ((len + 4 - rx->done) % ses->crypto->blk_size_in)
+		return MACSSH_FAILURE;
+
+	if (mac && mac_stream_update(mac, &rx->mac,
+		(unsigned char *) pck->data, rx->done) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	return packet_rx_update(rx);
 }
 
-int packet_encrypt(struct packet * pck)
+/*
+ * Decrypt and mac the whole cipher blocks that came in since last.
+ * Encrypt-then-mac only feeds the mac, nothing is decrypted before
+ * packet_rx_finish() has checked it.
+ */
+int packet_rx_update(struct packet_rx *rx)
 {
+	struct mac_ctx *mac = ses->crypto->mac_in;
+	struct packet *pck = rx->pck;
+	unsigned char *data = (unsigned char *) pck->data + rx->done;
+	unsigned int end = rx->total - ses->crypto->mac_len_in;
+	unsigned int n;
+	int ret;
+
+	if (!rx->stream)
+		return MACSSH_SUCCESS;
+
+	n = MIN(pck->len, end) - rx->done;
+	n -= n % ses->crypto->blk_size_in;
 
+	if (!n)
+		return MACSSH_SUCCESS;
+
+	if (mac && mac->mac->etm) {
+		ret = mac_stream_update(mac, &rx->mac, data, n);
+	} else {
+		ret = packet_descrypt(pck, rx->done, n);
+		if (mac)
+			ret |= mac_stream_update(mac, &rx->mac, data, n);
+	}
+
+	rx->done += n;
+
+	return ret;
 }
 
-/* The minimum size of a packet is 16 (or the cipher block size,
-whichever is larger) bytes (plus 'mac').  Implementations SHOULD
-decrypt the length after receiving the first 8 (or cipher block size,
-whichever is larger) bytes of a packet. */
-int packet_descrypt(struct packet * pck)
+/*
+ * Called once all rx->total bytes are in. Checks the mac, and leaves
+ * the packet as packet_open() does. Nothing in it may be used when
+ * this fails.
+ */
+int packet_rx_finish(struct packet_rx *rx)
 {
+	struct mac_ctx *mac = ses->crypto->mac_in;
+	struct packet *pck = rx->pck;
+	int ret = MACSSH_SUCCESS;
+
+	if (pck->len != rx->total)
+		return MACSSH_FAILURE;
+
+	if (!rx->stream)
+		return packet_open(pck);
 
+	pck->len -= ses->crypto->mac_len_in;
+
+	if (rx->done != pck->len)
+		ret = MACSSH_FAILURE;
+	else if (mac)
+		ret = mac_stream_verify(mac, &rx->mac,
+			(unsigned char *) pck->data + pck->len);
+
+	/* Garbage is rejected without decrypting it */
+	if (ret == MACSSH_SUCCESS && mac && mac->mac->etm)
+		ret = packet_descrypt(pck, 4, pck->len - 4);
+
+	ses->seq_in++;
+
+	pck->rd_pos = PACKET_HDR_LEN;
+
+	return ret;
 }
 
 void packet_free(struct packet * pck)
 {
-	free(pck->data);
-	free(pck);
+	if (!pck)
+		return;
+
+	pool_put(pck);
 }
@@ -21,8 +21,25 @@
 #define SSH_PACKET_H
 
 #include "includes.h"
+#include "mac.h"
 
 #define PACKET_MAX_SIZE  35000
+#define PACKET_MAX_PAYLOAD 32768
+
+/* uint32 packet_length + byte padding_length */
+#define PACKET_HDR_LEN		5
+
+/* At least four bytes of random padding, and never a block less */
+#define PACKET_MIN_PAD		4
+#define PACKET_MIN_BLOCK	8
+#define PACKET_MAX_BLOCK	16
+
+/* Room reserved behind the payload for padding and mac */
+#define PACKET_TAIL_ROOM	(PACKET_MIN_PAD + PACKET_MAX_BLOCK - 1 + \
+				MAX_HASH_SIZE)
+
+/* Sealed packets whose mac is computed in one batch */
+#define PACKET_MAC_BATCH	32
 
 #define SET_WR_POS(a, b) { a->wr_pos = b; }
 #define SET_RD_POS(a, b) { a->rd_pos = b; }
@@ -35,8 +52,14 @@ size of 35000 bytes or less (including 'packet_length',
 'padding_length', 'payload', 'random padding', and 'mac'). */
 
 struct exchange_list_local;
+struct algorithm;
+struct packet_pool;
 
-/* Single packet buffer */
+/*
+ * Single packet buffer.
+ *
+ * Kept within one cache line, the codec below works on it directly.
+ */
 struct packet {
 	
 	char *data; /* Actual data */
@@ -47,50 +70,126 @@ struct packet {
 	unsigned int size; /* Memory size */
 
 	/*
-	 * Put operations
-	 */
-	void (*put_int)(struct packet *pck, int data);
-	void (*put_char)(struct packet *pck, unsigned char data);
-	void (*put_str)(struct packet *pck, const char *data);
-	void (*put_byte)(struct packet *pck, unsigned char);
-	void (*put_bytes)(struct packet *pck, void *data, int len);
-	void (*put_exch_list)(struct packet *pck, struct exchange_list_local *data);
-	void (*put_mpint)(struct packet *pck, mp_int *mpi);
+	 * Linked-list head
+	 */	
+	struct list_head list;
 
 	/*
-	 * Get operations
-	 */
-	mp_int* (*get_mpint)(struct packet *pck, mp_int *mp);
-	int (*get_int)(struct packet *pck);
-	char* (*get_str)(struct packet *pck);
-	unsigned char (*get_char)(struct packet *pck);
-	unsigned char (*get_byte)(struct packet *pck);
-	unsigned char (*get_byte_at)(struct packet *pck, int index);
-	unsigned char (*get_byte_at_offset)(struct packet *pck, int offset);
-	unsigned char* (*get_bytes)(struct packet *pck, int num);
-	struct exchange_list_remote* (*get_exch_list)(struct packet *pck);
-	
-	/*
-	 * Other operations
+	 * Pool and size class the packet is returned to,
+	 * NULL for packets from malloc
 	 */
-	int (*resize)(struct packet *pck, int size);
-	
+	struct packet_pool *pool;
+	int pool_cls;
+
 	/*
-	 * Crypto operations
+	 * Sequence number it was sealed with, for a mac that is
+	 * computed later
 	 */
-	int (*encrypt) (struct packet *pck);
-	int (*decrypt) (struct packet *pck);
-	
-	/*
-	 * Linked-list head
-	 */	
-	struct list_head list;
+	uint32_t seq;
 	
 };
 
+/*
+ * Packet being received. Cipher blocks are decrypted and fed to the
+ * mac as they arrive, so only the mac check is left once the last
+ * byte is in.
+ */
+struct packet_rx {
+	struct packet *pck;
+
+	/* Whole packet including mac, 0 until the length is known */
+	unsigned int total;
+
+	/* Bytes macced so far, and decrypted unless encrypt-then-mac */
+	unsigned int done;
+
+	/* Processed while arriving, or opened at once when complete */
+	int stream;
+	struct mac_stream mac;
+};
+
+/*
+ * Put operations
+ */
+static inline void packet_put_byte(struct packet *pck, unsigned char data)
+{
+	*(pck->data + pck->len) = data;
+
+	pck->len++;
+}
+
+static inline void packet_put_int(struct packet *pck, int data)
+{
+	/* Macro from tomcrypt */
+	STORE32H(data, pck->data + pck->len);
+
+	pck->len += 4;
+}
+
+void packet_put_bytes(struct packet *pck, void *data, int len);
+void packet_put_str(struct packet *pck, const char *data);
+void packet_put_mpint(struct packet *pck, mp_int *mpi);
+void packet_put_exch_list(struct packet *pck,
+	struct exchange_list_local *data);
+
+/* The same, with 'first' moved to the head of the name-list */
+void packet_put_exch_list_first(struct packet *pck,
+	struct exchange_list_local *data, const struct algorithm *first);
+
+/*
+ * Get operations
+ */
+static inline unsigned char packet_get_byte(struct packet *pck)
+{
+	return ((unsigned char *) pck->data)[pck->rd_pos++];
+}
+
+static inline int packet_get_int(struct packet *pck)
+{
+	int ret;
+
+	LOAD32H(ret, pck->data + pck->rd_pos);
+
+	pck->rd_pos += 4;
+	return ret;
+}
+
+/* Pointer and length into packet memory, never owned */
+struct packet_view {
+	const unsigned char *ptr;
+	unsigned int len;
+};
+
+/*
+ * Bounds-checked reads, MACSSH_FAILURE on malformed input
+ */
+int packet_read_byte(struct packet *pck, unsigned char *val);
+int packet_read_u32(struct packet *pck, uint32_t *val);
+int packet_read_skip(struct packet *pck, unsigned int num);
+int packet_read_string(struct packet *pck, struct packet_view *view);
+int packet_read_mpint(struct packet *pck, mp_int *mp);
+
+int packet_namelist_next(struct packet_view *list, struct packet_view *name);
+int packet_view_eq(const struct packet_view *view, const char *str);
+void packet_view_reader(struct packet *pck, const struct packet_view *view);
+
+/* Grow or shrink the packet memory by 'size' bytes */
+int packet_resize(struct packet *pck, int size);
+
 /* Create new packet */
 struct packet* packet_new(unsigned int size);
 
+/* Create a transport packet of message type 'msg', with room for
+ * 'payload' bytes after the message byte. Header, padding and mac
+ * space is reserved, so the packet can be sealed in place. */
+struct packet* packet_new_msg(unsigned char msg, unsigned int payload);
+
+/* Bytes that can still be written before the reserved tail */
+unsigned int packet_room(struct packet *pck);
+
+/* Pad, stamp, encrypt and mac a packet from packet_new_msg() */
+void packet_seal(struct packet *pck);
+
 /* Wrap 'data' in a new packet */
 struct packet* packet_wrap(char *data, int size);
 
@@ -102,12 +201,20 @@ void packet_free(struct packet *pck);
 
 /* Crypto stuff */
 int packet_encrypt(struct packet *pck);
-int packet_descrypt(struct packet *pck);
+int packet_descrypt(struct packet *pck, unsigned int from, unsigned int len);
+int packet_mac_flush();
+unsigned int packet_first_len();
+int packet_decrypt_length(struct packet *pck, uint32_t *len);
+int packet_open(struct packet *pck);
+
+/* Receive pipeline, see struct packet_rx */
+int packet_rx_start(struct packet_rx *rx, unsigned char *block);
+int packet_rx_update(struct packet_rx *rx);
+int packet_rx_finish(struct packet_rx *rx);
 
 /* Manipulate meta-data in packet */
 void put_size(struct packet *pck, int data);
 void put_pad_size(struct packet *pck, int data);
-void put_stamp(struct packet *pck);
 
 #endif /* SSH_PACKET_H */
 
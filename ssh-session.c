@@ -19,44 +19,405 @@
 
 #include "includes.h"
 #include "buffer.h"
+#include "event.h"
 #include "ssh-packet.h"
 #include "ssh-session.h"
+#include "ssh-numbers.h"
+#include "cipher.h"
 #include "misc.h"
+#include "random.h"
+#include "kex.h"
+#include "util.h"
 #include "dbg.h"
 
-static int session_read_user_inp()
+__thread struct session *ses;
+
+/*
+ * Read channel input straight into the payload of a CHANNEL_DATA packet.
+ * This is the only copy of the data; padding, encryption and mac are
+ * done in place and the packet buffer is handed to the socket as is.
+ * Returns the bytes read, 0 at end of file, -1 on error, or
+ * SESSION_SNDQ_FULL when the queue has no room for the packet.
+ */
+static int session_read_channel(int fd, uint32_t recipient)
 {
-	
+	struct packet *pck;
+	unsigned int len_pos;
+	int len;
+
+	/* A sealed packet can't be dropped, leave the input unread */
+	if (ses->buf_out->buf_isfull(ses->buf_out))
+		return SESSION_SNDQ_FULL;
+
+	pck = packet_new_msg(SSH_MSG_CHANNEL_DATA,
+		CHANNEL_DATA_HDR_LEN - 1 + CHANNEL_DATA_MAX);
+	if (!pck)
+		return -1;
+
+	packet_put_int(pck, recipient);
+
+	/* Data length is known after the read */
+	len_pos = pck->len;
+	pck->len += 4;
+
+	len = read(fd, pck->data + pck->len,
+		MIN(packet_room(pck), CHANNEL_DATA_MAX));
+	if (len <= 0) {
+		packet_free(pck);
+		return len;
+	}
+
+	STORE32H(len, pck->data + len_pos);
+	pck->len += len;
+
+	packet_seal(pck);
+
+	if (ses->buf_out->buf_add(ses->buf_out, pck) != MACSSH_SUCCESS)
+		macssh_exit("Send queue full", -1);
+
+	return len;
 }
 
+/*
+ * Write queued packets until the queue is empty, or the socket
+ * would block. Many packets are gathered into each writev(), and
+ * packets are freed only once all of their bytes are out.
+ */
+static struct packet* read_packet_frame(void);
+static void session_sent_cb(struct ev_loop *loop, int fd, int res,
+	void *arg);
+
+/*
+ * io_uring: queue the send queue as one chain of linked sends, packet
+ * by packet, submitted with the next wait. Only one chain is in flight,
+ * the next one starts from wherever the last completion left off.
+ */
+static int session_send_linked()
+{
+	struct iovec iov[SESSION_IOV_MAX];
+	int num;
+
+	if (ses->tx_inflight)
+		return 0;
+
+	num = ses->buf_out->buf_fill_iov(ses->buf_out, iov, SESSION_IOV_MAX);
+
+	int x;
+	for (x = 0; x < num; x++)
+		if (ev_send(ses->loop, ses->sock_out, iov[x].iov_base,
+			iov[x].iov_len, x + 1 < num, &session_sent_cb) !=
+			MACSSH_SUCCESS)
+			break;
+
+	ses->tx_inflight = x;
+
+	return (x || !num) ? 0 : -1;
+}
+
+static int session_writev_buf()
+{
+	struct iovec iov[SESSION_IOV_MAX];
+	ssize_t len;
+	size_t total;
+	int num;
+
+	while ((num = ses->buf_out->buf_fill_iov(ses->buf_out, iov,
+		SESSION_IOV_MAX)) > 0) {
+
+		total = 0;
+
+		int x;
+		for (x = 0; x < num; x++)
+			total += iov[x].iov_len;
+
+		len = writev(ses->sock_out, iov, num);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ses->tx_full = 1;
+				return 0;
+			}
+
+			if (errno == EINTR)
+				return 0;
+
+			return -1;
+		}
+
+		ses->buf_out->buf_consume(ses->buf_out, len);
+
+		/* Socket buffer is full */
+		if (len < total) {
+			ses->tx_full = 1;
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writability is only asked for while something is queued. A
+ * level-triggered backend reports an idle socket as writable on every
+ * wait, and would spin.
+ */
+static void session_update_writer()
+{
+	int events = EV_READ | EV_ET;
+
+	if (ses->buf_out->buf_bytes(ses->buf_out))
+		events |= EV_WRITE;
+
+	ev_mod(ses->loop, ses->sock_in, events);
+}
+
+/*
+ * io_uring submits the client's sends, everything else is written until
+ * EAGAIN. Server sessions only use readiness, on every backend.
+ *
+ * Nothing is written, and no mac computed, while the socket can't take
+ * more. Packets sealed meanwhile get their macs in one batch once it
+ * can.
+ */
 static int session_flush_buf()
 {
-	
+	int ret;
+
+	if (ses->loop && (ses->tx_full || (ses->tx_inflight &&
+		ses->loop->backend == EV_BACKEND_URING && !ses->is_server)))
+		return 0;
+
+	if (packet_mac_flush() != MACSSH_SUCCESS)
+		return -1;
+
+	if (ses->loop && ses->loop->backend == EV_BACKEND_URING &&
+		!ses->is_server)
+		return session_send_linked();
+
+	ret = session_writev_buf();
+
+	if (ses->loop)
+		session_update_writer();
+
+	return ret;
+}
+
+/*
+ * Whether channel readers may produce more output. Stops above the
+ * high watermark of the send queue, and only resumes once it has
+ * drained below the low one.
+ */
+static int session_sndq_open()
+{
+	size_t queued = ses->buf_out->buf_bytes(ses->buf_out);
+	int packets = ses->buf_out->buf_len(ses->buf_out);
+
+	if (!ses->sndq_blocked && (queued >= ses->sndq_high ||
+		packets >= SESSION_SNDQ_PACKETS_HIGH ||
+		ses->buf_out->buf_isfull(ses->buf_out))) {
+		ses->sndq_blocked = 1;
+		macssh_info("Send queue at %zu bytes, %d packets, "
+			"pausing channels", queued, packets);
+	} else if (ses->sndq_blocked && queued <= ses->sndq_low &&
+		packets <= SESSION_SNDQ_PACKETS_LOW) {
+		ses->sndq_blocked = 0;
+		macssh_info("Send queue at %zu bytes, %d packets, "
+			"resuming channels", queued, packets);
+	}
+
+	return !ses->sndq_blocked;
+}
+
+/*
+ * (Re)arm the channel readers according to the send queue watermarks
+ */
+static void session_update_readers()
+{
+	struct channel *ch;
+	int events = session_sndq_open() ? EV_READ : 0;
+
+	if (ses->stdin_open)
+		ev_mod(ses->loop, STDIN_FILENO, events);
+
+	list_for_each_entry(ch, &ses->channels->list, list)
+		ev_mod(ses->loop, ch->read_fd, events);
+}
+
+static void session_handle_packet(struct packet *pck)
+{
+	struct packet_view data;
+	unsigned char msg;
+
+	if (packet_read_byte(pck, &msg) == MACSSH_SUCCESS &&
+		msg == SSH_MSG_CHANNEL_DATA &&
+		packet_read_skip(pck, 4) == MACSSH_SUCCESS &&
+		packet_read_string(pck, &data) == MACSSH_SUCCESS)
+		write(STDOUT_FILENO, data.ptr, data.len);
+
+	packet_free(pck);
+}
+
+/*
+ * The socket is edge-triggered: everything readable is drained, and
+ * the send queue is written until the socket is full.
+ */
+static void session_sock_cb(struct ev_loop *loop, int fd, int events,
+	void *arg)
+{
+	struct packet *pck;
+
+	if (events & (EV_WRITE | EV_ERROR))
+		ses->tx_full = 0;
+
+	if (events & (EV_READ | EV_ERROR)) {
+		while ((pck = ses->read_packet()))
+			session_handle_packet(pck);
+
+		if (ses->state == DEADBEEF) {
+			ev_stop(loop);
+			return;
+		}
+	}
+
+	if (session_flush_buf() < 0) {
+		macssh_err("session_flush_buf");
+		ev_stop(loop);
+		return;
+	}
+
+	session_update_readers();
+}
+
+/* io_uring: sends complete in order, the queue is consumed as they do */
+static void session_sent_cb(struct ev_loop *loop, int fd, int res,
+	void *arg)
+{
+	ses->tx_inflight--;
+
+	if (res > 0) {
+		ses->buf_out->buf_consume(ses->buf_out, res);
+	} else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+		errno = -res;
+		macssh_err("send");
+		ses->state = DEADBEEF;
+		ev_stop(loop);
+		return;
+	}
+
+	if (ses->tx_inflight)
+		return;
+
+	session_flush_buf();
+	session_update_readers();
+}
+
+/*
+ * io_uring: data straight from the provided buffers. It lands in the
+ * receive ring, and every packet completed by it is handled.
+ */
+static void session_recv_cb(struct ev_loop *loop, int fd,
+	const unsigned char *data, int len, void *arg)
+{
+	struct packet *pck;
+
+	if (len <= 0) {
+		if (len == 0) {
+			macssh_warn("Connection closed by remote host");
+		} else {
+			errno = -len;
+			macssh_err("recv");
+		}
+
+		ses->state = DEADBEEF;
+		ev_stop(loop);
+		return;
+	}
+
+	/* Framing drains the ring, a packet's worth at most is left */
+	if (ringbuf_put(&ses->rx_buf, data, len) != len)
+		macssh_exit("Receive buffer overrun", -1);
+
+	while ((pck = read_packet_frame()))
+		session_handle_packet(pck);
+
+	session_flush_buf();
+	session_update_readers();
+}
+
+/* Whether more input is there, without blocking on it */
+static int session_fd_readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Channel input is level-triggered. A wakeup reads a batch's worth of
+ * full packets at most, so their macs are computed together, and the
+ * channels stay fair to each other.
+ */
+static void session_channel_cb(struct ev_loop *loop, int fd, int events,
+	void *arg)
+{
+	struct channel *ch = arg;
+	int ret, num = 0;
+
+	/* A full queue pauses the readers below, the fd stays */
+	do {
+		ret = session_read_channel(fd, ch ? ch->channel_id : 0);
+	} while (ret == CHANNEL_DATA_MAX && ++num < PACKET_MAC_BATCH &&
+		session_sndq_open() && session_fd_readable(fd));
+
+	if (ret <= 0 && ret != SESSION_SNDQ_FULL) {
+		ev_del(loop, fd);
+		if (fd == STDIN_FILENO)
+			ses->stdin_open = 0;
+	}
+
+	session_flush_buf();
+	session_update_readers();
 }
 
 void client_session_loop()
 {
-	fd_set readfds;
+	struct channel *ch;
+	struct ev_loop *loop;
 
-	struct buffer *buf_in = ses.buf_in;
-	struct buffer *buf_out = ses.buf_out;
+	loop = ev_loop_new(argv_options.io_backend);
+	if (!loop && argv_options.io_backend != EV_BACKEND_AUTO) {
+		macssh_warn("I/O backend not available, using the default");
+		loop = ev_loop_new(EV_BACKEND_AUTO);
+	}
 
-	if (connect_to_remote_host() > -1)
+	if (!loop)
+		macssh_exit("Could not create event loop", errno);
+
+	/*
+	 * The name is resolved on the loop already, it only becomes the
+	 * session's once the blocking handshake is done. Our DH values
+	 * are computed on the pool meanwhile.
+	 */
+	if (connect_to_remote_host(loop) > -1) {
+		kex_dh_start(loop);
 		identify();
-	else
+	} else
 		macssh_err("connect");
 
-	if (ses.state >= IDENTIFIED) {
+	if (ses->state >= IDENTIFIED) {
 		
 		/*
-		 * Send the exchange lists.
+		 * Send the exchange lists, with our DH values right
+		 * behind them when guessing.
 		 */
 		kex_init();
 		
 		/*
-		 * Compute our DH values and send them to server.
+		 * Compute our DH values and send them to server, again
+		 * after a wrong guess.
 		 */
-		kex_dh_init();
+		if ((!ses->kex_guessed || !ses->kex_guess_ok) &&
+			kex_dh_init() != KEX_OK)
+			exit(EXIT_FAILURE);
 		
 		/*
 		 * Get their DH values, compute shared secret.
@@ -64,167 +425,487 @@ void client_session_loop()
 		kex_dh_reply();
 		
 		/*
-		 * Create the exchange hash and send it to server.
+		 * Create the exchange hash, then derive keys and switch
+		 * on encryption, ours goes out first, theirs with the
+		 * server's NEWKEYS.
 		 */
-		kex_dh_exchange_hash();
+		if (kex_dh_exchange_hash() == KEX_OK &&
+			kex_dh_new_keys() == KEX_OK && session_flush_buf() >= 0)
+			kex_recv_new_keys();
 	}
 
-	if (ses.state != KEXED)
+	if (ses->state != KEXED)
 		exit(EXIT_FAILURE);
 
-	for (;;) {
-
-		struct packet *pck_in;
-		struct packet *pck_out;
-
-		/* Check for activity on sockets */
-		struct timeval tv;
-		tv.tv_sec = 5;
-		tv.tv_usec = 5;
+	ses->loop = loop;
 
+	if (ses->loop->backend == EV_BACKEND_URING) {
 		/*
-		 * Zero out the set
+		 * The kernel moves the socket data, the socket stays
+		 * blocking so requests wait in the kernel, not in EAGAIN
 		 */
-		FD_ZERO(&readfds);
-
+		if (ev_add(ses->loop, ses->sock_in, 0, &session_sock_cb,
+			NULL) != MACSSH_SUCCESS ||
+			ev_recv_start(ses->loop, ses->sock_in,
+			&session_recv_cb) != MACSSH_SUCCESS)
+			macssh_exit("Could not watch socket", errno);
+	} else {
 		/*
-		 * Add stdin to fd_set
+		 * Past the handshake nothing may block, the loop only
+		 * sleeps while there is nothing to do.
 		 */
-		FD_SET(STDIN_FILENO, &readfds);
+		if (sock_set_nonblocking(ses->sock_in) != MACSSH_SUCCESS)
+			macssh_exit("Could not make socket non-blocking",
+				errno);
+
+		/* EV_WRITE only while the send queue is not empty */
+		if (ev_add(ses->loop, ses->sock_in, EV_READ | EV_ET,
+			&session_sock_cb, NULL) != MACSSH_SUCCESS)
+			macssh_exit("Could not watch socket", errno);
+	}
+
+	/* Anything queued during the handshake */
+	session_flush_buf();
+
+	/* A regular file on stdin is read until its end, on any backend */
+	ses->stdin_open = ev_add(ses->loop, STDIN_FILENO, EV_READ,
+		&session_channel_cb, NULL) == MACSSH_SUCCESS;
+	if (!ses->stdin_open)
+		macssh_warn("Not reading stdin");
+
+	list_for_each_entry(ch, &ses->channels->list, list)
+		ev_add(ses->loop, ch->read_fd, EV_READ, &session_channel_cb, ch);
+
+	if (ev_run(ses->loop) != MACSSH_SUCCESS)
+		macssh_err("ev_run");
+
+	if (argv_options.debug)
+		ev_print_stats(ses->loop);
+
+	ev_loop_free(ses->loop);
+	ses->loop = NULL;
+}
+
+static void server_session_close(struct session *s)
+{
+	struct session *cur = ses;
+
+	ev_del(s->loop, s->sock_in);
+	if (s->grace)
+		ev_timer_del(s->loop, s->grace);
+	s->grace = NULL;
+
+	list_del(&s->list);
+	s->worker->num--;
+
+	/* Packets go back to the pool of their own session */
+	ses = s;
+	session_free(s);
+	ses = (cur == s) ? NULL : cur;
+}
+
+static void server_grace_cb(struct ev_loop *loop, void *arg)
+{
+	struct session *s = arg;
+
+	/* The loop frees a timer once it fired */
+	s->grace = NULL;
+
+	macssh_warn("Handshake timed out");
+
+	server_session_close(s);
+}
+
+static int server_handle_packet(struct packet *pck)
+{
+	switch (ses->state) {
+	case IDENTIFIED:
+		if (kex_recv_init(pck) != KEX_OK)
+			return MACSSH_FAILURE;
+
+		ses->state = HAVE_KEX_INIT;
+		return MACSSH_SUCCESS;
+	case HAVE_KEX_INIT:
+		/* Behind the client's wrong guess, ignored (RFC 4253 7.1) */
+		if (ses->kex_discard) {
+			ses->kex_discard = 0;
+			return MACSSH_SUCCESS;
+		}
+
+		/* KEXDH_REPLY needs a host key signature, not there yet */
+		macssh_warn("Server side DH exchange not supported");
+		return MACSSH_FAILURE;
+	default:
+		return MACSSH_FAILURE;
+	}
+}
+
+/*
+ * Take a connection as far through the handshake as its input allows,
+ * never waiting for more. Progress is kept in the state enum:
+ * NONE until the client id string is in, IDENTIFIED with our KEXINIT
+ * sent and theirs awaited, HAVE_KEX_INIT once algorithms are agreed.
+ */
+static void server_session_step()
+{
+	struct packet *pck;
+	ssize_t len;
+	int ret;
+
+	while (ses->state == NONE) {
+		ret = session_parse_identification();
+		if (ret < 0) {
+			ses->state = DEADBEEF;
+			return;
+		}
+
+		if (ret > 0) {
+			pck = kex_new_init();
+			if (!pck || ses->buf_out->buf_add(ses->buf_out, pck) !=
+				MACSSH_SUCCESS) {
+				packet_free(pck);
+				ses->state = DEADBEEF;
+			}
+			break;
+		}
+
+		len = ringbuf_read_fd(&ses->rx_buf, ses->sock_in);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		/* errno is stale at end of file */
+		if (len == 0 || (len < 0 && errno != EINTR)) {
+			ses->state = DEADBEEF;
+			return;
+		}
+	}
+
+	/* Drains the socket, as edge-triggered events require */
+	while (ses->state > NONE && (pck = ses->read_packet())) {
+		ret = server_handle_packet(pck);
+		packet_free(pck);
+
+		if (ret != MACSSH_SUCCESS)
+			ses->state = DEADBEEF;
+	}
+}
+
+/* Send what the handshake queued, and close on failure */
+static void server_session_finish()
+{
+	if (ses->state != DEADBEEF && session_flush_buf() < 0)
+		ses->state = DEADBEEF;
+
+	if (ses->state >= KEXED && ses->grace) {
+		ev_timer_del(ses->loop, ses->grace);
+		ses->grace = NULL;
+	}
+
+	if (ses->state == DEADBEEF)
+		server_session_close(ses);
+
+	ses = NULL;
+}
+
+static void server_conn_cb(struct ev_loop *loop, int fd, int events,
+	void *arg)
+{
+	ses = arg;
+
+	if (events & (EV_WRITE | EV_ERROR))
+		ses->tx_full = 0;
+
+	if (events & (EV_READ | EV_ERROR))
+		server_session_step();
+
+	server_session_finish();
+}
+
+/* Every connection gets its own session, none of them waits for another */
+static void server_accept_cb(struct ev_loop *loop, int fd, int events,
+	void *arg)
+{
+	struct server_worker *w = arg;
+	struct session *s;
+	struct packet *id;
+	int client;
+
+	while ((client = accept4(fd, NULL, NULL,
+		SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+
+		if (w->num >= SERVER_MAX_SESSIONS) {
+			close(client);
+			continue;
+		}
+
+		s = session_new();
+		if (!s) {
+			close(client);
+			continue;
+		}
+
+		ses = s;
+
+		s->sock_in = s->sock_out = client;
+		s->is_server = 1;
+		s->loop = loop;
+		s->worker = w;
+		s->state = NONE;
 
-		int num;
-		if ((num = select(FD_SETSIZE,
-			&readfds, NULL, NULL, &tv)) == 0)
-			goto out;
-		
-		/*
-		 * Read user input from STDIN.
-		 * Encapsulate in packet and place in outgoing,
-		 * buffer.
-		 */
-		if(FD_ISSET(STDIN_FILENO, &readfds))
-			session_read_user_inp();
-		
 		/*
-		 * Flush outgoing packet buffer
+		 * Our id string goes out right away, EV_WRITE is only
+		 * armed if the socket does not take it.
 		 */
-		session_flush_buf();
-			
+		id = packet_new(64);
+		if (id)
+			packet_put_str(id, IDENTIFICATION_STRING);
+
+		if (!id || s->buf_out->buf_add(s->buf_out, id) !=
+			MACSSH_SUCCESS) {
+			packet_free(id);
+			session_free(s);
+			ses = NULL;
+			continue;
+		}
+
+		/* Queued, the id is freed along with the session now */
+		if (ev_add(loop, client, EV_READ | EV_ET, &server_conn_cb,
+			s) != MACSSH_SUCCESS) {
+			session_free(s);
+			ses = NULL;
+			continue;
+		}
+
+		s->grace = ev_timer_add(loop, SERVER_GRACE_MS,
+			&server_grace_cb, s);
+
+		list_add_tail(&s->list, &w->sessions);
+		w->num++;
 
-out:
-		;
+		server_session_finish();
 	}
 }
 
-void server_session_loop()
+static void* server_worker_run(void *arg)
 {
-	fd_set readfds;
-	int sock;
-	int client;
-	struct sockaddr_in addr;
-	int addr_len = sizeof(struct sockaddr_in);
+	struct server_worker *w = arg;
+	struct session *s, *tmp;
 
-	sock = init_tcp_listen_socket(6677);
+	if (w->cpu >= 0) {
+		cpu_set_t set;
 
-	struct packet *pck;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			macssh_warn("Could not pin worker %d to cpu %d",
+				w->id, w->cpu);
+	}
 
-	for (;;) {
+	/* The prng state is per thread too */
+	seedrandom();
 
-		struct packet *pck_in;
-		struct packet *pck_out;
+	w->loop = ev_loop_new(argv_options.io_backend);
+	if (!w->loop && argv_options.io_backend != EV_BACKEND_AUTO)
+		w->loop = ev_loop_new(EV_BACKEND_AUTO);
 
-		FD_ZERO(&readfds);
+	if (!w->loop)
+		macssh_exit("Could not create event loop", errno);
 
-		FD_SET(sock, &readfds);
+	if (ev_add(w->loop, w->sock, EV_READ, &server_accept_cb, w) !=
+		MACSSH_SUCCESS)
+		macssh_exit("Could not watch listening socket", errno);
 
-		/* Check for activity on sockets */
-		struct timeval tv;
-		tv.tv_sec = 5;
-		tv.tv_usec = 5;
+	if (ev_run(w->loop) != MACSSH_SUCCESS)
+		macssh_err("ev_run");
 
-		int num;
-		if ((num = select(FD_SETSIZE,
-			&readfds, NULL, NULL, &tv)) < 1)
-			goto out;
+	list_for_each_entry_safe(s, tmp, &w->sessions, list)
+		server_session_close(s);
 
-		if (FD_ISSET(sock, &readfds)) {
-			ses.sock_out = accept(sock, (struct sockaddr *) &addr,
-				&addr_len);
-			ses.sock_in = ses.sock_out;
-			identify();
-			kex_init();
-		}
+	if (argv_options.debug)
+		ev_print_stats(w->loop);
+
+	ev_loop_free(w->loop);
+	w->loop = NULL;
+
+	return NULL;
+}
+
+/*
+ * Pick the cpu of every worker from the ones we may run on, in order,
+ * wrapping around when there are more workers than cpus.
+ */
+static void server_assign_cpus(struct server_worker *workers, int num)
+{
+	cpu_set_t set;
+	int cpu = -1;
 
-		pck_in = packet_new(1500);
+	if (sched_getaffinity(0, sizeof(set), &set) || !CPU_COUNT(&set))
+		return;
+
+	int x;
+	for (x = 0; x < num; x++) {
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(cpu, &set));
 
-		ses.write_packet(pck_in);
-out:
-		;
+		workers[x].cpu = cpu;
 	}
+}
+
+void server_session_loop()
+{
+	struct server_worker *workers;
+	int num, backlog;
+
+	num = argv_options.workers;
+	if (num <= 0)
+		num = sysconf(_SC_NPROCESSORS_ONLN);
+	num = MAX(1, MIN(num, SERVER_MAX_WORKERS));
 
+	backlog = argv_options.backlog > 0 ?
+		argv_options.backlog : SERVER_BACKLOG;
+
+	workers = calloc(num, sizeof(struct server_worker));
+	if (!workers)
+		macssh_exit("Could not allocate workers", -1);
+
+	int x;
+	for (x = 0; x < num; x++) {
+		workers[x].id = x;
+		workers[x].cpu = -1;
+		INIT_LIST_HEAD(&workers[x].sessions);
+
+		/* Sockets first, a bind failure should stop us before any
+		 * thread runs */
+		workers[x].sock = init_tcp_listen_socket(6677, backlog,
+			num > 1);
+		if (workers[x].sock < 0 ||
+			sock_set_nonblocking(workers[x].sock) != MACSSH_SUCCESS)
+			macssh_exit("Could not listen", errno);
+	}
+
+	if (argv_options.pin_cpu)
+		server_assign_cpus(workers, num);
+
+	macssh_info("Server running %d workers\n", num);
+
+	/* Worker 0 runs on the calling thread */
+	for (x = 1; x < num; x++)
+		if (pthread_create(&workers[x].thread, NULL,
+			&server_worker_run, &workers[x]))
+			macssh_exit("Could not start worker", errno);
+
+	server_worker_run(&workers[0]);
+
+	for (x = 1; x < num; x++)
+		pthread_join(workers[x].thread, NULL);
+
+	for (x = 0; x < num; x++)
+		close(workers[x].sock);
+
+	free(workers);
 }
 
 int write_packet(struct packet *pck)
 {
 	int len = 0;
 
-	len = send(ses.sock_out, pck->data + pck->wr_pos,
+	packet_mac_flush();
+
+	len = send(ses->sock_out, pck->data + pck->wr_pos,
 		pck->len - pck->wr_pos, 0);
 
 	return len;
 }
 
-/* Read the first 8 bytes, or cipher block-size, whichever is larger,
- * of a pending packet */
-static int read_packet_init(struct packet *pck)
+/*
+ * Move buffered bytes into the packet being received, decrypting and
+ * macing them on the way. Returns the packet once complete and
+ * verified, NULL when the ring ran dry first.
+ */
+static struct packet* read_packet_frame(void)
 {
-	pck->len += read(ses.sock_in, pck->data + pck->len, 8);
+	struct packet_rx *rx = &ses->rx_pck;
+	unsigned char block[PACKET_MAX_BLOCK];
+	struct packet *pck;
+	unsigned int first;
 
-	macssh_info("%u", pck->len);
+	/*
+	 * The length block stays in the ring until all of it is in,
+	 * the packet is sized from the length it holds.
+	 */
+	if (!rx->pck) {
+		first = packet_first_len();
+		if (ringbuf_len(&ses->rx_buf) < first)
+			return NULL;
 
-	if (pck->len == 8)
-		macssh_info("Successfully read first 8 bytes");
-	else if (pck->len == 0)
-		macssh_warn("Connection closed by remote host");
-	else
-		macssh_err("try_read_packet");
-}
+		ringbuf_get(&ses->rx_buf, block, first);
 
-/* Read packet. If the whole packet cant be read,
- * the read content is placed in a temporary packet. */
-struct packet* read_packet(void)
-{
-	struct packet *pck;
+		if (packet_rx_start(rx, block) != MACSSH_SUCCESS)
+			goto bad;
+	}
 
-	(ses.pck_tmp == NULL) ?
-		(pck = packet_new(2048)) : (pck = ses.pck_tmp);
+	pck = rx->pck;
 
-	read_packet_init(pck);
+	while (pck->len < rx->total && ringbuf_len(&ses->rx_buf)) {
+		pck->len += ringbuf_get(&ses->rx_buf, pck->data + pck->len,
+			rx->total - pck->len);
 
-	if (pck->len < 8) {
-		(ses.pck_tmp == NULL) ? (ses.pck_tmp = pck) :
-			macssh_exit("Could not read packet in 2 tries", -1);
-		return NULL;
+		if (packet_rx_update(rx) != MACSSH_SUCCESS)
+			goto bad;
 	}
 
-	macssh_print_array(pck->data, pck->len);
+	if (pck->len != rx->total)
+		return NULL;
 
-	/* We have enough info to determine the length of the packet */
-	int pck_len, pck_pad, pck_pay_len;
-	pck_len = pck->get_int(pck);
-	pck_pad = pck->get_byte(pck);
-	pck_pay_len = (pck_len - pck_pad - 1);
-	pck_len += 4; // -uint32 and mac length
+	if (packet_rx_finish(rx) != MACSSH_SUCCESS)
+		goto bad;
 
-	pck->len += read(ses.sock_out, pck->data + pck->len, (pck_len - 8));
+	rx->pck = NULL;
+	rx->total = 0;
 
-	if (pck->len != pck_len) {
-		ses.pck_tmp = pck;
-		return NULL;
-	}
+	return pck;
+bad:
+	/* Nothing after a bad packet can be trusted, the session is over */
+	macssh_warn("Corrupted packet");
+	ses->state = DEADBEEF;
 
-	/* We have the whole packet. Place it in ingoing buffer*/
-	//ses.buf_in->buf_add(ses.buf_in, pck);
+	return NULL;
+}
+
+/*
+ * Read a packet. The socket is read into the receive ring, as much as
+ * it has, and packets are framed from there, so a burst of packets
+ * costs a single read(). The socket is only read when the ring holds
+ * no complete packet. Returns NULL when the socket has nothing more
+ * for now; the partial packet is picked up on the next call.
+ */
+struct packet* read_packet(void)
+{
+	struct packet *pck;
+	ssize_t len;
+
+	while (!(pck = read_packet_frame())) {
+		if (ses->state == DEADBEEF)
+			return NULL;
+
+		len = ringbuf_read_fd(&ses->rx_buf, ses->sock_in);
+		if (len == 0) {
+			macssh_warn("Connection closed by remote host");
+			ses->state = DEADBEEF;
+			return NULL;
+		}
+
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR) {
+				macssh_err("read_packet");
+				ses->state = DEADBEEF;
+			}
+
+			return NULL;
+		}
+	}
 
 	macssh_print_embedded_string(pck->data, pck->len);
 
@@ -235,7 +916,7 @@ void process_packet()
 {
 	struct packet *pck;
 
-	pck = ses.buf_in->buf_get(ses.buf_in);
+	pck = ses->buf_in->buf_get(ses->buf_in);
 }
 
 /* 
@@ -246,78 +927,130 @@ void identify()
 {
 	struct packet *loc_id_pck = packet_new(64);
 
-	loc_id_pck->put_str(loc_id_pck, IDENTIFICATION_STRING);
+	packet_put_str(loc_id_pck, IDENTIFICATION_STRING);
 
-	loc_id_pck->wr_pos = ses.write_packet(loc_id_pck);
+	loc_id_pck->wr_pos = ses->write_packet(loc_id_pck);
 
 	/* Check if entire packet has been transmitted */
 	if (loc_id_pck->wr_pos != loc_id_pck->len) {
 		/* Enqueue the packet for retransmission */
-		ses.buf_out->buf_add(ses.buf_out, loc_id_pck);
+		if (ses->buf_out->buf_add(ses->buf_out, loc_id_pck) !=
+			MACSSH_SUCCESS)
+			macssh_exit("Send queue full", -1);
 
 		fprintf(stderr, "%u out of %u was transmitted\n",
 			loc_id_pck->wr_pos, loc_id_pck->len);
+	} else {
+		packet_free(loc_id_pck);
 	}
 
 	read_identification_string();
 
 	if (errno == EWOULDBLOCK || errno == EAGAIN)
 		macssh_exit("failed in identify()", errno);
-
-	free(loc_id_pck);
 }
 
-void read_identification_string()
+int session_parse_identification()
 {
-	struct packet *pck;
-	pck = packet_new(2048);
+	char line[sizeof(ses->remote_id)];
+	unsigned int len;
 
-	pck->len = read(ses.sock_in, pck->data, 2048);
-
-	macssh_print_array(pck->data, pck->len);
-	macssh_print_embedded_string(pck->data, pck->len);
+	len = ringbuf_peek(&ses->rx_buf, line, sizeof(line));
 
-	/* 
-	 * We might receive the KEX_INIT immediatelly after the,
-	 * identification (eg. debugging).
-	 */
 	int x;
-	for (x = 0; x < pck->len; x++) {
-		if ((*(pck->data + x) == '\r') &&
-			(*(pck->data + x + 1) == '\n')) {
-			strncpy(ses.remote_id, pck->data, x);
-			pck->rd_pos += (x + 2);
-			break;
-		}
+	for (x = 0; x + 1 < len; x++) {
+		if (line[x] == '\r' && line[x + 1] == '\n') {
+			memcpy(ses->remote_id, line, x);
+			ses->remote_id[x] = '\0';
+			ringbuf_consume(&ses->rx_buf, x + 2);
 
-	}
+			ses->state = IDENTIFIED;
 
-	if (x + 2 == pck->len) {
-		free(pck);
-		ses.state = IDENTIFIED;
-	} else {
-		macssh_info("Seems like serverside has sent id string,"
-			" and kexinit immediately after each other");
+			macssh_info("Found identification string: %s\n",
+				ses->remote_id);
 
-		ses.state = HAVE_KEX_INIT;
-		ses.pck_tmp = pck;
+			return 1;
+		}
 	}
 
-	macssh_info("Found identification string: %s\n",
-		ses.remote_id);
+	if (len == sizeof(line))
+		return MACSSH_FAILURE;
+
+	return 0;
+}
+
+void read_identification_string()
+{
+	int ret;
+
+	/*
+	 * The id string is read into the receive ring like any other
+	 * data, whatever follows it (eg. KEX_INIT) is left there for
+	 * read_packet().
+	 */
+	while (!(ret = session_parse_identification()))
+		if (ringbuf_read_fd(&ses->rx_buf, ses->sock_in) <= 0)
+			macssh_exit("Could not read identification string",
+				errno);
+
+	if (ret < 0)
+		macssh_exit("Identification string too long", -1);
+}
+
+struct session* session_new(void)
+{
+	struct session *s = calloc(1, sizeof(struct session));
+
+	if (!s)
+		return NULL;
+
+	session_init(s);
+
+	return s;
 }
 
 void session_init(struct session *ses)
 {
 	ses->session_id = 1;
 
+	ses->sock_in = -1;
+	ses->sock_out = -1;
+
 	ses->rx = 0;
 	ses->tx = 0;
 
+	/*
+	 * Packet pool must be ready before the first packet_new()
+	 */
+	ses->pool = malloc(sizeof(struct packet_pool));
+	pool_init(ses->pool);
+
 	ses->buf_in = buf_new();
 	ses->buf_out = buf_new();
+	if (!ses->buf_in || !ses->buf_out)
+		macssh_exit("Could not allocate packet queues", -1);
+
+	if (ringbuf_init(&ses->rx_buf, SESSION_RX_BUF) != MACSSH_SUCCESS)
+		macssh_exit("Could not allocate receive buffer", -1);
+
+	ses->rx_pck.pck = NULL;
+	ses->rx_pck.total = 0;
+
+	ses->sndq_high = argv_options.sndq_high ?
+		argv_options.sndq_high : SESSION_SNDQ_HIGH;
+	ses->sndq_low = argv_options.sndq_low ?
+		argv_options.sndq_low : SESSION_SNDQ_LOW;
 
-	ses->pck_tmp = NULL;
+	/* The hard bound of the queue leaves room for one more packet */
+	ses->sndq_high = MIN(ses->sndq_high, BUF_MAX_BYTES - PACKET_MAX_SIZE);
+	if (ses->sndq_low >= ses->sndq_high)
+		ses->sndq_low = ses->sndq_high / 2;
+
+	ses->sndq_blocked = 0;
+
+	ses->loop = NULL;
+	ses->stdin_open = 0;
+	ses->tx_inflight = 0;
 
 	ses->crypto = calloc(1, sizeof(struct crypto));
 
@@ -345,8 +1078,42 @@ void session_free(struct session *ses)
 	buf_free(ses->buf_in);
 	buf_free(ses->buf_out);
 
-	packet_free(ses->pck_tmp);
+	ringbuf_free(&ses->rx_buf);
+	packet_free(ses->rx_pck.pck);
+	ses->rx_pck.pck = NULL;
+
+	if (argv_options.debug) {
+		cipher_print_stats(ses->crypto->cipher_out, "out");
+		cipher_print_stats(ses->crypto->cipher_in, "in");
+		mac_print_stats(ses->crypto->mac_out, "out");
+		mac_print_stats(ses->crypto->mac_in, "in");
+		pool_print_stats(ses->pool);
+	}
 
-	close(ses->sock_in);
-	close(ses->sock_out);
+	cipher_free(ses->crypto->cipher_out);
+	cipher_free(ses->crypto->cipher_in);
+	mac_free(ses->crypto->mac_out);
+	mac_free(ses->crypto->mac_in);
+	ses->mac_pending_num = 0;
+
+	pool_destroy(ses->pool);
+	free(ses->pool);
+	ses->pool = NULL;
+
+	mp_clear_multi(&ses->dh->pub_key, &ses->dh->priv_key, &ses->dh->dh_k,
+		&ses->dh->dh_f, &ses->dh->key.e, &ses->dh->key.n, NULL);
+	free(ses->dh->init_local);
+	free(ses->dh->init_remote);
+	free(ses->dh->host_key);
+	free(ses->dh);
+	free(ses->crypto);
+	free(ses->channels);
+
+	/* Usually one socket both ways, closed once */
+	if (ses->sock_out >= 0 && ses->sock_out != ses->sock_in)
+		close(ses->sock_out);
+	if (ses->sock_in >= 0)
+		close(ses->sock_in);
+
+	free(ses);
 }
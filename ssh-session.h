@@ -25,18 +25,77 @@
 #include "crypto.h"
 #include "ssh-channel.h"
 #include "ssh-packet.h"
+#include "pool.h"
+#include "ringbuf.h"
 
 #define IDENTIFICATION_STRING "SSH-2.0-" SSH_VERSION_STR "\r\n"
 
+/* Packets gathered per writev() when flushing the send queue */
+#define SESSION_IOV_MAX		64
+
+/*
+ * Default send queue watermarks. Channels are not read above the high
+ * mark, until the queue drains below the low mark.
+ */
+#define SESSION_SNDQ_HIGH	(1 << 20)
+#define SESSION_SNDQ_LOW	(1 << 18)
+
+/* The same for the number of queued packets, small ones fill it first */
+#define SESSION_SNDQ_PACKETS_HIGH	(BUF_MAX_PACKETS * 3 / 4)
+#define SESSION_SNDQ_PACKETS_LOW	(BUF_MAX_PACKETS / 4)
+
+/* Channel input left unread, no room in the send queue */
+#define SESSION_SNDQ_FULL	-2
+
+/*
+ * Receive ring, the most one read() can take in. Sized for the many
+ * sessions of a server, still well above the largest packet.
+ */
+#define SESSION_RX_BUF		(1 << 16)
+
+/* Server connections, and the time a client has to finish its handshake */
+#define SERVER_MAX_SESSIONS	8192
+#define SERVER_GRACE_MS		(120 * 1000)
+
+/* Listen backlog of each server worker when not given */
+#define SERVER_BACKLOG		1024
+
+/* Upper bound on server worker threads */
+#define SERVER_MAX_WORKERS	256
+
 struct session;
+struct ev_loop;
+struct ev_timer;
+
+/*
+ * One server event loop thread. Workers share nothing but the port,
+ * each accepts on its own SO_REUSEPORT socket into its own table.
+ */
+struct server_worker {
+	pthread_t thread;
+	int id;
+	int cpu;		/* -1 when not pinned */
+	int sock;
+	struct ev_loop *loop;
+
+	struct list_head sessions;
+	unsigned int num;
+};
 
-void session_free();
+struct session* session_new(void);
+void session_free(struct session *ses);
 void session_init(struct session *ses);
 void client_session_loop();
 void server_session_loop();
 void identify();
 void read_identification_string();
 
+/*
+ * Take the remote id string off the receive ring. 1 once found, 0 when
+ * more input is needed, MACSSH_FAILURE for garbage.
+ */
+int session_parse_identification();
+
 enum {
 	DEADBEEF	= -1,
 	NONE		= 0,
@@ -52,6 +111,14 @@ struct session {
 	
 	int session_id;
 
+	/*
+	 * Exchange hash of the first kex (RFC 4253 section 7.2)
+	 */
+	unsigned char sess_id[MAX_HASH_SIZE];
+	unsigned int sess_id_len;
+
+	int is_server;
+
 	int state;
 
 	int sock_in;
@@ -61,24 +128,56 @@ struct session {
 	int tx;
 	
 	char remote_id[256];
+
+	/* Name and port connected to, for per host caches */
+	char remote_host[256];
+	int remote_port;
 	
 	/* 
 	 * Number of kex'es (initial + renegotiation) 
 	 */
 	int kex_num;
+
+	/*
+	 * KEX guessing, RFC 4253 section 7.1. Client: what our KEXINIT put
+	 * first, and whether KEXDH_INIT went out right behind it. Both
+	 * ends: whether the first choices of both sides agree, and if the
+	 * next packet is the remote's wrong guess, to be dropped.
+	 */
+	struct algorithm *guess_kex;
+	struct algorithm *guess_host;
+	int kex_guessed;
+	int kex_guess_ok;
+	int kex_discard;
 	
 	struct crypto *crypto;
+
+	/*
+	 * Packet sequence numbers, never reset, wrap at 2^32
+	 */
+	uint32_t seq_in;
+	uint32_t seq_out;
+
+	/*
+	 * Outgoing encrypt-then-mac packets still waiting for their
+	 * mac. Batched up to PACKET_MAC_BATCH, flushed before sending.
+	 */
+	struct packet *mac_pending[PACKET_MAC_BATCH];
+	unsigned int mac_pending_num;
 	
 	struct diffie_hellman *dh;
 
 	struct channel *channels;
 
-	/* 
-	 * Partial read packet. Might be incomplete
-	 * after a read. Is put in ingoing buffer if
-	 * complete. 
+	/*
+	 * Bytes read from the socket, not yet framed into packets
 	 */
-	struct packet *pck_tmp;
+	struct ringbuf rx_buf;
+
+	/*
+	 * Packet being received, decrypted as it arrives
+	 */
+	struct packet_rx rx_pck;
 	
 	int packet_flag;
         
@@ -87,6 +186,31 @@ struct session {
 	struct buffer *buf_in;
 	struct buffer *buf_out;
 
+	/*
+	 * Backpressure on the channel readers, with hysteresis
+	 * between the two watermarks of buf_out
+	 */
+	size_t sndq_high;
+	size_t sndq_low;
+	int sndq_blocked;
+
+	/*
+	 * Event loop driving the session after the handshake
+	 */
+	struct ev_loop *loop;
+	int stdin_open;
+
+	/* io_uring sends submitted and not yet completed */
+	int tx_inflight;
+
+	/* The last writev() came up short, waiting for EV_WRITE */
+	int tx_full;
+
+	/*
+	 * Recycled packets, shared by both directions
+	 */
+	struct packet_pool *pool;
+
 	/*
 	 * Some packet handlers
 	 */
@@ -101,7 +225,22 @@ struct session {
 	/* KEX */
 	void (*kex_init)();
 
-} ses;
+	/*
+	 * Server: entry in the connection table, and the handshake
+	 * deadline
+	 */
+	struct list_head list;
+	struct ev_timer *grace;
+	struct server_worker *worker;
+
+};
+
+/*
+ * The session being worked on. A client has just the one, a server
+ * points it at each connection while handling its events. Per thread,
+ * every server worker has its own.
+ */
+extern __thread struct session *ses;
 
 #endif /* SSH_SESSION_H */
 
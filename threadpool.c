@@ -0,0 +1,226 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "threadpool.h"
+#include "random.h"
+#include "dbg.h"
+
+/* Pop the newest job of our own deque, it is the most likely cached */
+static struct work* threadpool_pop(struct threadpool_thread *t)
+{
+	struct work *work = NULL;
+
+	pthread_mutex_lock(&t->lock);
+	if (!list_empty(&t->deque)) {
+		work = list_entry(t->deque.prev, struct work, list);
+		list_del(&work->list);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return work;
+}
+
+/* Take the oldest job of another thread's deque */
+static struct work* threadpool_steal(struct threadpool_thread *t)
+{
+	struct threadpool *pool = t->pool;
+	struct threadpool_thread *victim;
+	struct work *work = NULL;
+
+	int x;
+	for (x = 1; x < pool->num && !work; x++) {
+		victim = &pool->threads[(t->id + x) % pool->num];
+
+		pthread_mutex_lock(&victim->lock);
+		if (!list_empty(&victim->deque)) {
+			work = list_entry(victim->deque.next, struct work, list);
+			list_del(&work->list);
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	return work;
+}
+
+static void* threadpool_run(void *arg)
+{
+	struct threadpool_thread *t = arg;
+	struct threadpool *pool = t->pool;
+	struct work *work;
+	ev_post_cb done;
+	int stolen;
+
+	/* Jobs may draw from the prng, which is per thread */
+	seedrandom();
+
+	for (;;) {
+		stolen = 0;
+		work = threadpool_pop(t);
+		if (!work && (work = threadpool_steal(t)))
+			stolen = 1;
+
+		pthread_mutex_lock(&pool->lock);
+		if (work) {
+			pool->queued--;
+			pool->jobs++;
+			pool->steals += stolen;
+		} else {
+			while (!pool->queued && !pool->stop) {
+				pool->idle++;
+				pthread_cond_wait(&pool->cond, &pool->lock);
+				pool->idle--;
+			}
+
+			if (!pool->queued && pool->stop) {
+				pthread_mutex_unlock(&pool->lock);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!work)
+			continue;
+
+		/* 'run' may free a job that has no 'done' */
+		done = work->done;
+
+		work->run(work);
+
+		if (!done)
+			continue;
+
+		/* The job is the loop's from here on, hands off */
+		work->post.cb = done;
+		work->post.arg = work->arg;
+		if (ev_post(work->loop, &work->post) != MACSSH_SUCCESS)
+			macssh_warn("Could not post job completion");
+	}
+
+	return NULL;
+}
+
+struct threadpool* threadpool_new(int num)
+{
+	struct threadpool *pool;
+
+	if (num < 1 || num > THREADPOOL_MAX_THREADS)
+		return NULL;
+
+	pool = calloc(1, sizeof(struct threadpool));
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(num, sizeof(struct threadpool_thread));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	int x;
+	for (x = 0; x < num; x++) {
+		pool->threads[x].pool = pool;
+		pool->threads[x].id = x;
+		pthread_mutex_init(&pool->threads[x].lock, NULL);
+		INIT_LIST_HEAD(&pool->threads[x].deque);
+	}
+
+	/* Threads steal over the whole array, set it up before any runs */
+	for (x = 0; x < num; x++) {
+		if (pthread_create(&pool->threads[x].thread, NULL,
+			&threadpool_run, &pool->threads[x]))
+			break;
+		pool->num++;
+	}
+
+	if (pool->num != num) {
+		threadpool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void threadpool_free(struct threadpool *pool)
+{
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	int x;
+	for (x = 0; x < pool->num; x++)
+		pthread_join(pool->threads[x].thread, NULL);
+
+	for (x = 0; x < pool->num; x++)
+		pthread_mutex_destroy(&pool->threads[x].lock);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Jobs are dealt round robin, a thread left idle by short jobs steals
+ * from the ones stuck behind long ones.
+ */
+int threadpool_submit(struct threadpool *pool, struct work *work)
+{
+	struct threadpool_thread *t;
+
+	if (!work->run || (work->done && !work->loop))
+		return MACSSH_FAILURE;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->stop) {
+		pthread_mutex_unlock(&pool->lock);
+		return MACSSH_FAILURE;
+	}
+
+	t = &pool->threads[pool->next++ % pool->num];
+
+	pthread_mutex_lock(&t->lock);
+	list_add_tail(&work->list, &t->deque);
+	pthread_mutex_unlock(&t->lock);
+
+	pool->queued++;
+	if (pool->idle)
+		pthread_cond_signal(&pool->cond);
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return MACSSH_SUCCESS;
+}
+
+void threadpool_print_stats(struct threadpool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	macssh_info("threadpool: %d threads, %llu jobs, %llu stolen",
+		pool->num, pool->jobs, pool->steals);
+	pthread_mutex_unlock(&pool->lock);
+}
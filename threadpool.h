@@ -0,0 +1,91 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "includes.h"
+#include "list.h"
+#include "event.h"
+
+/* Upper bound on pool threads */
+#define THREADPOOL_MAX_THREADS	256
+
+struct work;
+
+typedef void (*work_fn)(struct work *work);
+
+/*
+ * A job, embedded by the caller. 'run' is called on a pool thread,
+ * then 'done' on the thread of 'loop', through ev_post(). Nothing but
+ * what the job owns may be touched from 'run'. Without 'done' the job
+ * is finished once 'run' returns, and the pool does not touch it after
+ * 'run' was called; the job may be freed by then.
+ */
+struct work {
+	work_fn run;
+	ev_post_cb done;
+	struct ev_loop *loop;
+	void *arg;
+
+	struct ev_post post;
+	struct list_head list;
+};
+
+/* One thread and its deque, the owner works the tail, thieves the head */
+struct threadpool_thread {
+	pthread_t thread;
+	struct threadpool *pool;
+	int id;
+
+	pthread_mutex_t lock;
+	struct list_head deque;
+};
+
+struct threadpool {
+	struct threadpool_thread *threads;
+	int num;
+
+	/* Jobs queued, not yet taken, and threads waiting for one */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int queued;
+	int idle;
+	int stop;
+
+	/* Thread the next job is dealt to */
+	unsigned int next;
+
+	/* Jobs taken from another thread's deque, for the stats */
+	unsigned long long steals;
+	unsigned long long jobs;
+};
+
+/* Start 'num' threads, each seeded for the per thread prng */
+struct threadpool* threadpool_new(int num);
+
+/* Finish the queued jobs, then stop and free */
+void threadpool_free(struct threadpool *pool);
+
+/* Queue a job, from any thread. Its 'done' is posted to work->loop. */
+int threadpool_submit(struct threadpool *pool, struct work *work);
+
+void threadpool_print_stats(struct threadpool *pool);
+
+#endif /* THREADPOOL_H */
@@ -0,0 +1,443 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "umac.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UMAC_SIMD
+#include <immintrin.h>
+#endif
+
+#define UMAC_P36	0x0000000FFFFFFFFBULL
+#define UMAC_P64	0xFFFFFFFFFFFFFFC5ULL
+#define UMAC_P64_OFFSET	59
+#define UMAC_MAXWORD	0xFFFFFFFF00000000ULL
+
+#define LOAD32L(p) ((uint32_t) (p)[0] | ((uint32_t) (p)[1] << 8) | \
+	((uint32_t) (p)[2] << 16) | ((uint32_t) (p)[3] << 24))
+
+static int umac_aes_setup(struct umac_aes *aes, const unsigned char *key)
+{
+	static const unsigned char zero[16];
+
+	if (aesni_available()) {
+		aes->aesni = 1;
+		return aesni_ctr_init(&aes->key.ni, key, 16, zero);
+	}
+
+	aes->aesni = 0;
+
+	if (register_cipher(&aes_desc) < 0 ||
+		aes_desc.setup(key, 16, 0, &aes->key.ltc) != CRYPT_OK)
+		return MACSSH_FAILURE;
+
+	return MACSSH_SUCCESS;
+}
+
+static void umac_aes_encrypt(struct umac_aes *aes, const unsigned char *in,
+	unsigned char *out)
+{
+	if (aes->aesni)
+		aesni_encrypt_block(&aes->key.ni, in, out);
+	else
+		aes_desc.ecb_encrypt(in, out, &aes->key.ltc);
+}
+
+/* KDF(K, index, len): AES of index || counter, both 64 bit */
+static void umac_kdf(struct umac_aes *aes, int index, unsigned char *out,
+	unsigned int len)
+{
+	unsigned char in[16];
+	unsigned char blk[16];
+	unsigned int ctr;
+
+	memset(in, 0, sizeof(in));
+	in[7] = index;
+
+	for (ctr = 1; len > 0; ctr++) {
+		unsigned int num = MIN(len, 16);
+
+		STORE32H(ctr, in + 12);
+		umac_aes_encrypt(aes, in, blk);
+
+		memcpy(out, blk, num);
+		out += num;
+		len -= num;
+	}
+
+	memset(blk, 0, sizeof(blk));
+}
+
+int umac_init(struct umac_ctx *ctx, const unsigned char *key, int len)
+{
+	unsigned char buf[UMAC_NH_BYTES + 16 * (UMAC_MAX_ITERS - 1)];
+	struct umac_aes aes;
+	int x, y;
+
+	if (len != 8 && len != 16)
+		return MACSSH_FAILURE;
+
+	memset(ctx, 0, sizeof(struct umac_ctx));
+	ctx->iters = len / 4;
+
+	if (umac_aes_setup(&aes, key) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	/* Pad key */
+	umac_kdf(&aes, 0, buf, 16);
+	if (umac_aes_setup(&ctx->pdf_key, buf) != MACSSH_SUCCESS)
+		return MACSSH_FAILURE;
+
+	/* L1 key, big-endian words */
+	umac_kdf(&aes, 1, buf, UMAC_NH_BYTES + 16 * (ctx->iters - 1));
+	for (x = 0; x < UMAC_NH_BYTES / 4 + 4 * (ctx->iters - 1); x++)
+		LOAD32H(ctx->nh_key[x], buf + 4 * x);
+
+	/* L2 key, only the 64 bit part of each 24 bytes */
+	umac_kdf(&aes, 2, buf, 24 * ctx->iters);
+	for (x = 0; x < ctx->iters; x++) {
+		LOAD64H(ctx->poly_key[x], buf + 24 * x);
+		ctx->poly_key[x] &= 0x01FFFFFF01FFFFFFULL;
+	}
+
+	/*
+	 * L3 key. The input to L3 is a 64 bit value zero extended to
+	 * 128, so only the last four of its eight words take part.
+	 */
+	umac_kdf(&aes, 3, buf, 64 * ctx->iters);
+	for (x = 0; x < ctx->iters; x++) {
+		for (y = 0; y < 4; y++) {
+			LOAD64H(ctx->l3_key[x][y], buf + 64 * x + 32 + 8 * y);
+			ctx->l3_key[x][y] %= UMAC_P36;
+		}
+	}
+
+	umac_kdf(&aes, 4, buf, 4 * ctx->iters);
+	for (x = 0; x < ctx->iters; x++)
+		LOAD32H(ctx->l3_xor[x], buf + 4 * x);
+
+	memset(buf, 0, sizeof(buf));
+	memset(&aes, 0, sizeof(aes));
+
+	return MACSSH_SUCCESS;
+}
+
+/*
+ * NH over 'len' bytes, a multiple of 32, for every iteration at
+ * once. Message words are little-endian, and word j is paired with
+ * word j + 4 of each 32 byte group.
+ */
+static void umac_nh_ref(const uint32_t *key, const unsigned char *m,
+	unsigned int len, int iters, uint64_t *acc)
+{
+	unsigned int x;
+	int t, j;
+
+	for (x = 0; x < len / 4; x += 8) {
+		uint32_t w[8];
+
+		for (j = 0; j < 8; j++)
+			w[j] = LOAD32L(m + 4 * (x + j));
+
+		for (t = 0; t < iters; t++) {
+			const uint32_t *k = key + x + 4 * t;
+
+			for (j = 0; j < 4; j++)
+				acc[t] += (uint64_t) (uint32_t) (w[j] + k[j]) *
+					(uint32_t) (w[j + 4] + k[j + 4]);
+		}
+	}
+}
+
+#ifdef UMAC_SIMD
+
+/* Two products per register, the odd lanes are shifted down */
+__attribute__((target("sse2")))
+static void umac_nh_sse2(const uint32_t *key, const unsigned char *m,
+	unsigned int len, int iters, uint64_t *acc)
+{
+	__m128i sum[UMAC_MAX_ITERS];
+	unsigned int x;
+	int t;
+
+	for (t = 0; t < iters; t++)
+		sum[t] = _mm_setzero_si128();
+
+	for (x = 0; x < len / 4; x += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) (m + 4 * x));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (m + 4 * x + 16));
+
+		for (t = 0; t < iters; t++) {
+			const uint32_t *k = key + x + 4 * t;
+			__m128i a, b;
+
+			a = _mm_add_epi32(lo,
+				_mm_loadu_si128((const __m128i *) k));
+			b = _mm_add_epi32(hi,
+				_mm_loadu_si128((const __m128i *) (k + 4)));
+
+			sum[t] = _mm_add_epi64(sum[t], _mm_mul_epu32(a, b));
+			sum[t] = _mm_add_epi64(sum[t],
+				_mm_mul_epu32(_mm_srli_epi64(a, 32),
+				_mm_srli_epi64(b, 32)));
+		}
+	}
+
+	for (t = 0; t < iters; t++) {
+		uint64_t s[2];
+
+		_mm_storeu_si128((__m128i *) s, sum[t]);
+		acc[t] += s[0] + s[1];
+	}
+}
+
+/*
+ * Iterations t and t + 1 share a register. Their keys are four words
+ * apart, so one unaligned load covers both halves.
+ */
+__attribute__((target("avx2")))
+static void umac_nh_avx2(const uint32_t *key, const unsigned char *m,
+	unsigned int len, int iters, uint64_t *acc)
+{
+	__m256i sum[UMAC_MAX_ITERS / 2];
+	unsigned int x;
+	int t;
+
+	for (t = 0; t < iters / 2; t++)
+		sum[t] = _mm256_setzero_si256();
+
+	for (x = 0; x < len / 4; x += 8) {
+		__m256i lo = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) (m + 4 * x)));
+		__m256i hi = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) (m + 4 * x + 16)));
+
+		for (t = 0; t < iters / 2; t++) {
+			const uint32_t *k = key + x + 8 * t;
+			__m256i a, b;
+
+			a = _mm256_add_epi32(lo,
+				_mm256_loadu_si256((const __m256i *) k));
+			b = _mm256_add_epi32(hi,
+				_mm256_loadu_si256((const __m256i *) (k + 4)));
+
+			sum[t] = _mm256_add_epi64(sum[t],
+				_mm256_mul_epu32(a, b));
+			sum[t] = _mm256_add_epi64(sum[t],
+				_mm256_mul_epu32(_mm256_srli_epi64(a, 32),
+				_mm256_srli_epi64(b, 32)));
+		}
+	}
+
+	for (t = 0; t < iters / 2; t++) {
+		uint64_t s[4];
+
+		_mm256_storeu_si256((__m256i *) s, sum[t]);
+		acc[2 * t] += s[0] + s[1];
+		acc[2 * t + 1] += s[2] + s[3];
+	}
+}
+
+static int umac_simd_level()
+{
+	static int level = -1;
+
+	if (level < 0) {
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2"))
+			level = 2;
+		else if (__builtin_cpu_supports("sse2"))
+			level = 1;
+		else
+			level = 0;
+	}
+
+	return level;
+}
+
+#endif /* UMAC_SIMD */
+
+static void umac_nh(const uint32_t *key, const unsigned char *m,
+	unsigned int len, int iters, uint64_t *acc)
+{
+#ifdef UMAC_SIMD
+	switch (umac_simd_level()) {
+	case 2:
+		umac_nh_avx2(key, m, len, iters, acc);
+		return;
+	case 1:
+		umac_nh_sse2(key, m, len, iters, acc);
+		return;
+	}
+#endif
+	umac_nh_ref(key, m, len, iters, acc);
+}
+
+/* (k * y + m) mod 2^64 - 59 */
+static uint64_t umac_poly_step(uint64_t k, uint64_t y, uint64_t m)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128) k * y + m;
+
+	while (r >> 64)
+		r = (r >> 64) * UMAC_P64_OFFSET + (uint64_t) r;
+#else
+	uint64_t r_lo, r_hi, t;
+	uint64_t a0 = k & 0xffffffff, a1 = k >> 32;
+	uint64_t b0 = y & 0xffffffff, b1 = y >> 32;
+	uint64_t mid;
+
+	/* 64 x 64 -> 128 in 32 bit halves */
+	r_lo = a0 * b0;
+	mid = a0 * b1 + (r_lo >> 32);
+	r_hi = a1 * b1 + (mid >> 32);
+	mid = (mid & 0xffffffff) + a1 * b0;
+	r_hi += mid >> 32;
+	r_lo = (mid << 32) | (r_lo & 0xffffffff);
+
+	r_lo += m;
+	r_hi += (r_lo < m);
+
+	/* Fold 2^64 = 59 until the high half is gone */
+	while (r_hi) {
+		uint64_t a = (r_hi & 0xffffffff) * UMAC_P64_OFFSET;
+		uint64_t b = (r_hi >> 32) * UMAC_P64_OFFSET;
+
+		t = b << 32;
+		r_hi = (b >> 32);
+		t += a;
+		r_hi += (t < a);
+		r_lo += t;
+		r_hi += (r_lo < t);
+	}
+
+	uint64_t r = r_lo;
+#endif
+	if ((uint64_t) r >= UMAC_P64)
+		r -= UMAC_P64;
+
+	return (uint64_t) r;
+}
+
+static uint64_t umac_poly(uint64_t k, uint64_t y, uint64_t m)
+{
+	/* Words too big for the field are escaped by a marker */
+	if (m >= UMAC_MAXWORD) {
+		y = umac_poly_step(k, y, UMAC_P64 - 1);
+		return umac_poly_step(k, y, m - UMAC_P64_OFFSET);
+	}
+
+	return umac_poly_step(k, y, m);
+}
+
+/* Inner product of the 16 bit words of 'y' with the key, mod 2^36 - 5 */
+static uint32_t umac_l3(struct umac_ctx *ctx, int t, uint64_t y)
+{
+	uint64_t r = 0;
+
+	int x;
+	for (x = 0; x < 4; x++)
+		r += ((y >> (48 - 16 * x)) & 0xffff) * ctx->l3_key[t][x];
+
+	return (uint32_t) (r % UMAC_P36) ^ ctx->l3_xor[t];
+}
+
+/* PDF, the pad is cached per nonce */
+static void umac_pdf(struct umac_ctx *ctx, const unsigned char *nonce,
+	unsigned char *pad)
+{
+	unsigned char blk[16];
+	int idx = 0;
+
+	memset(blk, 0, sizeof(blk));
+	memcpy(blk, nonce, UMAC_NONCE_LEN);
+
+	/* UMAC-64 uses the low bit to pick a half of the block */
+	if (ctx->iters == 2) {
+		idx = blk[UMAC_NONCE_LEN - 1] & 1;
+		blk[UMAC_NONCE_LEN - 1] &= ~1;
+	}
+
+	if (!ctx->pdf_valid || memcmp(blk, ctx->pdf_nonce, 16)) {
+		memcpy(ctx->pdf_nonce, blk, 16);
+		umac_aes_encrypt(&ctx->pdf_key, blk, ctx->pdf_cache);
+		ctx->pdf_valid = 1;
+	}
+
+	memcpy(pad, ctx->pdf_cache + 8 * idx, 4 * ctx->iters);
+}
+
+int umac_compute(struct umac_ctx *ctx, const unsigned char *nonce,
+	const unsigned char *data, unsigned int len, unsigned char *tag)
+{
+	unsigned char buf[32] __attribute__((aligned(32)));
+	uint64_t poly[UMAC_MAX_ITERS];
+	uint64_t nh[UMAC_MAX_ITERS];
+	unsigned char pad[16];
+	unsigned int done = 0, num, full;
+	int t;
+
+	if (len > UMAC_MAX_LEN)
+		return MACSSH_FAILURE;
+
+	for (t = 0; t < ctx->iters; t++)
+		poly[t] = 1;
+
+	/* An empty message still hashes one zero padded group */
+	do {
+		num = MIN(len - done, UMAC_NH_BYTES);
+		full = num & ~31U;
+
+		memset(nh, 0, sizeof(nh));
+		umac_nh(ctx->nh_key, data + done, full, ctx->iters, nh);
+
+		if (num > full || num == 0) {
+			memset(buf, 0, sizeof(buf));
+			memcpy(buf, data + done + full, num - full);
+			umac_nh(ctx->nh_key + full / 4, buf, sizeof(buf),
+				ctx->iters, nh);
+		}
+
+		for (t = 0; t < ctx->iters; t++) {
+			nh[t] += (uint64_t) num * 8;
+
+			if (len > UMAC_NH_BYTES)
+				poly[t] = umac_poly(ctx->poly_key[t], poly[t],
+					nh[t]);
+			else
+				poly[t] = nh[t];
+		}
+
+		done += num;
+	} while (done < len);
+
+	umac_pdf(ctx, nonce, pad);
+
+	for (t = 0; t < ctx->iters; t++) {
+		uint32_t v = umac_l3(ctx, t, poly[t]);
+		uint32_t p;
+
+		LOAD32H(p, pad + 4 * t);
+		STORE32H(v ^ p, tag + 4 * t);
+	}
+
+	return MACSSH_SUCCESS;
+}
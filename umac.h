@@ -0,0 +1,78 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UMAC_H
+#define UMAC_H
+
+#include "includes.h"
+#include "aesni.h"
+
+/* UMAC, RFC 4418, as used by umac-64 and umac-128@openssh.com */
+#define UMAC_KEY_LEN		16
+#define UMAC_NONCE_LEN		8
+#define UMAC_NH_BYTES		1024
+
+/* One iteration per 32 bits of tag */
+#define UMAC_MAX_ITERS		4
+
+/*
+ * Only the 64 bit polynomial of the second layer is implemented,
+ * which covers messages up to 2^24 bytes.
+ */
+#define UMAC_MAX_LEN		(1 << 24)
+
+/* AES-128, on AES-NI when present */
+struct umac_aes {
+	int aesni;
+	union {
+		struct aesni_ctx ni;
+		symmetric_key ltc;
+	} key;
+};
+
+struct umac_ctx {
+	int iters;
+
+	/* L1 key as native words, shifted by four words per iteration */
+	uint32_t nh_key[UMAC_NH_BYTES / 4 + 4 * (UMAC_MAX_ITERS - 1)]
+		__attribute__((aligned(32)));
+
+	/* L2 and L3 keys */
+	uint64_t poly_key[UMAC_MAX_ITERS];
+	uint64_t l3_key[UMAC_MAX_ITERS][4];
+	uint32_t l3_xor[UMAC_MAX_ITERS];
+
+	/*
+	 * Pad generation. UMAC-64 uses one half of an AES block per
+	 * nonce, so two sequence numbers in a row share an encryption.
+	 */
+	struct umac_aes pdf_key;
+	unsigned char pdf_nonce[16];
+	unsigned char pdf_cache[16];
+	int pdf_valid;
+};
+
+/* 'len' is the tag length, 8 or 16 bytes */
+int umac_init(struct umac_ctx *ctx, const unsigned char *key, int len);
+
+/* Tag of 'data' under 'nonce', written to 'tag' */
+int umac_compute(struct umac_ctx *ctx, const unsigned char *nonce,
+	const unsigned char *data, unsigned int len, unsigned char *tag);
+
+#endif /* UMAC_H */
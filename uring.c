@@ -0,0 +1,263 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "includes.h"
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+	unsigned int min_complete, unsigned int flags, void *arg, size_t sz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, arg, sz);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg,
+	unsigned int num)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, num);
+}
+
+static int uring_map(struct uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array +
+		p->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size =
+			MAX(ring->sq_ring_size, ring->cq_ring_size);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return MACSSH_FAILURE;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			return MACSSH_FAILURE;
+	}
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return MACSSH_FAILURE;
+
+	ring->sq_head = (unsigned int *) ((char *) ring->sq_ring +
+		p->sq_off.head);
+	ring->sq_tail = (unsigned int *) ((char *) ring->sq_ring +
+		p->sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((char *) ring->sq_ring +
+		p->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((char *) ring->sq_ring +
+		p->sq_off.array);
+
+	ring->cq_head = (unsigned int *) ((char *) ring->cq_ring +
+		p->cq_off.head);
+	ring->cq_tail = (unsigned int *) ((char *) ring->cq_ring +
+		p->cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((char *) ring->cq_ring +
+		p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring +
+		p->cq_off.cqes);
+
+	return MACSSH_SUCCESS;
+}
+
+/* Register the provided buffer ring, and hand it every buffer */
+static int uring_setup_bufs(struct uring *ring, unsigned int buf_num,
+	unsigned int buf_size)
+{
+	struct io_uring_buf_reg reg;
+	size_t br_size = buf_num * sizeof(struct io_uring_buf);
+
+	/* The kernel indexes the ring with a mask */
+	if (!buf_num || (buf_num & (buf_num - 1)) || buf_num > 32768)
+		return MACSSH_FAILURE;
+
+	if (posix_memalign((void **) &ring->br, sysconf(_SC_PAGESIZE),
+		br_size))
+		return MACSSH_FAILURE;
+
+	memset(ring->br, 0, br_size);
+
+	ring->bufs = malloc((size_t) buf_num * buf_size);
+	if (!ring->bufs)
+		return MACSSH_FAILURE;
+
+	ring->buf_num = buf_num;
+	ring->buf_size = buf_size;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) ring->br;
+	reg.ring_entries = buf_num;
+	reg.bgid = URING_BGID;
+
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return MACSSH_FAILURE;
+
+	unsigned int x;
+	for (x = 0; x < buf_num; x++)
+		uring_buf_recycle(ring, x);
+
+	return MACSSH_SUCCESS;
+}
+
+int uring_init(struct uring *ring, unsigned int entries,
+	unsigned int buf_num, unsigned int buf_size)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return MACSSH_FAILURE;
+
+	/* The wait timeout is passed to io_uring_enter() directly */
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	if (uring_map(ring, &p) != MACSSH_SUCCESS)
+		goto fail;
+
+	if (uring_setup_bufs(ring, buf_num, buf_size) != MACSSH_SUCCESS)
+		goto fail;
+
+	return MACSSH_SUCCESS;
+fail:
+	uring_free(ring);
+	return MACSSH_FAILURE;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+		ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+
+	/* Closing the ring drops the buffer registration with it */
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring->br);
+	free(ring->bufs);
+
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring->sq_tail;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	/* Full, make room without waiting for anything */
+	if (tail - head > *ring->sq_mask) {
+		if (uring_submit_wait(ring, 0, 0) < 0)
+			return NULL;
+
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head > *ring->sq_mask)
+			return NULL;
+	}
+
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->sq_pending++;
+
+	return sqe;
+}
+
+int uring_submit_wait(struct uring *ring, unsigned int wait, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	int ret;
+
+	if (wait)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+		arg.ts = (unsigned long) &ts;
+	}
+
+	ring->enters++;
+
+	ret = uring_enter(ring->fd, ring->sq_pending, wait, flags, &arg,
+		sizeof(arg));
+	if (ret < 0) {
+		/* Timing out is not an error, nor is a signal */
+		if (errno == ETIME || errno == EINTR)
+			return 0;
+
+		return MACSSH_FAILURE;
+	}
+
+	ring->sq_pending -= MIN((unsigned int) ret, ring->sq_pending);
+
+	return ret;
+}
+
+void uring_buf_recycle(struct uring *ring, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring->br->bufs[ring->br_tail & (ring->buf_num - 1)];
+	buf->addr = (unsigned long) uring_buf(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_URING */
@@ -0,0 +1,120 @@
+/*
+    This file is part of macSSH
+    
+    Copyright 2016 Daniel Machon
+
+    SSH program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "includes.h"
+
+#if defined(__linux__)
+#define HAVE_URING
+#endif
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring, on the raw syscalls. Submission and completion
+ * rings are shared with the kernel; a provided buffer ring feeds the
+ * multishot receives.
+ */
+struct uring {
+	int fd;
+
+	/* Submission ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/* SQEs filled in, not yet handed to the kernel */
+	unsigned int sq_pending;
+
+	/* Completion ring, may share the mapping with the submission ring */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffers, group URING_BGID */
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	unsigned int buf_num;
+	unsigned int buf_size;
+	unsigned short br_tail;
+
+	/* io_uring_enter() calls, for the stats */
+	unsigned long long enters;
+};
+
+#define URING_BGID	0
+
+/*
+ * Set up a ring of 'entries' SQEs, with 'buf_num' provided buffers of
+ * 'buf_size' bytes. Fails on kernels without buffer rings (5.19) or
+ * extended wait arguments.
+ */
+int uring_init(struct uring *ring, unsigned int entries,
+	unsigned int buf_num, unsigned int buf_size);
+void uring_free(struct uring *ring);
+
+/* Next free SQE, zeroed, or NULL if the ring is full even after a submit */
+struct io_uring_sqe* uring_get_sqe(struct uring *ring);
+
+/*
+ * Submit everything pending, and wait for at least 'wait' completions
+ * or until 'timeout_ms' (-1 for none) passed. One syscall.
+ */
+int uring_submit_wait(struct uring *ring, unsigned int wait, int timeout_ms);
+
+/* Oldest unseen completion, NULL when none */
+static inline struct io_uring_cqe* uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Address of provided buffer 'bid' */
+static inline unsigned char* uring_buf(struct uring *ring, unsigned int bid)
+{
+	return ring->bufs + (size_t) bid * ring->buf_size;
+}
+
+/* Give buffer 'bid' back to the kernel once its data is consumed */
+void uring_buf_recycle(struct uring *ring, unsigned int bid);
+
+#endif /* HAVE_URING */
+
+#endif /* URING_H */
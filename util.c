@@ -17,92 +17,313 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <time.h>
+
 #include "includes.h"
 #include "util.h"
 #include "ssh-session.h"
+#include "dns.h"
+#include "dbg.h"
+
+static unsigned long long util_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Answer to the lookup of connect_to_remote_host() */
+struct connect_resolve {
+	struct dns_result res;
+	struct ev_timer *timer;
+	int answered;
+};
+
+static void connect_resolved_cb(struct ev_loop *loop,
+	const struct dns_result *res, void *arg)
+{
+	struct connect_resolve *cr = arg;
+
+	cr->res = *res;
+	cr->answered = 1;
+
+	ev_timer_del(loop, cr->timer);
+	cr->timer = NULL;
+
+	ev_stop(loop);
+}
+
+static void connect_resolve_timeout_cb(struct ev_loop *loop, void *arg)
+{
+	struct connect_resolve *cr = arg;
+
+	/* The loop frees a timer once it fired */
+	cr->timer = NULL;
+
+	ev_stop(loop);
+}
+
+/*
+ * Resolve 'host' on 'loop', through the process wide cache. The loop
+ * runs until the answer is in or 'timeout_ms' passed, the lookup
+ * itself is on the resolver threads.
+ */
+static int connect_resolve(struct ev_loop *loop, const char *host,
+	int timeout_ms, struct dns_result *res)
+{
+	struct connect_resolve *cr;
+
+	cr = calloc(1, sizeof(struct connect_resolve));
+	if (!cr)
+		return MACSSH_FAILURE;
+
+	if (dns_lookup(loop, host, &connect_resolved_cb, cr) !=
+		MACSSH_SUCCESS) {
+		free(cr);
+		res->err = EAI_FAIL;
+		res->num = 0;
+		return MACSSH_FAILURE;
+	}
 
-#define h_addr h_addr_list[0]
+	/* A cached answer is in already */
+	if (!cr->answered) {
+		cr->timer = ev_timer_add(loop, timeout_ms,
+			&connect_resolve_timeout_cb, cr);
+		if (!cr->timer || ev_run(loop) != MACSSH_SUCCESS ||
+			!cr->answered) {
+			/* A late answer still lands in 'cr', left to it */
+			ev_timer_del(loop, cr->timer);
+			res->err = EAI_AGAIN;
+			res->num = 0;
+			return MACSSH_FAILURE;
+		}
+	}
 
-int init_tcp_socket(char* ip, int port, int t_out);
-int init_tcp_listen_socket(int port); 
+	*res = cr->res;
+	free(cr);
 
-int connect_to_remote_host()
+	return res->err ? MACSSH_FAILURE : MACSSH_SUCCESS;
+}
+
+int connect_to_remote_host(struct ev_loop *loop)
 {
+	const char *host = argv_options.server_addr[0] ?
+		argv_options.server_addr : CONNECT_DEFAULT_HOST;
+	int port = argv_options.server_port > 0 ?
+		argv_options.server_port : CONNECT_DEFAULT_PORT;
+	int timeout = argv_options.connect_timeout > 0 ?
+		argv_options.connect_timeout : CONNECT_TIMEOUT_MS;
+	unsigned long long start = util_now();
+	struct dns_result res;
 	int sock;
-	sock = init_tcp_socket("194.255.39.141", 6666, 0);
+
+	if (connect_resolve(loop, host, timeout, &res) != MACSSH_SUCCESS) {
+		macssh_warn("Could not resolve %s: %s", host,
+			gai_strerror(res.err));
+		return -1;
+	}
+
+	/* The lookup counts against the timeout */
+	timeout -= MIN(util_now() - start, timeout - 1);
+
+	sock = tcp_connect(&res, port, timeout);
 
 	if(sock < 0)
 		return -1;
 	else
-		ses.sock_out = ses.sock_in = sock;
+		ses->sock_out = ses->sock_in = sock;
+
+	snprintf(ses->remote_host, sizeof(ses->remote_host), "%s", host);
+	ses->remote_port = port;
 	
 	return 0;
 }
 
-int init_tcp_socket(char *ip, int port, int t_out)
+/* Non-blocking socket with a connect in progress, or -1 */
+static int tcp_connect_start(const struct dns_addr *a, int port)
 {
-	/* Needs to be declared outside while loop */
+	struct sockaddr_storage addr;
 	int sock;
 
-	struct hostent *host;
-	struct sockaddr_in server_addr;
-	struct timeval rcv_timeval;
-	struct timeval snd_timeval;
+	memcpy(&addr, &a->addr, a->len);
+	if (a->family == AF_INET6)
+		((struct sockaddr_in6 *) &addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *) &addr)->sin_port = htons(port);
 
-	/* TextSpeak IP Address is defined as 192.168.0.23 */
-	host = gethostbyname(ip);
+	sock = socket(a->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		0);
+	if (sock < 0)
+		return -1;
 
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if (connect(sock, (struct sockaddr *) &addr, a->len) < 0 &&
+		errno != EINPROGRESS) {
+		close(sock);
 		return -1;
+	}
 
+	return sock;
+}
+
+/*
+ * Connect to one of the resolved addresses, racing them in the manner
+ * of RFC 8305 (Happy Eyeballs): a new attempt starts every
+ * CONNECT_ATTEMPT_DELAY_MS, or at once when one fails, and the first
+ * to connect wins. The socket comes back blocking.
+ */
+int tcp_connect(const struct dns_result *res, int port, int timeout_ms)
+{
+	struct pollfd pfds[DNS_MAX_ADDRS];
+	unsigned long long now, next, deadline;
+	int started = 0, active = 0;
+	int sock = -1, last_err = EHOSTUNREACH;
+	int ret;
+
+	now = util_now();
+	next = now;
+	deadline = now + timeout_ms;
+
+	while (sock < 0) {
+		now = util_now();
+		if (now >= deadline) {
+			last_err = ETIMEDOUT;
+			break;
+		}
+
+		if (started < res->num && (now >= next || !active)) {
+			ret = tcp_connect_start(&res->addrs[started++], port);
+			next = now + CONNECT_ATTEMPT_DELAY_MS;
+
+			if (ret >= 0) {
+				pfds[active].fd = ret;
+				pfds[active].events = POLLOUT;
+				active++;
+			} else {
+				last_err = errno;
+			}
+			continue;
+		}
 
-	/* Set TCP socket options */
-	if (t_out) {
-		rcv_timeval.tv_sec = t_out;
-		rcv_timeval.tv_usec = 0;
-		snd_timeval.tv_sec = t_out;
-		snd_timeval.tv_usec = 0;
+		/* Every address tried and failed */
+		if (!active)
+			break;
 
-		int buffersize = 2;
-		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &rcv_timeval, sizeof(struct timeval));
-		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &snd_timeval, sizeof(struct timeval));
-		//setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffersize, 4);
+		ret = deadline - now;
+		if (started < res->num && next - now < ret)
+			ret = next - now;
+
+		ret = poll(pfds, active, ret);
+		if (ret < 0 && errno != EINTR) {
+			last_err = errno;
+			break;
+		}
+
+		int x;
+		for (x = 0; ret > 0 && x < active; ) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+
+			if (!pfds[x].revents) {
+				x++;
+				continue;
+			}
+
+			if (getsockopt(pfds[x].fd, SOL_SOCKET, SO_ERROR, &err,
+				&len) < 0)
+				err = errno;
+
+			if (!err && sock < 0) {
+				sock = pfds[x].fd;
+			} else {
+				close(pfds[x].fd);
+				last_err = err;
+				/* A failed attempt doesn't hold up the next */
+				next = now;
+			}
+
+			pfds[x] = pfds[--active];
+		}
 	}
 
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(port);
-	server_addr.sin_addr = *((struct in_addr *) host->h_addr);
-	bzero(&(server_addr.sin_zero), 8);
+	/* The losers */
+	while (active)
+		close(pfds[--active].fd);
+
+	if (sock < 0) {
+		errno = last_err;
+		return -1;
+	}
 
-	if (connect(sock, (struct sockaddr *) &server_addr, sizeof(struct sockaddr)) < 0)
+	if (sock_set_blocking(sock) != MACSSH_SUCCESS) {
+		close(sock);
 		return -1;
+	}
 
 	return sock;
 }
 
-int init_tcp_listen_socket(int port)
+/*
+ * With reuseport every caller gets its own socket on the same port,
+ * and the kernel spreads incoming connections over them.
+ */
+int init_tcp_listen_socket(int port, int backlog, int reuseport)
 {
 	int sock;
+	int on = 1;
 
-	struct hostent *host;
 	struct sockaddr_in si_me;
-	struct timeval rcv_timeval;
-	struct timeval snd_timeval;
 
 	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
 		return -1;
 
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on,
+		sizeof(on)) < 0)
+		goto fail;
+
+	memset(&si_me, 0, sizeof(si_me));
 	si_me.sin_family = AF_INET;
 	si_me.sin_port = htons(port);
 	si_me.sin_addr.s_addr = htonl(INADDR_ANY);
 
 	if (bind(sock, (struct sockaddr*) &si_me, sizeof(si_me)) == -1)
-		return -1;
-        
-        listen(sock, 5);
+		goto fail;
 
+	if (listen(sock, backlog) < 0)
+		goto fail;
 
 	return sock;
+fail:
+	close(sock);
+	return -1;
+}
+
+static int sock_set_flag(int fd, int flag, int on)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0)
+		return MACSSH_FAILURE;
+
+	flags = on ? (flags | flag) : (flags & ~flag);
+
+	if (fcntl(fd, F_SETFL, flags) < 0)
+		return MACSSH_FAILURE;
+
+	return MACSSH_SUCCESS;
+}
+
+int sock_set_blocking(int fd)
+{
+	return sock_set_flag(fd, O_NONBLOCK, 0);
+}
+
+int sock_set_nonblocking(int fd)
+{
+	return sock_set_flag(fd, O_NONBLOCK, 1);
 }
 
 void get_ip(struct in_addr *addr, char *ip)
@@ -20,9 +20,21 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-int connect_to_remote_host();
-void sock_set_blocking();
-void sock_set_nonblocking();
+#include "dns.h"
+
+/* Remote end when none is given */
+#define CONNECT_DEFAULT_HOST	"194.255.39.141"
+#define CONNECT_DEFAULT_PORT	6666
+
+/* Whole connection setup, and the stagger between attempts (RFC 8305) */
+#define CONNECT_TIMEOUT_MS		(10 * 1000)
+#define CONNECT_ATTEMPT_DELAY_MS	250
+
+int connect_to_remote_host(struct ev_loop *loop);
+int tcp_connect(const struct dns_result *res, int port, int timeout_ms);
+int sock_set_blocking(int fd);
+int sock_set_nonblocking(int fd);
+int init_tcp_listen_socket(int port, int backlog, int reuseport);
 
 #endif /* UTIL_H */
 